@@ -8,7 +8,9 @@
 #include "ringbuf.h"
 #include "codec.h"
 #include "faac.h"
+#include "trace.h"
 #include "utils.h"
+#include "worker.h"
 
 typedef struct {
     CODEC_COMMON_MEMBERS
@@ -17,45 +19,97 @@ typedef struct {
     unsigned long outbufsize;
     unsigned long aaccfgsize;
     uint8_t      *aaccfgptr;
-    pthread_t     thread;
+    pthread_t     thread;   // only when not running on the worker pool
+    int           samprate;
+    int           channels;
+    int64_t       anchor;   // capture time of the pcm at head when it was anchored
+    int64_t       consumed; // samples per channel encoded since anchor, pts comes from sample counts, not clocks
+    int         (*basewritebuf)(void *c, uint8_t *buf, int len);
 } AACENC;
 
-static void* encode_thread_proc(void *param)
+#define AACENC_RESYNC_US 100000 // capture time further off the sample count than this is a gap in pcm, anchor again
+
+static int64_t pcm_us(AACENC *enc, int bytes)
 {
-    AACENC  *enc = (AACENC*)param;
-    uint8_t  buffer[8192];
-    uint32_t size, type, pts;
+    return (int64_t)bytes / (int)sizeof(int16_t) / enc->channels * 1000000 / enc->samprate;
+}
 
-    while (!(enc->flags & CODEC_FLAG_EXIT)) {
-        if (!(enc->flags & CODEC_FLAG_START)) { usleep(100*1000); continue; }
+static int aacenc_encode(AACENC *enc, int wait) // encode one frame of pcm, return 1 if there was one, the encode thread waits for it
+{
+    uint8_t  buffer[8192];
+    int      size = 0, got;
+    int64_t  pts = 0;
+    uint64_t t;
 
-        pthread_mutex_lock(&enc->mutex);
-        while (enc->cursize < (int)(enc->insamples * sizeof(int16_t)) && !(enc->flags & CODEC_FLAG_EXIT)) pthread_cond_wait(&enc->cond, &enc->mutex);
-        if (!(enc->flags & CODEC_FLAG_EXIT)) {
-            size = faacEncEncode(enc->faacenc, (int32_t*)(enc->buff + enc->head), enc->insamples, buffer, sizeof(buffer));
-            type = CODEC_FOURCC('A', 0, 0, 0);
-            pts  = get_tick_count();
-            enc->head   += enc->insamples * sizeof(int16_t);
-            enc->cursize-= enc->insamples * sizeof(int16_t);
-            if (enc->cursize < (int)(enc->insamples * sizeof(int16_t))) {
-                memmove(enc->buff, enc->buff + enc->head, enc->cursize);
-                enc->head = 0; enc->tail = enc->cursize;
-            }
+    codec_lock(enc); // codec_start, writebuf and free all signal cond
+    while (wait && (enc->cursize < (int)(enc->insamples * sizeof(int16_t)) || !(enc->flags & CODEC_FLAG_START)) && !(enc->flags & CODEC_FLAG_EXIT)) pthread_cond_wait(&enc->cond, &enc->mutex);
+    if ((got = enc->cursize >= (int)(enc->insamples * sizeof(int16_t)) && (enc->flags & CODEC_FLAG_START) && !(enc->flags & CODEC_FLAG_EXIT))) {
+        pts  = enc->anchor + enc->consumed * 1000000 / enc->samprate;
+        t    = get_time_us();
+        size = faacEncEncode(enc->faacenc, (int32_t*)(enc->buff + enc->head), enc->insamples, buffer, sizeof(buffer)); // never into next's ring, a full one may block and writeraw waits on this mutex
+        codec_stat_encode(enc, (uint32_t)(get_time_us() - t));
+        if (size > 0) codec_stat_out(enc, 1, size);
+        if (g_trace_enabled && size > 0) { // the frame is captured once its last sample is
+            trace_stamp('A', pts, TRACE_CAPTURE     , pts + pcm_us(enc, enc->insamples * sizeof(int16_t)));
+            trace_stamp('A', pts, TRACE_ENCODE_START, t);
+            trace_stamp('A', pts, TRACE_ENCODE_END  , get_time_us());
+        }
+        enc->head   += enc->insamples * sizeof(int16_t);
+        enc->cursize-= enc->insamples * sizeof(int16_t);
+        enc->consumed+= enc->insamples / enc->channels;
+        if (enc->cursize < (int)(enc->insamples * sizeof(int16_t))) {
+            memmove(enc->buff, enc->buff + enc->head, enc->cursize);
+            enc->head = 0; enc->tail = enc->cursize;
         }
-        pthread_mutex_unlock(&enc->mutex);
-        if ((int32_t)size > 0) codec_writeframe(enc->next, buffer, size, type, pts);
     }
+    pthread_mutex_unlock(&enc->mutex);
+    if (got && size > 0) codec_writeframe(enc->next, buffer, size, CODEC_FOURCC('A', 0, 0, 0), pts); // pcm is consumed, a blocked ring holds up only this thread
+    return got;
+}
+
+static void* encode_thread_proc(void *param)
+{
+    AACENC *enc = (AACENC*)param;
+    while (!(enc->flags & CODEC_FLAG_EXIT)) aacenc_encode(enc, 1);
     return NULL;
 }
 
-static void aacenc_free(void *ctxt)
+static int encode_task_run(void *ctxt)
+{
+    return aacenc_encode((AACENC*)ctxt, 0);
+}
+
+static int aacenc_writeraw(void *ctxt, uint8_t *buf, int len, int64_t pts)
 {
     AACENC *enc = (AACENC*)ctxt;
-    pthread_mutex_lock(&enc->mutex);
-    enc->flags |= CODEC_FLAG_EXIT;
-    pthread_cond_signal(&enc->cond);
+    int64_t queued;
+    if (!pts) pts = get_time_us() - pcm_us(enc, len); // just captured, so its first sample is len ago
+    codec_lock(enc); // the encode thread only moves consumed along with cursize
+    queued = enc->anchor + enc->consumed * 1000000 / enc->samprate + pcm_us(enc, enc->cursize); // where the pcm written now starts by sample count
+    if (enc->anchor == 0 || pts - queued > AACENC_RESYNC_US || queued - pts > AACENC_RESYNC_US) {
+        enc->anchor   = pts - pcm_us(enc, enc->cursize);
+        enc->consumed = 0;
+    }
     pthread_mutex_unlock(&enc->mutex);
-    pthread_join(enc->thread, NULL);
+    return enc->basewritebuf(ctxt, buf, len);
+}
+
+static int aacenc_writebuf(void *ctxt, uint8_t *buf, int len)
+{
+    return aacenc_writeraw(ctxt, buf, len, 0);
+}
+
+static void aacenc_free(void *ctxt)
+{
+    AACENC *enc = (AACENC*)ctxt;
+    if (enc->readers[0].task) worker_del(enc->readers[0].task);
+    else {
+        pthread_mutex_lock(&enc->mutex);
+        enc->flags |= CODEC_FLAG_EXIT;
+        pthread_cond_signal(&enc->cond);
+        pthread_mutex_unlock(&enc->mutex);
+        pthread_join(enc->thread, NULL);
+    }
     pthread_mutex_destroy(&enc->mutex);
     pthread_cond_destroy (&enc->cond );
     if (enc->faacenc) faacEncClose(enc->faacenc);
@@ -69,6 +123,13 @@ void* aacenc_init(int bufsize, void *next, int bitrate, int samprate, int channe
     if (!enc) return NULL;
 
     enc->free    = aacenc_free;
+    enc->basewritebuf = enc->writebuf;
+    enc->writebuf     = aacenc_writebuf;
+    enc->writeraw     = aacenc_writeraw;
+    enc->samprate     = samprate;
+    enc->channels     = MAX(1, channels);
+    enc->reserve = NULL; // input is a pcm byte stream, not frames
+    enc->commit  = NULL;
     enc->faacenc = faacEncOpen((unsigned long)samprate, (unsigned int)channels, &enc->insamples, &enc->outbufsize);
     conf = faacEncGetCurrentConfiguration(enc->faacenc);
     conf->aacObjectType = LOW;
@@ -85,6 +146,7 @@ void* aacenc_init(int bufsize, void *next, int bitrate, int samprate, int channe
     faacEncGetDecoderSpecificInfo(enc->faacenc, &enc->aaccfgptr, &enc->aaccfgsize);
     memcpy(enc->aacinfo, enc->aaccfgptr, MIN(sizeof(enc->aacinfo), enc->aaccfgsize));
 
-    pthread_create(&enc->thread, NULL, encode_thread_proc, enc);
+    enc->readers[0].task = worker_add(encode_task_run, enc, WORKER_PRIO_HIGH); // audio frames are small and late audio is heard, ahead of video
+    if (!enc->readers[0].task) pthread_create(&enc->thread, NULL, encode_thread_proc, enc);
     return enc;
 }
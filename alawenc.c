@@ -7,12 +7,16 @@
 #include <errno.h>
 #include "ringbuf.h"
 #include "codec.h"
+#include "trace.h"
 #include "utils.h"
 
 typedef struct {
     CODEC_COMMON_MEMBERS
+    int64_t framepts; // capture time of the first sample of the frame being filled
 } ALAWENC;
 
+#define ALAW_SAMPLE_US 125 // g.711 is 8000 Hz mono
+
 static uint8_t pcm2alaw(int16_t pcm)
 {
     uint8_t sign = (pcm >> 8) & (1 << 7);
@@ -24,28 +28,46 @@ static uint8_t pcm2alaw(int16_t pcm)
     return (alaw ^ 0xd5);
 }
 
-static int alawenc_writebuf(void *ctxt, uint8_t *buf, int len)
+static int alawenc_writeraw(void *ctxt, uint8_t *buf, int len, int64_t pts)
 {
     ALAWENC  *enc = (ALAWENC*)ctxt;
     int   samples = len / sizeof(int16_t), n, i;
     uint8_t *pdst = enc->buff + enc->tail;
     int16_t *psrc = (int16_t*)buf;
+    uint64_t t    = get_time_us();
+    if (!pts) pts = t - (int64_t)samples * ALAW_SAMPLE_US; // just captured, so its first sample is len ago
     while (samples > 0) {
+        if (enc->tail == 0) enc->framepts = pts + (int64_t)(psrc - (int16_t*)buf) * ALAW_SAMPLE_US; // frames go by sample count from the capture time of this pcm
         n = MIN(samples, enc->maxsize - enc->tail);
         for (i=0; i<n; i++) *pdst++ = pcm2alaw(*psrc++);
         samples -= n; enc->tail += n;
         if (enc->tail == enc->maxsize) {
             enc->tail = 0; pdst = enc->buff;
-            codec_writeframe(enc->next, enc->buff, enc->maxsize, CODEC_FOURCC('A', 0, 0, 0), get_tick_count());
+            if (g_trace_enabled) { // encoded right in writebuf, frames wait for nothing
+                trace_stamp('A', enc->framepts, TRACE_CAPTURE     , t);
+                trace_stamp('A', enc->framepts, TRACE_ENCODE_START, t);
+                trace_stamp('A', enc->framepts, TRACE_ENCODE_END  , get_time_us());
+            }
+            codec_writeframe(enc->next, enc->buff, enc->maxsize, CODEC_FOURCC('A', 0, 0, 0), enc->framepts);
+            codec_stat_out(enc, 1, enc->maxsize);
         }
     }
+    codec_stat_in(enc, 0, len);
     return (uint8_t*)psrc - buf;
 }
 
+static int alawenc_writebuf(void *ctxt, uint8_t *buf, int len)
+{
+    return alawenc_writeraw(ctxt, buf, len, 0);
+}
+
 void* alawenc_init(int bufsize, void *next)
 {
     CODEC *codec = codec_init("alawenc", sizeof(ALAWENC), MAX(320, bufsize), next);
     if (!codec) return NULL;
     codec->writebuf = alawenc_writebuf;
+    codec->writeraw = alawenc_writeraw;
+    codec->reserve  = NULL;
+    codec->commit   = NULL;
     return codec;
 }
@@ -84,6 +84,7 @@ typedef struct {
     uint32_t      framesize_fix;
     uint32_t      framesize_idx;
     uint32_t      framesize_max;
+    int64_t       vpts_next; // dts the next video frame is due at, by frame rate
     FILE         *fp;
 
     char          riff[4];
@@ -268,7 +269,7 @@ void avimuxer_exit(void *ctx)
     }
 }
 
-void avimuxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts)
+void avimuxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts)
 {
     AVI_FILE *avi = (AVI_FILE*)ctx;
     if (avi && avi->fp) {
@@ -286,12 +287,25 @@ void avimuxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
     }
 }
 
-void avimuxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts)
+void avimuxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts, int64_t dts)
 {
     AVI_FILE *avi = (AVI_FILE*)ctx;
+    int64_t   period;
+    uint32_t  n, zero = 0;
     if (avi == NULL) return;
-    if (avi->fp) {
+    if (avi->fp) { // avi has no timestamps, frames missing by dts become empty chunks so video stays in sync with audio, b-frames are stored in decode order and players reorder them
         int len      =  len1 + len2;
+        period = 1000000 * (int64_t)avi->strhdr_video.scale / avi->strhdr_video.rate;
+        for (n=0; avi->vpts_next && dts - avi->vpts_next > period / 2 && n < avi->strhdr_video.rate; n++) {
+            fwrite("01dc", 4, 1, avi->fp);
+            fwrite(&zero , 4, 1, avi->fp);
+            if (avi->framesize_lst && avi->framesize_idx < avi->framesize_max) {
+                avi->framesize_lst[avi->framesize_idx++] = 0 | AVI_VIDEO_FRAME;
+            }
+            avi->strhdr_video.length++;
+            avi->vpts_next += period;
+        }
+        avi->vpts_next = (n == avi->strhdr_video.rate || !avi->vpts_next ? dts : avi->vpts_next) + period; // gaps over a second get a second of empty chunks and start over from this frame
         int alignlen = (len & 1) ? len + 1 : len;
         fwrite("01dc"   , 4, 1, avi->fp);
         fwrite(&alignlen, 4, 1, avi->fp);
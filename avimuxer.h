@@ -1,10 +1,12 @@
 #ifndef __AVIMUXER_H__
 #define __AVIMUXER_H__
 
+#include <stdint.h>
+
 void* avimuxer_init (char *file, int duration, int w, int h, int frate, int gop, int h265, int sampnum);
 void  avimuxer_exit (void *ctx);
-void  avimuxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts);
-void  avimuxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts);
+void  avimuxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts, int64_t dts); // pts is capture time in us, frames come in decode order, dts = pts without b-frames
+void  avimuxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts);
 
 #endif
 
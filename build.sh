@@ -2,4 +2,4 @@
 
 set -e
 
-gcc -Wall -static -Ilibfaac/include -Ilibx264/include utils.c ringbuf.c codec.c alawenc.c aacenc.c h264enc.c avimuxer.c mp4muxer.c recorder.c test.c -Llibfaac/lib -lfaac -Llibx264/lib -lx264 -lpthread -lm -o test
+gcc -Wall -static -Ilibfaac/include -Ilibx264/include utils.c trace.c ringbuf.c codec.c worker.c alawenc.c aacenc.c h264enc.c scaler.c convert.c osd.c avimuxer.c mp4muxer.c recorder.c recmgr.c test.c -Llibfaac/lib -lfaac -Llibx264/lib -lx264 -lpthread -lm -o test
@@ -7,41 +7,671 @@
 #include <errno.h>
 #include "ringbuf.h"
 #include "codec.h"
+#include "worker.h"
 #include "utils.h"
 
+typedef struct {
+    uint32_t size;
+    uint32_t type;
+    int64_t  pts;  // capture time in us
+    uint32_t room; // payload bytes the frame occupies in ring, may be larger than size for MPSC reservations
+    int32_t  delay;// pts - dts in us, b-frames come in decode order with a later pts than dts
+} FRAMEHDR;
+
+static THREAD_LOCAL struct { // the frame reserved by current thread and not committed yet
+    void    *codec;
+    uint32_t pos;
+    int      room;
+} s_resv;
+
+static struct { // memory locked frame rings borrow to absorb bursts, given back once they are idle
+    volatile int32_t total;
+    volatile int32_t used;
+    int              chunk;
+} s_budget = { 0, 0, 64 * 1024 };
+
+static void ring_free(CODEC *codec) // give back what the ring has borrowed, it uses its own memory from now on
+{
+    free(codec->oldbuf);
+    codec->oldbuf = NULL;
+    if (codec->buff == codec->basebuf) return;
+    ATOMIC_ADD(&s_budget.used, -(codec->maxsize - codec->basesize));
+    free(codec->buff);
+    codec->buff    = codec->basebuf;
+    codec->maxsize = codec->basesize;
+}
+
 static void base_codec_free(void *c)
 {
     CODEC *codec = (CODEC*)c;
     pthread_mutex_destroy(&codec->mutex);
     pthread_cond_destroy (&codec->cond );
+    if (codec->mode & CODEC_MODE_MIRROR) ringbuf_mirror_free(codec->buff, codec->maxsize);
+    else ring_free(codec);
+    free(codec->lfq.commit);
+    free(codec->index.off);
     free(codec);
 }
 
+static void timeout_to_timespec(struct timespec *ts, int timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec  += timeout / 1000; // whole seconds apart, timeout*1000*1000 overflows an int past 2147 ms
+    ts->tv_nsec += timeout % 1000 * 1000 * 1000;
+    ts->tv_sec  += ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+static void stat_max(uint32_t *max, uint32_t v) // racy but only ever misses a concurrent maximum
+{
+    if (v > *max) *max = v;
+}
+
+void codec_lock(void *c)
+{
+    CODEC   *codec = (CODEC*)c;
+    uint64_t t;
+    uint32_t us;
+    if (pthread_mutex_trylock(&codec->mutex) == 0) return; // uncontended, nothing to time
+    t  = get_time_us();
+    pthread_mutex_lock(&codec->mutex);
+    us = (uint32_t)(get_time_us() - t);
+    ATOMIC_ADD64(&codec->stats.lockwait_us, us);
+    stat_max(&codec->stats.lockwait_max, us);
+}
+
+void codec_stat_in(void *c, int frames, int bytes)
+{
+    CODEC *codec = (CODEC*)c;
+    ATOMIC_ADD  (&codec->stats.frames_in, frames);
+    ATOMIC_ADD64(&codec->stats.bytes_in , bytes );
+}
+
+void codec_stat_out(void *c, int frames, int bytes)
+{
+    CODEC *codec = (CODEC*)c;
+    ATOMIC_ADD  (&codec->stats.frames_out, frames);
+    ATOMIC_ADD64(&codec->stats.bytes_out , bytes );
+}
+
+void codec_stat_encode(void *c, uint32_t us)
+{
+    CODEC *codec = (CODEC*)c;
+    ATOMIC_ADD64(&codec->stats.encode_us, us);
+    stat_max(&codec->stats.encode_max, us);
+}
+
+// lock-free frame queue positions run in [0, maxsize * 2), so that a full ring and an empty ring can be told apart
+static int lfq_used(CODEC *codec, uint32_t head, uint32_t tail)
+{
+    int used = (int)tail - (int)head;
+    return used < 0 ? used + codec->maxsize * 2 : used;
+}
+
+static uint32_t lfq_advance(CODEC *codec, uint32_t pos, int n)
+{
+    pos += n;
+    return pos >= (uint32_t)codec->maxsize * 2 ? pos - codec->maxsize * 2 : pos;
+}
+
+static int lfq_offset(CODEC *codec, uint32_t pos)
+{
+    return pos >= (uint32_t)codec->maxsize ? pos - codec->maxsize : pos;
+}
+
+static int lfq_span(CODEC *codec, int len) // bytes a record of len occupies in the ring
+{
+    return (codec->mode & CODEC_MODE_MPSC) ? ALIGN(len, CODEC_LFQ_GRANULE) : len;
+}
+
+static int lfq_reserve(CODEC *codec, int span, int limit, uint32_t *pos) // producer side, the ring may only be filled up to limit
+{
+    CODEC_LFQ *q = &codec->lfq;
+    uint32_t   tail;
+    if (codec->mode & CODEC_MODE_MPSC) { // producers race for the tail, the winner owns [tail, tail + span)
+        tail = ATOMIC_LOAD(&q->tail);
+        do {
+            if (limit - lfq_used(codec, ATOMIC_LOAD(&q->head), tail) < span) return 0;
+        } while (!ATOMIC_CAS(&q->tail, &tail, lfq_advance(codec, tail, span)));
+        *pos = tail;
+        return 1;
+    }
+    if (limit - lfq_used(codec, q->hcache, q->tail) < span) {
+        q->hcache = ATOMIC_LOAD(&q->head);
+        if (limit - lfq_used(codec, q->hcache, q->tail) < span) return 0;
+    }
+    *pos = q->tail;
+    return 1;
+}
+
+static void lfq_commit(CODEC *codec, uint32_t pos, int span) // producer side
+{
+    CODEC_LFQ *q = &codec->lfq;
+    stat_max((uint32_t*)&codec->stats.highwater, lfq_used(codec, q->head, lfq_advance(codec, pos, span)));
+    if (codec->mode & CODEC_MODE_MPSC) ATOMIC_STORE(&q->commit[lfq_offset(codec, pos) / CODEC_LFQ_GRANULE], 1);
+    else ATOMIC_STORE(&q->tail, lfq_advance(codec, pos, span));
+    ATOMIC_FENCE(); // pairs with the fence in lfq_wait, only take the mutex if consumer is really parked
+    if (ATOMIC_LOAD(&q->parked)) {
+        pthread_mutex_lock(&codec->mutex);
+        pthread_cond_broadcast(&codec->cond); // blocked producers share the cond
+        pthread_mutex_unlock(&codec->mutex);
+    }
+    worker_kick(codec->readers[0].task);
+}
+
+static int lfq_avail(CODEC *codec, int need) // consumer side, return used size if need bytes are readable, otherwise 0
+{
+    CODEC_LFQ *q = &codec->lfq;
+    int used = lfq_used(codec, q->head, q->tcache);
+    if (used < need) used = lfq_used(codec, q->head, q->tcache = ATOMIC_LOAD(&q->tail));
+    if (used < need) return 0;
+    if ((codec->mode & CODEC_MODE_MPSC) && !ATOMIC_LOAD(&q->commit[lfq_offset(codec, q->head) / CODEC_LFQ_GRANULE])) return 0;
+    return used;
+}
+
+static int cond_wait(CODEC *codec, struct timespec *ts, int timeout) // mutex held, timeout < 0 waits forever
+{
+    return timeout < 0 ? pthread_cond_wait(&codec->cond, &codec->mutex) : pthread_cond_timedwait(&codec->cond, &codec->mutex, ts);
+}
+
+static int lfq_gethdr(CODEC *codec, FRAMEHDR *hdr) // consumer side, take the frame header off the queue, return payload offset
+{
+    CODEC_LFQ *q = &codec->lfq;
+    int head = ringbuf_read(codec->buff, codec->maxsize, lfq_offset(codec, q->head), (uint8_t*)hdr, sizeof(FRAMEHDR));
+    q->room  = hdr->room;
+    if (codec->mode & CODEC_MODE_MPSC) q->commit[lfq_offset(codec, q->head) / CODEC_LFQ_GRANULE] = 0;
+    ATOMIC_STORE(&q->head, lfq_advance(codec, q->head, sizeof(FRAMEHDR)));
+    return head;
+}
+
+static void lfq_freed(CODEC *codec) // consumer side, head moved on, wake producers parked in lfq_room
+{
+    ATOMIC_FENCE(); // pairs with the fence in lfq_room, only take the mutex if a producer is really parked
+    if (ATOMIC_LOAD(&codec->lfq.pparked)) {
+        pthread_mutex_lock(&codec->mutex);
+        pthread_cond_broadcast(&codec->cond);
+        pthread_mutex_unlock(&codec->mutex);
+    }
+}
+
+static void lfq_consume(CODEC *codec, int n) // consumer side
+{
+    CODEC_LFQ *q = &codec->lfq;
+    ATOMIC_STORE(&q->head, lfq_advance(codec, q->head, n));
+    lfq_freed(codec);
+}
+
+static void lfq_putframe(CODEC *codec) // consumer side, release the payload of the frame whose header was taken
+{
+    lfq_consume(codec, lfq_span(codec, sizeof(FRAMEHDR) + codec->lfq.room) - sizeof(FRAMEHDR));
+}
+
+static void lfq_clear(CODEC *codec) // consumer side, nothing locked, drop the frames queued before the latest CODEC_CONFIG_CLEAR_BUFF
+{
+    CODEC_LFQ *q   = &codec->lfq;
+    uint32_t   req = ATOMIC_LOAD(&q->clearreq), pos = ATOMIC_LOAD(&q->clearpos);
+    FRAMEHDR   hdr;
+    if (req == q->cleared) return;
+    q->tcache = ATOMIC_LOAD(&q->tail);
+    if (codec->mode & CODEC_MODE_MPSC) { // slots are freed frame by frame, a reservation still in flight stops it until the next wait
+        while (q->head != pos && lfq_used(codec, q->head, pos) <= lfq_used(codec, q->head, q->tcache)) {
+            if (!lfq_avail(codec, sizeof(hdr))) return;
+            lfq_gethdr(codec, &hdr);
+            lfq_putframe(codec);
+        }
+    } else if (lfq_used(codec, q->head, pos) <= lfq_used(codec, q->head, q->tcache)) { // unless it was read past already
+        ATOMIC_STORE(&q->head, pos);
+        lfq_freed(codec);
+    }
+    q->cleared = req;
+}
+
+static int lfq_wait(CODEC *codec, int need, int timeout) // consumer side
+{
+    CODEC_LFQ *q = &codec->lfq;
+    struct timespec ts;
+    int used, ret = 0;
+    lfq_clear(codec);
+    used = lfq_avail(codec, need);
+    if (used || !timeout) return used;
+
+    timeout_to_timespec(&ts, timeout);
+    pthread_mutex_lock(&codec->mutex);
+    while (ret != ETIMEDOUT && !(codec->wakemask & 1)) {
+        ATOMIC_STORE(&q->parked, 1);
+        ATOMIC_FENCE();
+        if ((used = lfq_avail(codec, need))) break;
+        ret = cond_wait(codec, &ts, timeout);
+    }
+    codec->wakemask &= ~1;
+    ATOMIC_STORE(&q->parked, 0);
+    pthread_mutex_unlock(&codec->mutex);
+    return used;
+}
+
+static void get_region(CODEC *codec, int off, int len, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2)
+{
+    int len1 = (codec->mode & CODEC_MODE_MIRROR) ? len : MIN(len, codec->maxsize - off % codec->maxsize);
+    if (ppbuf1) *ppbuf1 = codec->buff + off % codec->maxsize;
+    if (ppbuf2) *ppbuf2 = len1 < len ? codec->buff : NULL;
+    if (plen1 ) *plen1  = len1;
+    if (plen2 ) *plen2  = len - len1;
+}
+
+static int index_alloc(CODEC *codec) // mutex held, sized for frames of 1KB on average, never less than 256
+{
+    CODEC_INDEX *idx = &codec->index;
+    uint32_t     cap = 256;
+    if (idx->off) return 1;
+    while (cap < (uint32_t)codec->maxsize / 1024) cap *= 2;
+    idx->off = malloc(cap * (sizeof(uint32_t) * 3 + sizeof(int64_t)));
+    if (!idx->off) return 0;
+    idx->size  = idx->off  + cap;
+    idx->type  = idx->size + cap;
+    idx->pts   = (int64_t*)(idx->type + cap); // cap is a multiple of 2, stays 8 byte aligned
+    idx->cap   = cap;
+    idx->first = idx->last = 0;
+    idx->key   = (uint32_t)-1;
+    return 1;
+}
+
+static int index_bytes(CODEC *codec, uint32_t off) // bytes from a frame header to the tail
+{
+    int n = (codec->tail - (int)off + codec->maxsize) % codec->maxsize;
+    return n == 0 ? codec->maxsize : n;
+}
+
+static void index_trim(CODEC *codec) // mutex held, drop descriptors of the frames read or dropped
+{
+    CODEC_INDEX *idx = &codec->index;
+    while (idx->first != idx->last && (codec->cursize == 0 || index_bytes(codec, idx->off[idx->first & (idx->cap - 1)]) > codec->cursize)) idx->first++;
+}
+
+static int index_full(CODEC *codec)
+{
+    CODEC_INDEX *idx = &codec->index;
+    if (!idx->off) return 0;
+    index_trim(codec);
+    return idx->last - idx->first == idx->cap;
+}
+
+static void index_push(CODEC *codec, uint32_t off, FRAMEHDR *hdr) // mutex held, room was checked by index_full
+{
+    CODEC_INDEX *idx = &codec->index;
+    uint32_t     i   = idx->last & (idx->cap - 1);
+    if (!idx->off) return;
+    idx->off [i] = off;
+    idx->size[i] = hdr->size;
+    idx->type[i] = hdr->type;
+    idx->pts [i] = hdr->pts - hdr->delay; // decode time, it goes up in queue order even with b-frames
+    if (CODEC_IS_VIDEO_KEYFRAME(hdr->type)) idx->key = idx->last;
+    idx->last++;
+}
+
+static int index_get(CODEC *codec, uint32_t seq, CODEC_FRAMEINFO *info)
+{
+    CODEC_INDEX *idx = &codec->index;
+    uint32_t     i   = seq & (idx->cap - 1);
+    if (info) {
+        info->size  = idx->size[i];
+        info->type  = idx->type[i];
+        info->pts   = idx->pts [i];
+        info->bytes = index_bytes(codec, idx->off[i]);
+    }
+    return seq - idx->first;
+}
+
+static int ring_locked(CODEC *codec)
+{
+    int i;
+    for (i=0; i<CODEC_MAX_READERS; i++) {
+        if (codec->readers[i].locked) return 1;
+    }
+    return 0;
+}
+
+static int ring_resize(CODEC *codec, int size) // mutex held, move queued bytes to the start of a ring of new size
+{
+    uint8_t *buff = size == codec->basesize ? codec->basebuf : malloc(size);
+    int32_t  used, diff = (size - codec->basesize) - (codec->maxsize - codec->basesize);
+    uint32_t i;
+    if (diff > 0) { // take it from the budget first
+        used = ATOMIC_LOAD(&s_budget.used);
+        do {
+            if (used + diff > ATOMIC_LOAD(&s_budget.total)) { if (buff != codec->basebuf) free(buff); return 0; }
+        } while (!ATOMIC_CAS(&s_budget.used, &used, used + diff));
+    }
+    if (!buff) {
+        if (diff > 0) ATOMIC_ADD(&s_budget.used, -diff);
+        return 0;
+    }
+    if (codec->index.off) { // descriptors and readers keep their distance to the tail
+        index_trim(codec);
+        for (i=codec->index.first; i!=codec->index.last; i++) codec->index.off[i & (codec->index.cap - 1)] = codec->cursize - index_bytes(codec, codec->index.off[i & (codec->index.cap - 1)]);
+    }
+    for (i=0; i<CODEC_MAX_READERS; i++) {
+        if (codec->rmask & (1 << i)) codec->readers[i].pos = codec->cursize - codec->readers[i].used;
+    }
+    ringbuf_read(codec->buff, codec->maxsize, codec->head, buff, codec->cursize);
+    if (codec->buff != codec->basebuf) { // a frame locked by a reader may still point into the old ring
+        if (ring_locked(codec)) codec->oldbuf = codec->buff;
+        else free(codec->buff);
+    }
+    if (diff < 0) ATOMIC_ADD(&s_budget.used, diff);
+    codec->buff    = buff;
+    codec->maxsize = size;
+    codec->head    = 0;
+    codec->tail    = codec->cursize % size;
+    return 1;
+}
+
+static int ring_grow(CODEC *codec, int need) // mutex held, mirror and lock-free rings never move
+{
+    int more = need - (codec->maxsize - codec->cursize);
+    if (more <= 0 || !ATOMIC_LOAD(&s_budget.total) || codec->oldbuf || (codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC|CODEC_MODE_MIRROR))) return 0;
+    return ring_resize(codec, codec->maxsize + ALIGN(more, s_budget.chunk));
+}
+
+static void ring_shrink(CODEC *codec) // mutex held, give back half of what is borrowed after the ring stays below half full for 2s
+{
+    int size;
+    if (codec->oldbuf && !ring_locked(codec)) { free(codec->oldbuf); codec->oldbuf = NULL; }
+    if (codec->maxsize <= codec->basesize || ring_locked(codec)) return;
+    if (codec->cursize > codec->maxsize / 2) { codec->lowtick = 0; return; }
+    if (!codec->lowtick) { codec->lowtick = get_tick_count() | 1; return; }
+    if ((int32_t)(get_tick_count() - codec->lowtick) < 2000) return;
+    size = codec->basesize + (codec->maxsize - codec->basesize) / 2 / s_budget.chunk * s_budget.chunk;
+    if (codec->cursize <= size / 2 && ring_resize(codec, size)) codec->lowtick = 0;
+}
+
+static void bcast_reclaim(CODEC *codec) // ring space is held by the slowest reader
+{
+    int i;
+    for (codec->cursize=0,i=0; i<CODEC_MAX_READERS; i++) {
+        if (codec->rmask & (1 << i)) codec->cursize = MAX(codec->cursize, codec->readers[i].used);
+    }
+    codec->head = (codec->tail - codec->cursize + codec->maxsize) % codec->maxsize;
+}
+
+static void bcast_written(CODEC *codec, int n)
+{
+    int i;
+    for (i=0; i<CODEC_MAX_READERS; i++) {
+        if (codec->rmask & (1 << i)) {
+            codec->readers[i].used += n;
+            worker_kick(codec->readers[i].task);
+        }
+    }
+    bcast_reclaim(codec);
+    pthread_cond_broadcast(&codec->cond);
+}
+
+static int skip_gop(CODEC *codec, int *rpos, int *rused) // move a read position past the frames up to the next video key frame, return frames skipped
+{
+    FRAMEHDR hdr;
+    int      pos, n = 0;
+    do {
+        pos    = ringbuf_read(codec->buff, codec->maxsize, *rpos, (uint8_t*)&hdr, sizeof(hdr));
+        *rpos  = ringbuf_read(codec->buff, codec->maxsize, pos, NULL, hdr.size);
+        *rused-= sizeof(hdr) + hdr.size;
+        if (*rused > 0) ringbuf_read(codec->buff, codec->maxsize, *rpos, (uint8_t*)&hdr, sizeof(hdr));
+        n++;
+    } while (*rused > 0 && !CODEC_IS_VIDEO_KEYFRAME(hdr.type));
+    return n;
+}
+
+static int bcast_skip(CODEC *codec) // move the slowest reader on to its next video key frame if it lags more than half of the ring
+{
+    CODEC_READER *r;
+    int           i;
+    for (r=NULL,i=0; i<CODEC_MAX_READERS; i++) {
+        if ((codec->rmask & (1 << i)) && !codec->readers[i].locked && codec->readers[i].used == codec->cursize) r = &codec->readers[i];
+    }
+    if (!r || r->used <= codec->maxsize / 2) return 0;
+    skip_gop(codec, &r->pos, &r->used);
+    r->skips++;
+    bcast_reclaim(codec);
+    return 1;
+}
+
+static int drop_gop(CODEC *codec, uint32_t type) // drop the oldest gop queued, the reader must go on from a key frame
+{
+    int pos = codec->head, used = codec->cursize, n;
+    if (codec->readers[0].locked || used <= 0) return 0;
+    n = skip_gop(codec, &pos, &used);
+    if (used == 0 && !CODEC_IS_VIDEO_KEYFRAME(type)) return 0;
+    codec->head    = pos;
+    codec->cursize = used;
+    ATOMIC_ADD(&codec->drops[CODEC_DROP_GOP], n);
+    return 1;
+}
+
+static int drop_limit(CODEC *codec, uint32_t type)
+{
+    return (codec->policy & CODEC_POLICY_AUDIO_LAST) && !CODEC_IS_AUDIO_FRAME(type) ? codec->maxsize - codec->maxsize / 8 : codec->maxsize;
+}
+
+static int drop_nonref(CODEC *codec, int used, int need, uint32_t type)
+{
+    if (!(codec->policy & CODEC_POLICY_DROP_NONREF) || !CODEC_IS_DISPOSABLE(type) || used + need <= codec->maxsize / 4 * 3) return 0;
+    ATOMIC_ADD(&codec->drops[CODEC_DROP_NONREF], 1);
+    return 1;
+}
+
+static int lfq_room(CODEC *codec, int span, uint32_t type, uint32_t *pos) // producer side, lock-free rings can only wait for room
+{
+    CODEC_LFQ *q     = &codec->lfq;
+    int        limit = drop_limit(codec, type), ret = 0, got;
+    struct timespec ts;
+    if (drop_nonref(codec, lfq_used(codec, ATOMIC_LOAD(&q->head), ATOMIC_LOAD(&q->tail)), span, type)) return 0;
+    if (lfq_reserve(codec, span, limit, pos)) return 1;
+    if (!(codec->policy & CODEC_POLICY_BLOCK)) {
+        ATOMIC_ADD(&codec->drops[CODEC_DROP_FULL], 1);
+        return 0;
+    }
+    timeout_to_timespec(&ts, codec->blocktime);
+    pthread_mutex_lock(&codec->mutex); // parked until the consumer frees room, see lfq_freed
+    ATOMIC_ADD(&q->pparked, 1);
+    ATOMIC_FENCE();
+    while (!(got = lfq_reserve(codec, span, limit, pos)) && ret != ETIMEDOUT) ret = pthread_cond_timedwait(&codec->cond, &codec->mutex, &ts);
+    ATOMIC_ADD(&q->pparked, -1);
+    pthread_mutex_unlock(&codec->mutex);
+    if (!got) ATOMIC_ADD(&codec->drops[CODEC_DROP_TIMEOUT], 1);
+    return got;
+}
+
+static int frame_room(CODEC *codec, int need, uint32_t type) // mutex held, make room for need bytes as the drop policy allows
+{
+    struct timespec ts;
+    int    ret = 0, gop = (codec->policy & CODEC_POLICY_DROP_GOP) && !(codec->mode & CODEC_MODE_BROADCAST);
+    if (drop_nonref(codec, codec->cursize, need, type)) return 0;
+    timeout_to_timespec(&ts, codec->blocktime);
+    if (!(codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC))) index_alloc(codec); // frames go on without index if it fails
+    while (drop_limit(codec, type) - codec->cursize < need || index_full(codec)) { // limit goes up when the ring grows
+        if ((codec->mode & CODEC_MODE_BROADCAST) && bcast_skip(codec)) continue;
+        if (ring_grow(codec, need + codec->maxsize - drop_limit(codec, type))) continue;
+        if (gop && drop_gop(codec, type)) continue;
+        if (((codec->policy & CODEC_POLICY_BLOCK) || (gop && codec->readers[0].locked)) && ret != ETIMEDOUT) { // a gop can be dropped once the reader unlocks its frame
+            codec->pwait++;
+            ret = pthread_cond_timedwait(&codec->cond, &codec->mutex, &ts);
+            codec->pwait--;
+            continue;
+        }
+        ATOMIC_ADD(&codec->drops[ret == ETIMEDOUT ? CODEC_DROP_TIMEOUT : CODEC_DROP_FULL], 1);
+        return 0;
+    }
+    return 1;
+}
+
+static void frame_freed(CODEC *codec) // mutex held, wake producers blocked for room
+{
+    if (codec->pwait) pthread_cond_broadcast(&codec->cond);
+    ring_shrink(codec);
+}
+
+static int base_codec_reserve(void *c, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2)
+{
+    CODEC   *codec = (CODEC*)c;
+    uint32_t pos;
+    int      off;
+    if (size < 0 || s_resv.codec) return -1;
+    if (codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC)) {
+        if (!lfq_room(codec, lfq_span(codec, sizeof(FRAMEHDR) + size), type, &pos)) return 0;
+        off = lfq_offset(codec, pos);
+    } else {
+        codec_lock(codec); // held until commit, producers of a locked codec fill their frames one by one
+        if (!frame_room(codec, sizeof(FRAMEHDR) + size, type)) {
+            pthread_mutex_unlock(&codec->mutex);
+            return 0;
+        }
+        pos = off = codec->tail;
+    }
+    s_resv.codec = c;
+    s_resv.pos   = pos;
+    s_resv.room  = size;
+    get_region(codec, off + sizeof(FRAMEHDR), size, ppbuf1, plen1, ppbuf2, plen2);
+    return size;
+}
+
+static int frame_commit(void *c, int len, uint32_t type, int64_t pts, int64_t dts)
+{
+    CODEC   *codec = (CODEC*)c;
+    FRAMEHDR hdr   = { MAX(0, MIN(len, s_resv.room)), type, pts, 0, (int32_t)MAX(0, MIN(pts - dts, INT32_MAX)) };
+    int      span;
+    if (s_resv.codec != c) return -1;
+    s_resv.codec = NULL;
+    if (len >= 0) codec_stat_in(codec, 1, hdr.size);
+    if (codec->mode & CODEC_MODE_MPSC) { // the reserved room is owned by us anyway, a canceled frame is committed as an empty one
+        if (len < 0) hdr.type = 0;
+        hdr.room = s_resv.room;
+        span = lfq_span(codec, sizeof(hdr) + hdr.room);
+        ringbuf_write(codec->buff, codec->maxsize, lfq_offset(codec, s_resv.pos), (uint8_t*)&hdr, sizeof(hdr));
+        lfq_commit(codec, s_resv.pos, span);
+    } else if (codec->mode & CODEC_MODE_SPSC) { // nothing is published before commit, so the frame can simply shrink
+        if (len < 0) return 0;
+        hdr.room = hdr.size;
+        ringbuf_write(codec->buff, codec->maxsize, lfq_offset(codec, s_resv.pos), (uint8_t*)&hdr, sizeof(hdr));
+        lfq_commit(codec, s_resv.pos, sizeof(hdr) + hdr.size);
+    } else {
+        if (len >= 0) {
+            hdr.room = hdr.size;
+            index_push(codec, codec->tail, &hdr);
+            ringbuf_write(codec->buff, codec->maxsize, codec->tail, (uint8_t*)&hdr, sizeof(hdr));
+            codec->tail    = ringbuf_read(codec->buff, codec->maxsize, codec->tail, NULL, sizeof(hdr) + hdr.size);
+            if (codec->mode & CODEC_MODE_BROADCAST) {
+                bcast_written(codec, sizeof(hdr) + hdr.size);
+            } else {
+                codec->cursize+= sizeof(hdr) + hdr.size;
+                pthread_cond_signal(&codec->cond);
+                worker_kick(codec->readers[0].task);
+            }
+            stat_max((uint32_t*)&codec->stats.highwater, codec->cursize);
+        }
+        pthread_mutex_unlock(&codec->mutex);
+    }
+    return len < 0 ? 0 : (int)hdr.size;
+}
+
+static int base_codec_commit(void *c, int len, uint32_t type, int64_t pts)
+{
+    return frame_commit(c, len, type, pts, pts);
+}
+
 static int base_codec_writebuf(void *c, uint8_t *buf, int len)
 {
     CODEC *codec = (CODEC*)c;
     int    ret   = 0;
-    pthread_mutex_lock(&codec->mutex);
+    uint32_t pos;
+    if (codec->mode & CODEC_MODE_MPSC) return -1;
+    if (codec->mode & CODEC_MODE_SPSC) {
+        if (lfq_reserve(codec, len, codec->maxsize, &pos)) {
+            ringbuf_write(codec->buff, codec->maxsize, lfq_offset(codec, pos), buf, len);
+            lfq_commit(codec, pos, len);
+            codec_stat_in(codec, 0, len);
+            return len;
+        }
+        ATOMIC_ADD(&codec->drops[CODEC_DROP_FULL], 1);
+        printf("codec_write %s drop data %d, head: %u, tail: %u, maxsize: %d\n", codec->name, len, codec->lfq.hcache, codec->lfq.tail, codec->maxsize);
+        return 0;
+    }
+    codec_lock(codec);
     if (codec->cursize + len <= codec->maxsize) {
         codec->tail     = ringbuf_write(codec->buff, codec->maxsize, codec->tail, buf, len);
         codec->cursize += len;
         pthread_cond_signal(&codec->cond);
+        worker_kick(codec->readers[0].task);
+        stat_max((uint32_t*)&codec->stats.highwater, codec->cursize);
+        codec_stat_in(codec, 0, len);
         ret = len;
     } else {
+        ATOMIC_ADD(&codec->drops[CODEC_DROP_FULL], 1);
         printf("codec_write %s drop data %d, head: %d, tail: %d, cursize: %d, maxsize: %d\n", codec->name, len, codec->head, codec->tail, codec->cursize, codec->maxsize);
     }
     pthread_mutex_unlock(&codec->mutex);
     return ret;
 }
 
+static int base_codec_writeraw(void *c, uint8_t *buf, int len, int64_t pts) // a plain ring is a byte stream, nothing to carry pts with
+{
+    return ((CODEC*)c)->writebuf(c, buf, len);
+}
+
+static void readers_reset(CODEC *codec) // cursors only, tasks stay attached, the encode task of an encoder is on reader 0
+{
+    void *task;
+    int   i;
+    for (i=0; i<CODEC_MAX_READERS; i++) {
+        task = codec->readers[i].task;
+        memset(&codec->readers[i], 0, sizeof(CODEC_READER));
+        codec->readers[i].task = task;
+    }
+}
+
 static void base_codec_config(void *c, int flags, void *param1, uint32_t param2)
 {
     CODEC *codec = (CODEC*)c;
     if (flags & CODEC_CONFIG_CLEAR_BUFF) {
         pthread_mutex_lock(&codec->mutex);
         codec->head = codec->tail = codec->cursize = 0;
+        readers_reset(codec);
+        frame_freed(codec);
+        if (codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC)) { // the consumer may be reading, it drops up to here on its next wait, frames written after are kept
+            ATOMIC_STORE(&codec->lfq.clearpos, ATOMIC_LOAD(&codec->lfq.tail));
+            ATOMIC_STORE(&codec->lfq.clearreq, codec->lfq.clearreq + 1);
+        }
+        pthread_mutex_unlock(&codec->mutex);
+    }
+    if (flags & CODEC_CONFIG_SET_MODE) {
+        pthread_mutex_lock(&codec->mutex);
+        if (!(codec->mode & CODEC_MODE_MIRROR)) ring_free(codec);
+        free(codec->lfq.commit);
+        free(codec->index.off);
+        codec->lfq.commit = NULL;
+        memset(&codec->index, 0, sizeof(codec->index));
+        if ((param2 & CODEC_MODE_MIRROR) && !(codec->mode & CODEC_MODE_MIRROR)) { // the inline ring memory is left unused from now on
+            int      size = codec->maxsize;
+            uint8_t *buff = ringbuf_mirror_alloc(&size);
+            if (buff) { codec->buff = buff; codec->maxsize = size; }
+            else param2 &= ~CODEC_MODE_MIRROR;
+        }
+        param2 |= codec->mode & CODEC_MODE_MIRROR;
+        codec->mode = (param2 & CODEC_MODE_BROADCAST) ? (param2 & (CODEC_MODE_BROADCAST|CODEC_MODE_MIRROR)) : param2;
+        codec->head = codec->tail = codec->cursize = 0;
+        codec->rmask= 0;
+        readers_reset(codec);
+        codec->lfq.head = codec->lfq.tail = codec->lfq.hcache = codec->lfq.tcache = 0;
+        codec->lfq.cleared = codec->lfq.clearreq; // a clear still pending has nothing left to drop
+        if (codec->mode & CODEC_MODE_MPSC) {
+            codec->maxsize   -= codec->maxsize % CODEC_LFQ_GRANULE;
+            codec->lfq.commit = calloc(1, codec->maxsize / CODEC_LFQ_GRANULE);
+            if (!codec->lfq.commit) codec->mode = CODEC_MODE_LOCKED;
+        }
         pthread_mutex_unlock(&codec->mutex);
     }
+    if (flags & CODEC_CONFIG_SET_POLICY) {
+        codec->policy = param2;
+        if (param1) codec->blocktime = *(int*)param1;
+    }
 }
 
 void* codec_init(char *name, int codecsize, int buffersize, void *next)
@@ -53,9 +683,15 @@ void* codec_init(char *name, int codecsize, int buffersize, void *next)
     codec->next      = next;
     codec->buff      = (uint8_t*)codec + codecsize;
     codec->maxsize   = buffersize;
+    codec->basebuf   = codec->buff;
+    codec->basesize  = buffersize;
     codec->free      = base_codec_free;
     codec->writebuf  = base_codec_writebuf;
+    codec->writeraw  = base_codec_writeraw;
     codec->config    = base_codec_config;
+    codec->reserve   = base_codec_reserve;
+    codec->commit    = base_codec_commit;
+    codec->blocktime = 40;
     pthread_condattr_init(&attr);
     pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
     pthread_mutex_init(&codec->mutex, NULL );
@@ -67,126 +703,326 @@ int codec_readbuf(void *c, uint8_t *buf, int len)
 {
     CODEC *codec = (CODEC*)c;
     int    ret   = 0;
-    if (!codec) return -1;
-    pthread_mutex_lock(&codec->mutex);
+    if (!codec || (codec->mode & CODEC_MODE_MPSC)) return -1;
+    if (codec->mode & CODEC_MODE_SPSC) {
+        ret = MIN(len, lfq_wait(codec, 1, 0));
+        ringbuf_read(codec->buff, codec->maxsize, lfq_offset(codec, codec->lfq.head), buf, ret);
+        lfq_consume(codec, ret);
+        codec_stat_out(codec, 0, ret);
+        return ret;
+    }
+    codec_lock(codec);
     if (codec->cursize > 0) {
         ret = MIN(len, codec->cursize);
         codec->head     = ringbuf_read(codec->buff, codec->maxsize, codec->head, buf, ret);
-        codec->cursize += ret;
+        codec->cursize -= ret;
     }
     pthread_mutex_unlock(&codec->mutex);
+    codec_stat_out(codec, 0, ret);
     return ret;
 }
 
-int codec_writeframe(void *c, uint8_t *buf, int len, uint32_t type, uint32_t pts)
+int codec_writeframe_ex(void *c, uint8_t *buf, int len, uint32_t type, int64_t pts, int64_t dts)
 {
-    CODEC  *codec = (CODEC*)c;
-    int32_t size  = 0;
+    uint8_t *buf1, *buf2;
+    int      len1 ,  len2;
     if (!c) return -1;
-    pthread_mutex_lock(&codec->mutex);
-    if (sizeof(uint32_t) * 3 + len <= codec->maxsize - codec->cursize) {
-        size = len;
-        codec->tail    = ringbuf_write(codec->buff, codec->maxsize, codec->tail, (uint8_t*)&size, sizeof(uint32_t));
-        codec->tail    = ringbuf_write(codec->buff, codec->maxsize, codec->tail, (uint8_t*)&type, sizeof(uint32_t));
-        codec->tail    = ringbuf_write(codec->buff, codec->maxsize, codec->tail, (uint8_t*)&pts , sizeof(uint32_t));
-        codec->tail    = ringbuf_write(codec->buff, codec->maxsize, codec->tail, (uint8_t*) buf , len);
-        codec->cursize+= sizeof(uint32_t) * 3 + len;
-        pthread_cond_signal(&codec->cond);
-    }
-    pthread_mutex_unlock(&codec->mutex);
-    return size;
+    if (base_codec_reserve(c, len, type, &buf1, &len1, &buf2, &len2) < 0 || s_resv.codec != c) return 0; // an empty frame reserves 0 bytes too
+    if (len1) memcpy(buf1, buf, len1);
+    if (len2) memcpy(buf2, buf + len1, len2);
+    return frame_commit(c, len, type, pts, dts);
 }
 
-int codec_readframe(void *c, uint8_t *buf, int len, uint32_t *fsize, uint32_t *type, uint32_t *pts, int timeout)
+int codec_writeframe(void *c, uint8_t *buf, int len, uint32_t type, int64_t pts)
 {
-    CODEC *codec = (CODEC*)c;
+    return codec_writeframe_ex(c, buf, len, type, pts, pts);
+}
+
+int codec_readframe(void *c, uint8_t *buf, int len, uint32_t *fsize, uint32_t *type, int64_t *pts, int timeout)
+{
+    CODEC   *codec = (CODEC*)c;
+    FRAMEHDR hdr;
     struct timespec ts;
-    int      readn = 0, ret;
-    uint32_t size;
+    int      readn = 0, ret = 0, head;
     if (!codec) return -1;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    ts.tv_nsec += timeout*1000*1000;
-    ts.tv_sec  += ts.tv_nsec / 1000000000;
-    ts.tv_nsec %= 1000000000;
-    pthread_mutex_lock(&codec->mutex);
-    while (timeout && codec->cursize == 0 && ret != ETIMEDOUT) ret = pthread_cond_timedwait(&codec->cond, &codec->mutex, &ts);
-    if (codec->cursize > sizeof(uint32_t) * 3) {
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, (uint8_t*)&size, sizeof(uint32_t));
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, (uint8_t*) type, sizeof(uint32_t));
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, (uint8_t*) pts , sizeof(uint32_t));
-        codec->cursize-= sizeof(uint32_t) * 3;
-        readn = MIN(len, size);
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head,  buf , readn);
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head,  NULL, size - readn);
+    if (codec->mode & CODEC_MODE_BROADCAST) {
+        uint8_t *buf1, *buf2;
+        int      len1 ,  len2, size = codec_lockframe_r(c, 0, &buf1, &len1, &buf2, &len2, type, pts, timeout);
+        if (size <= 0) return size;
+        readn = MIN(len, len1);
+        memcpy(buf, buf1, readn);
+        if (len2) memcpy(buf + readn, buf2, MIN(len - readn, len2));
+        codec_unlockframe_r(c, 0, size);
         if (fsize) *fsize = size;
+        return MIN(len, size);
+    }
+    if (codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC)) {
+        if (!lfq_wait(codec, sizeof(hdr), timeout)) return 0;
+        head  = lfq_gethdr(codec, &hdr);
+        readn = MIN(len, (int)hdr.size);
+        ringbuf_read(codec->buff, codec->maxsize, head, buf, readn);
+        lfq_putframe(codec);
+        codec_stat_out(codec, 1, hdr.size);
+        if (fsize) *fsize = hdr.size;
+        if (type ) *type  = hdr.type;
+        if (pts  ) *pts   = hdr.pts;
+        return readn;
+    }
+    timeout_to_timespec(&ts, timeout);
+    codec_lock(codec);
+    while (timeout && codec->cursize == 0 && ret != ETIMEDOUT && !(codec->wakemask & 1)) ret = cond_wait(codec, &ts, timeout);
+    codec->wakemask &= ~1;
+    if (codec->cursize >= (int)sizeof(hdr)) {
+        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, (uint8_t*)&hdr, sizeof(hdr));
+        codec->cursize-= sizeof(hdr);
+        readn = MIN(len, (int)hdr.size);
+        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, buf , readn);
+        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, NULL, hdr.size - readn);
+        codec->cursize-= hdr.size;
+        frame_freed(codec);
+        codec_stat_out(codec, 1, hdr.size);
+        if (fsize) *fsize = hdr.size;
+        if (type ) *type  = hdr.type;
+        if (pts  ) *pts   = hdr.pts;
     }
     pthread_mutex_unlock(&codec->mutex);
     return readn;
 }
 
-int codec_lockframe(void *c, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, uint32_t *pts, int timeout)
+int codec_lockframe_ex(void *c, int reader, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, int64_t *pts, int64_t *dts, int timeout)
 {
-    CODEC  *codec = (CODEC*)c;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int      len1 = 0   ,  len2 = 0, ret;
+    CODEC   *codec = (CODEC*)c;
+    FRAMEHDR hdr   = {0};
+    int      ret   = 0, head = -1, *rpos, *rused;
+    CODEC_READER *r;
     struct timespec ts;
-    uint32_t size = 0;
     if (!codec) return -1;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    ts.tv_nsec += timeout*1000*1000;
-    ts.tv_sec  += ts.tv_nsec / 1000000000;
-    ts.tv_nsec %= 1000000000;
-    pthread_mutex_lock(&codec->mutex);
-    while (timeout && codec->cursize == 0 && ret != ETIMEDOUT) ret = pthread_cond_timedwait(&codec->cond, &codec->mutex, &ts);
-    if (codec->cursize > sizeof(uint32_t) * 3) {
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, (uint8_t*)&size, sizeof(uint32_t));
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, (uint8_t*) type, sizeof(uint32_t));
-        codec->head    = ringbuf_read(codec->buff, codec->maxsize, codec->head, (uint8_t*) pts , sizeof(uint32_t));
-        codec->cursize-= sizeof(uint32_t) * 3;
-        buf1= codec->buff + codec->head;
-        len1= size;
-        if (codec->head + len1 > codec->maxsize) {
-            len1 = codec->maxsize - codec->head;
-            buf2 = codec->buff;
-            len2 = size - len1;
+    if (codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC)) {
+        if (lfq_wait(codec, sizeof(hdr), timeout)) {
+            head = lfq_gethdr(codec, &hdr);
+            if (hdr.size == 0) lfq_putframe(codec); // nothing to unlock for empty frames
+        }
+    } else {
+        rpos  = &codec->head;
+        rused = &codec->cursize;
+        r     = &codec->readers[0]; // only its locked state is used when not broadcasting, so gop drops leave the locked frame alone
+        if (codec->mode & CODEC_MODE_BROADCAST) {
+            if (reader < 0 || reader >= CODEC_MAX_READERS) return -1;
+            r     = &codec->readers[reader];
+            rpos  = &r->pos;
+            rused = &r->used;
+        }
+        timeout_to_timespec(&ts, timeout);
+        codec_lock(codec);
+        while (timeout && *rused == 0 && ret != ETIMEDOUT && !(codec->wakemask & (1 << (r - codec->readers)))) ret = cond_wait(codec, &ts, timeout);
+        codec->wakemask &= ~(1 << (r - codec->readers));
+        if (*rused >= (int)sizeof(hdr)) {
+            head = *rpos = ringbuf_read(codec->buff, codec->maxsize, *rpos, (uint8_t*)&hdr, sizeof(hdr));
+            *rused -= sizeof(hdr);
+            r->locked = hdr.size > 0;
+            if (codec->mode & CODEC_MODE_BROADCAST) bcast_reclaim(codec);
+        } else ring_shrink(codec); // readers poll an idle ring, give its borrowed memory back then
+        pthread_mutex_unlock(&codec->mutex);
+    }
+    if (head >= 0) {
+        codec_stat_out(codec, 1, hdr.size);
+        get_region(codec, head, hdr.size, ppbuf1, plen1, ppbuf2, plen2);
+        if (type) *type = hdr.type;
+        if (pts ) *pts  = hdr.pts;
+        if (dts ) *dts  = hdr.pts - hdr.delay;
+    }
+    return hdr.size;
+}
+
+int codec_lockframe_r(void *c, int reader, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, int64_t *pts, int timeout)
+{
+    return codec_lockframe_ex(c, reader, ppbuf1, plen1, ppbuf2, plen2, type, pts, NULL, timeout);
+}
+
+void codec_unlockframe_r(void *c, int reader, int len)
+{
+    CODEC *codec = (CODEC*)c;
+    if (!codec || len <= 0) return;
+    if (codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC)) {
+        lfq_putframe(codec);
+        return;
+    }
+    codec_lock(codec);
+    if (codec->mode & CODEC_MODE_BROADCAST) {
+        if (reader >= 0 && reader < CODEC_MAX_READERS && (codec->rmask & (1 << reader))) {
+            codec->readers[reader].pos    = ringbuf_read(codec->buff, codec->maxsize, codec->readers[reader].pos, NULL, len);
+            codec->readers[reader].used  -= len;
+            codec->readers[reader].locked = 0;
+            bcast_reclaim(codec);
         }
-        if (ppbuf1) *ppbuf1 = buf1;
-        if (ppbuf2) *ppbuf2 = buf2;
-        if (plen1 ) *plen1  = len1;
-        if (plen2 ) *plen2  = len2;
+    } else {
+        codec->head     = ringbuf_read(codec->buff, codec->maxsize, codec->head, NULL, len);
+        codec->cursize -= len;
+        codec->readers[0].locked = 0;
     }
+    frame_freed(codec);
     pthread_mutex_unlock(&codec->mutex);
-    return size;
+}
+
+int codec_lockframe(void *c, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, int64_t *pts, int timeout)
+{
+    return codec_lockframe_r(c, 0, ppbuf1, plen1, ppbuf2, plen2, type, pts, timeout);
 }
 
 void codec_unlockframe(void *c, int len)
+{
+    codec_unlockframe_r(c, 0, len);
+}
+
+int codec_addreader(void *c)
 {
     CODEC *codec = (CODEC*)c;
-    if (!codec || len == -1) return;
+    int    i;
+    if (!codec) return -1;
+    if (!(codec->mode & CODEC_MODE_BROADCAST)) return 0;
     pthread_mutex_lock(&codec->mutex);
-    if (len > 0) {
-        codec->head     = ringbuf_read(codec->buff, codec->maxsize, codec->head, NULL, len);
-        codec->cursize -= len;
+    for (i=0; i<CODEC_MAX_READERS && (codec->rmask & (1 << i)); i++);
+    if (i < CODEC_MAX_READERS) {
+        memset(&codec->readers[i], 0, sizeof(CODEC_READER));
+        codec->readers[i].pos = codec->tail;
+        if (codec->index.off) { // start from the newest key frame, a recorder then need not wait for a whole gop
+            index_trim(codec);
+            if (codec->index.key - codec->index.first < codec->index.last - codec->index.first) {
+                codec->readers[i].pos  = codec->index.off[codec->index.key & (codec->index.cap - 1)];
+                codec->readers[i].used = index_bytes(codec, codec->readers[i].pos);
+            }
+        }
+        codec->rmask |= (1 << i);
+    } else i = -1;
+    pthread_mutex_unlock(&codec->mutex);
+    return i;
+}
+
+void codec_delreader(void *c, int reader)
+{
+    CODEC *codec = (CODEC*)c;
+    if (!codec || !(codec->mode & CODEC_MODE_BROADCAST) || reader < 0 || reader >= CODEC_MAX_READERS) return;
+    pthread_mutex_lock(&codec->mutex);
+    codec->rmask &= ~(1 << reader);
+    codec->readers[reader].task = NULL;
+    bcast_reclaim(codec);
+    frame_freed(codec);
+    pthread_mutex_unlock(&codec->mutex);
+}
+
+int codec_keyframe(void *c, CODEC_FRAMEINFO *info)
+{
+    CODEC *codec = (CODEC*)c;
+    int    ret   = -1;
+    if (!codec) return -1;
+    pthread_mutex_lock(&codec->mutex);
+    if (codec->index.off) {
+        index_trim(codec);
+        if (codec->index.key - codec->index.first < codec->index.last - codec->index.first) ret = index_get(codec, codec->index.key, info);
+    }
+    pthread_mutex_unlock(&codec->mutex);
+    return ret;
+}
+
+int codec_findframe(void *c, int64_t pts, CODEC_FRAMEINFO *info)
+{
+    CODEC   *codec = (CODEC*)c;
+    uint32_t lo, hi, mid;
+    int      ret   = -1;
+    if (!codec) return -1;
+    pthread_mutex_lock(&codec->mutex);
+    if (codec->index.off) { // decode times of queued frames go up
+        index_trim(codec);
+        for (lo=codec->index.first,hi=codec->index.last; lo!=hi; ) {
+            mid = lo + (hi - lo) / 2;
+            if (codec->index.pts[mid & (codec->index.cap - 1)] < pts) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo != codec->index.last) ret = index_get(codec, lo, info);
     }
     pthread_mutex_unlock(&codec->mutex);
+    return ret;
 }
 
 void codec_start(void *c, int start)
 {
     CODEC *codec = (CODEC*)c;
     if (!codec) return;
+    pthread_mutex_lock(&codec->mutex); // counted, so codecs shared by several recorders keep running until the last one stops
+    if (start) codec->starts++;
+    else if (codec->starts > 0) codec->starts--;
+    if (codec->starts) codec->flags |= CODEC_FLAG_START;
+    else               codec->flags &=~CODEC_FLAG_START;
+    pthread_cond_broadcast(&codec->cond); // encode threads sleep on it while stopped
+    worker_kick(codec->readers[0].task);
+    pthread_mutex_unlock(&codec->mutex);
+}
+
+void codec_settask(void *c, int reader, void *task)
+{
+    CODEC *codec = (CODEC*)c;
+    if (!codec || reader < 0 || reader >= CODEC_MAX_READERS) return;
     pthread_mutex_lock(&codec->mutex);
-    if (start) codec->flags |= CODEC_FLAG_START;
-    else       codec->flags &=~CODEC_FLAG_START;
+    codec->readers[reader].task = task;
     pthread_mutex_unlock(&codec->mutex);
 }
 
+void codec_getstats(void *c, CODEC_STATS *stats)
+{
+    CODEC *codec = (CODEC*)c;
+    int    i;
+    if (!codec || !stats) return;
+    *stats = codec->stats;
+    for (i=0; i<CODEC_DROP_REASONS; i++) stats->drops[i] = ATOMIC_LOAD(&codec->drops[i]);
+    stats->maxsize = codec->maxsize;
+    stats->cursize = (codec->mode & (CODEC_MODE_SPSC|CODEC_MODE_MPSC)) ? lfq_used(codec, ATOMIC_LOAD(&codec->lfq.head), ATOMIC_LOAD(&codec->lfq.tail)) : codec->cursize;
+}
+
+void codec_wakeup(void *c)
+{
+    CODEC *codec = (CODEC*)c;
+    int    i;
+    if (!codec) return;
+    pthread_mutex_lock(&codec->mutex); // sticky, so a reader about to wait returns too
+    codec->wakemask = (uint32_t)-1;
+    pthread_cond_broadcast(&codec->cond);
+    for (i=0; i<CODEC_MAX_READERS; i++) worker_kick(codec->readers[i].task);
+    pthread_mutex_unlock(&codec->mutex);
+}
+
+void codec_setbudget(int total, int chunk)
+{
+    ATOMIC_STORE(&s_budget.total, total);
+    if (chunk > 0) s_budget.chunk = chunk;
+}
+
+int codec_getbudget(int *total, int *chunk)
+{
+    if (total) *total = ATOMIC_LOAD(&s_budget.total);
+    if (chunk) *chunk = s_budget.chunk;
+    return ATOMIC_LOAD(&s_budget.used);
+}
+
 void codec_free(void *c)
 {
     CODEC *codec = (CODEC*)c;
     if (codec && codec->free) codec->free(c);
 }
 
+int codec_reserveframe(void *c, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2)
+{
+    CODEC *codec = (CODEC*)c;
+    if (codec && codec->reserve) return codec->reserve(c, size, type, ppbuf1, plen1, ppbuf2, plen2);
+    return -1;
+}
+
+int codec_commitframe(void *c, int len, uint32_t type, int64_t pts)
+{
+    CODEC *codec = (CODEC*)c;
+    if (codec && codec->commit) return codec->commit(c, len, type, pts);
+    return -1;
+}
+
 int codec_writebuf(void *c, uint8_t *buf, int len)
 {
     CODEC *codec = (CODEC*)c;
@@ -194,9 +1030,17 @@ int codec_writebuf(void *c, uint8_t *buf, int len)
     return -1;
 }
 
+int codec_writeraw(void *c, uint8_t *buf, int len, int64_t pts)
+{
+    CODEC *codec = (CODEC*)c;
+    if (codec && codec->writeraw) return codec->writeraw(c, buf, len, pts);
+    return -1;
+}
+
 void codec_config(void *c, int flags, void *param1, uint32_t param2)
 {
     CODEC *codec = (CODEC*)c;
+    if (codec && (flags & CODEC_CONFIG_SET_PRIORITY)) worker_setprio(codec->readers[0].task, (int)param2);
     if (codec && codec->config) codec->config(c, flags, param1, param2);
 }
 
@@ -11,7 +11,34 @@ extern "C" {
 enum {
     CODEC_CONFIG_CLEAR_BUFF  = (1 << 0),
     CODEC_CONFIG_REQUEST_IDR = (1 << 1),
-    CODEC_CONFIG_SET_BITRATE = (1 << 2),
+    CODEC_CONFIG_SET_BITRATE = (1 << 2), // param2 is bits per second, h264enc takes it before its next frame
+    CODEC_CONFIG_SET_MODE    = (1 << 3), // param2 is CODEC_MODE_XXX, only change it while no one is using the codec
+    CODEC_CONFIG_SET_POLICY  = (1 << 4), // param2 is CODEC_POLICY_XXX, param1 points to block timeout in ms (40 by default) or NULL
+    CODEC_CONFIG_SET_PRIORITY= (1 << 5), // param2 is WORKER_PRIO_XXX of the task on reader 0, the encode task of an encoder, the recorder of a buffer
+};
+
+enum {
+    CODEC_MODE_LOCKED = 0,        // mutex + cond protected ring, any number of producers and consumers
+    CODEC_MODE_SPSC   = (1 << 0), // lock-free frame queue, exactly one producer thread and one consumer thread
+    CODEC_MODE_MPSC   = (1 << 1), // lock-free frame queue, any number of producer threads and one consumer thread, frame api only
+    CODEC_MODE_BROADCAST = (1 << 2), // locked ring, every reader from codec_addreader sees every frame, not with SPSC/MPSC
+    CODEC_MODE_MIRROR    = (1 << 3), // ring memory mapped twice back to back, frames never split into buf1/buf2, stays once set
+};
+
+enum { // what a frame ring does when a new frame does not fit, default is to drop the new frame
+    CODEC_POLICY_BLOCK       = (1 << 0), // producer waits for room up to the block timeout
+    CODEC_POLICY_DROP_GOP    = (1 << 1), // drop the oldest whole gop queued to make room, locked mode only
+    CODEC_POLICY_DROP_NONREF = (1 << 2), // drop disposable video frames once the ring is 3/4 full
+    CODEC_POLICY_AUDIO_LAST  = (1 << 3), // the last 1/8 of the ring is only for audio frames
+};
+
+enum {
+    CODEC_DROP_FULL,    // new frame did not fit
+    CODEC_DROP_TIMEOUT, // new frame did not fit before the block timeout
+    CODEC_DROP_GOP,     // queued frames dropped along with the oldest gop
+    CODEC_DROP_NONREF,  // disposable frames dropped early
+    CODEC_DROP_NOKEY,   // frames an encoder dropped while waiting for the next key frame
+    CODEC_DROP_REASONS,
 };
 
 enum {
@@ -21,6 +48,77 @@ enum {
 };
 
 #define CODEC_FOURCC(a, b, c, d) (((a) << 0) | ((b) << 8) | ((c) << 16) | ((d) << 24))
+#define CODEC_IS_VIDEO_KEYFRAME(type) ((char)(type) == 'V')
+#define CODEC_IS_AUDIO_FRAME(type)    ((char)(type) == 'A')
+#define CODEC_IS_DISPOSABLE(type)     ((((type) >> 16) & 0xFF) == 'D') // nal_ref_idc == 0, nothing refers to it
+#define CODEC_VIDEO_SCALE(type)       (((type) >> 24) & 0x0F) // video encoded at width and height >> n of what went in
+#define CODEC_VIDEO_GEN(type)         (((type) >> 28) & 0x0F) // times the encoder was opened again, mod 16, sps and pps change with it
+#define CODEC_VIDEO_STREAM(scale, gen) ((scale) | (gen) << 4) // last fourcc byte of a video frame
+#define CODEC_VIDEO_PART(type)        ((((type) >> 16) & 0xFF) == 'F' || (((type) >> 16) & 0xFF) == 'P' || (((type) >> 16) & 0xFF) == 'L' ? (((type) >> 16) & 0xFF) : 0) // 'F', 'P' or 'L' for the first, a middle or the last nal of a frame sent in parts, only the first can be 'V', 0 for a whole one, the byte holds 'D' too
+
+#define CODEC_CACHE_LINE 64
+
+#define CODEC_LFQ_GRANULE 16
+
+typedef struct { // positions of the lock-free frame queue, range [0, maxsize * 2)
+    uint8_t          *commit; // MPSC per-slot commit flags, one for every CODEC_LFQ_GRANULE bytes
+    uint8_t           pad0[CODEC_CACHE_LINE - sizeof(uint8_t*)];
+    volatile uint32_t tail;   // written by producer
+    uint32_t          hcache; // producer's last seen head
+    uint8_t           pad1[CODEC_CACHE_LINE - sizeof(uint32_t) * 2];
+    volatile uint32_t head;   // written by consumer
+    uint32_t          tcache; // consumer's last seen tail
+    uint32_t          room;   // payload room of the frame consumer has taken
+    volatile uint32_t parked; // consumer is sleeping on cond
+    volatile uint32_t pparked;  // producers sleeping on cond for room, CODEC_POLICY_BLOCK
+    volatile uint32_t clearreq; // CODEC_CONFIG_CLEAR_BUFF requests, the consumer drops up to clearpos itself
+    volatile uint32_t clearpos; // tail when the latest one came
+    uint32_t          cleared;  // requests the consumer has done
+    uint8_t           pad2[CODEC_CACHE_LINE - sizeof(uint32_t) * 8];
+} CODEC_LFQ;
+
+#define CODEC_MAX_READERS 8
+
+typedef struct { // per reader cursor of broadcast mode
+    int      pos;    // read offset in ring
+    int      used;   // bytes not read yet
+    int      locked; // holding a frame from codec_lockframe_r
+    uint32_t skips;  // times it lagged behind too far and was moved on to the next key frame
+    void    *task;   // worker task consuming it, kicked when data arrives, reader 0 of an encoder is its own encode task
+} CODEC_READER;
+
+typedef struct { // descriptors of the frames queued in a locked ring, kept as struct of arrays so lookups never touch payload
+    uint32_t *off;   // frame header offset in ring
+    uint32_t *size;
+    uint32_t *type;
+    int64_t  *pts;   // decode time, the same as pts without b-frames
+    uint32_t  first; // sequence numbers, frames [first, last) are queued
+    uint32_t  last;
+    uint32_t  key;   // sequence number of the newest video key frame
+    uint32_t  cap;   // power of 2, a full index makes the ring full too
+} CODEC_INDEX;
+
+typedef struct {
+    uint32_t size;
+    uint32_t type;
+    int64_t  pts;   // dts with b-frames
+    int      bytes; // bytes queued from this frame to the tail
+} CODEC_FRAMEINFO;
+
+typedef struct { // counters only ever go up, take two snapshots for rates
+    uint32_t frames_in;
+    uint32_t frames_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t drops[CODEC_DROP_REASONS];
+    int      cursize;
+    int      maxsize;
+    int      highwater;   // largest cursize seen
+    uint64_t lockwait_us; // time spent waiting for the codec mutex
+    uint32_t lockwait_max;
+    uint64_t encode_us;   // time spent in the encoder, encoders only, divide by frames_out for per frame
+    uint32_t encode_max;
+} CODEC_STATS;
 
 #define CODEC_COMMON_MEMBERS \
     void    *next;         \
@@ -34,31 +132,145 @@ enum {
     int      tail;    \
     int      maxsize; \
     int      cursize; \
+    uint8_t *basebuf; \
+    uint8_t *oldbuf;  \
+    int      basesize;\
+    uint32_t lowtick; \
     uint32_t flags  ; \
+    uint32_t mode   ; \
+    CODEC_LFQ lfq   ; \
+    uint32_t rmask  ; \
+    uint32_t wakemask;\
+    CODEC_READER readers[CODEC_MAX_READERS]; \
+    CODEC_INDEX index; \
+    int      starts ; \
+    uint32_t policy ; \
+    int      blocktime; \
+    int      pwait  ; \
+    volatile uint32_t drops[CODEC_DROP_REASONS]; \
+    CODEC_STATS stats; \
     pthread_mutex_t mutex; \
     pthread_cond_t  cond;  \
     void (*free    )(void *c); \
     int  (*writebuf)(void *c, uint8_t *buf, int len); \
-    void (*config  )(void *c, int flags, void *param1, uint32_t param2);
+    int  (*writeraw)(void *c, uint8_t *buf, int len, int64_t pts); \
+    void (*config  )(void *c, int flags, void *param1, uint32_t param2); \
+    int  (*reserve )(void *c, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2); \
+    int  (*commit  )(void *c, int len, uint32_t type, int64_t pts);
 
 typedef struct {
     CODEC_COMMON_MEMBERS
 } CODEC;
 
-void* codec_init       (char *name, int codecsize, int buffersize, void *next);
-void  codec_free       (void *c);
-int   codec_writebuf   (void *c, uint8_t *buf, int len);
-int   codec_readbuf    (void *c, uint8_t *buf, int len);
-int   codec_writeframe (void *c, uint8_t *buf, int len, uint32_t type, uint32_t pts);
-int   codec_readframe  (void *c, uint8_t *buf, int len, uint32_t *fsize, uint32_t *type, uint32_t *pts, int timeout);
-int   codec_lockframe  (void *c, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, uint32_t *pts, int timeout);
-void  codec_unlockframe(void *c, int len);
-void  codec_start      (void *c, int start);
-void  codec_config     (void *c, int flags, void *param1, uint32_t param2);
+void* codec_init         (char *name, int codecsize, int buffersize, void *next);
+void  codec_free         (void *c);
+int   codec_writebuf     (void *c, uint8_t *buf, int len);
+int   codec_readbuf      (void *c, uint8_t *buf, int len);
+int   codec_writeraw     (void *c, uint8_t *buf, int len, int64_t pts); // raw pcm or picture into an encoder, pts is get_time_us() when its first sample was captured, 0 if it was just captured
+int   codec_writeframe   (void *c, uint8_t *buf, int len, uint32_t type, int64_t pts);
+int   codec_writeframe_ex(void *c, uint8_t *buf, int len, uint32_t type, int64_t pts, int64_t dts); // frames reordered by b-frames, written in decode order, dts <= pts
+int   codec_readframe    (void *c, uint8_t *buf, int len, uint32_t *fsize, uint32_t *type, int64_t *pts, int timeout);
+int   codec_lockframe    (void *c, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, int64_t *pts, int timeout);
+void  codec_unlockframe  (void *c, int len);
+int   codec_addreader    (void *c); // broadcast mode gives a new reader starting at the newest key frame queued, other modes always return 0
+void  codec_delreader    (void *c, int reader);
+int   codec_lockframe_r  (void *c, int reader, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, int64_t *pts, int timeout);
+void  codec_unlockframe_r(void *c, int reader, int len);
+int   codec_lockframe_ex (void *c, int reader, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2, uint32_t *type, int64_t *pts, int64_t *dts, int timeout); // lockframe_r with the dts, same as pts without b-frames
+int   codec_reserveframe (void *c, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2); // type for drop policy, commit may change it
+int   codec_commitframe  (void *c, int len, uint32_t type, int64_t pts); // len < 0 cancels, must be called by the thread which reserved, pts as in codec_writeraw
+int   codec_keyframe     (void *c, CODEC_FRAMEINFO *info); // newest video key frame queued, return its place in queue or -1, locked and broadcast mode only
+int   codec_findframe    (void *c, int64_t pts, CODEC_FRAMEINFO *info); // first frame queued at or after pts, return its place in queue or -1, by dts with b-frames
+void  codec_start        (void *c, int start);
+void  codec_wakeup       (void *c); // blocked or next lockframe/readframe of every reader returns at once, timeout < 0 waits forever
+void  codec_settask      (void *c, int reader, void *task); // worker_add task kicked whenever data arrives for reader, NULL for none
+void  codec_getstats     (void *c, CODEC_STATS *stats); // lock-free snapshot, fields are read one by one
+
+// for codec implementations, stats are updated without locks
+void  codec_lock         (void *c); // lock codec mutex, time waiting for it goes to lockwait_us
+void  codec_stat_in      (void *c, int frames, int bytes);
+void  codec_stat_out     (void *c, int frames, int bytes);
+void  codec_stat_encode  (void *c, uint32_t us);
+void  codec_setbudget    (int total, int chunk); // process-wide bytes locked frame rings may borrow in chunks to grow beyond their own size
+int   codec_getbudget    (int *total, int *chunk); // return bytes borrowed now, a ring has borrowed maxsize - basesize
+void  codec_config       (void *c, int flags, void *param1, uint32_t param2);
+
+enum {
+    H264ENC_THREADS_DEFAULT, // whatever preset and tune give, sliced threads with zerolatency
+    H264ENC_THREADS_SLICED,  // threads encode slices of the same frame, no added latency
+    H264ENC_THREADS_FRAME,   // threads encode different frames, better quality per bit, every thread adds a frame of latency
+};
+
+typedef struct { // a step of the h264enc overload ladder, each one cheaper than the one before
+    char *preset;
+    int   decimate; // encode 1 of every n frames
+    int   scale;    // 1 for half the width and height
+} H264ENC_RUNG;
+
+#define H264ENC_MAX_RUNGS 16
+
+typedef struct { // x264 settings of h264enc_init_ex, 0 or NULL keeps the default
+    int   threads;   // 1 for single thread, 0 lets x264 pick from the cpu count
+    int   threading; // H264ENC_THREADS_XXX
+    int   slices;    // max slices per frame, slices per frame with sliceout
+    int   lookahead; // rc lookahead depth in frames
+    char *preset;    // "ultrafast" by default
+    char *tune;      // "zerolatency" by default, "" for none
+    char *profile;   // "baseline" by default
+    int   governor;  // step down the ladder while encoding falls behind the frame rate, back up once there is headroom
+    H264ENC_RUNG *ladder; // NULL for preset, the faster presets, then frame rate and size cut, strings must outlive the encoder
+    int   rungs;
+    int   bframes;   // b-frames between references, main profile and no tune by default then, frames leave in decode order with a dts
+    int   sliceout;  // each nal goes to next as soon as x264 has it, frames in parts for live view, one x264 thread and no delay
+    int   intrarefresh; // a column of intra blocks sweeps each gop instead of idr frames, the frame it starts on is the key frame
+} H264ENC_PARAMS;
+
+typedef struct {
+    int      threads; // what x264 actually runs with
+    int      frames;
+    float    fps;
+    uint32_t latency_avg; // us from a frame going in to it coming out
+    uint32_t latency_max;
+} H264ENC_BENCH;
+
+enum {
+    SCALER_BOX,      // 2x2 box halving while the output is at most half the size, bilinear for the rest
+    SCALER_BILINEAR, // bilinear straight from the source, cheapest, aliases when shrinking more than 2x
+};
+
+#define SCALER_MAX_OUTPUTS 4
+
+typedef struct {
+    void *next;   // h264enc of w x h the scaled frames go to
+    int   w, h;   // even, no larger than the source
+    int   fps;    // 0 keeps every frame, otherwise frames are dropped by pts down to this rate
+    int   filter; // SCALER_XXX
+} SCALER_OUTPUT;
+
+enum { // source pixel formats of convert_init
+    CONVERT_I420,  // only restrides
+    CONVERT_NV12,  // y plane then interleaved u v plane of the same stride
+    CONVERT_NV21,  // y plane then interleaved v u plane of the same stride
+    CONVERT_YUYV,
+    CONVERT_UYVY,
+    CONVERT_RGB24, // r g b bytes
+    CONVERT_BGR24, // b g r bytes
+    CONVERT_BGRA,  // b g r a bytes, alpha ignored
+};
+
+#define OSD_MAX_TEXTS 4
 
 void* alawenc_init(int bufsize, void *next);
 void* aacenc_init (int bufsize, void *next, int bitrate, int samprate, int channels);
 void* h264enc_init(int bufsize, void *next, int bitrate, int frmrate , int w, int h);
+void* h264enc_init_ex(int bufsize, void *next, int bitrate, int frmrate, int w, int h, H264ENC_PARAMS *params); // params NULL is h264enc_init
+char* h264enc_calibrate(int bitrate, int frmrate, int w, int h, int load, H264ENC_PARAMS *params); // slowest preset up to medium which encodes load streams like this on one core with 25% to spare, set in params too, a static string
+int   h264enc_benchmark(int bitrate, int frmrate, int w, int h, H264ENC_PARAMS *params, int frames, H264ENC_BENCH *bench); // encode synthetic frames as fast as possible, 0 ok, -1 params rejected
+void* convert_init(void *next, int csp, int w, int h, int stride); // CONVERT_XXX w x h in, bt.601 i420 out to next, stride in bytes of a source line, 0 for packed
+void* osd_init    (void *next, int w, int h); // i420 w x h passes through by reserve/commit or writebuf with the texts blended into all planes
+void  osd_settext (void *osd, int id, int x, int y, int size, int bgalpha, char *str); // id < OSD_MAX_TEXTS, size is glyph height (48 native), bgalpha of the black box behind, str NULL removes it, only changed characters render again
+void* scaler_init (void *next, int w, int h, SCALER_OUTPUT *outputs, int n); // i420 w x h in by reserve/commit or writebuf, next gets it as is, NULL for none
+
 
 #ifdef __cplusplus
 }
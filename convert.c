@@ -0,0 +1,384 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "codec.h"
+#include "utils.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    CODEC_COMMON_MEMBERS
+
+    int      csp;
+    int      vw, vh;
+    int      stride;
+    int      srcsize;
+    uint8_t *rows; // two source lines of 24 bit rgb widened to bgra
+} CONVERT;
+
+// bt.601 limited range, chroma from the 2x2 average, rows are vertically averaged first with rounding up like pavgb
+#define RGB_Y(r, g, b)    (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define RGB_U(r2, g2, b2) (((-38 * (r2) - 74 * (g2) + 112 * (b2) + 256) >> 9) + 128) // r2 g2 b2 are sums of two pixels
+#define RGB_V(r2, g2, b2) (((112 * (r2) - 94 * (g2) - 18 * (b2) + 256) >> 9) + 128)
+
+static void split_c(uint8_t *du, uint8_t *dv, uint8_t *src, int w2)
+{
+    int x;
+    for (x=0; x<w2; x++) {
+        du[x] = src[2 * x + 0];
+        dv[x] = src[2 * x + 1];
+    }
+}
+
+static void yuyv_c(uint8_t *dy0, uint8_t *dy1, uint8_t *du, uint8_t *dv, uint8_t *s0, uint8_t *s1, int w, int uyvy)
+{ // two lines of w pixels, uyvy has chroma in the even bytes
+    int x, c = uyvy ? 0 : 1, l = uyvy ? 1 : 0;
+    for (x=0; x<w; x++) {
+        dy0[x] = s0[2 * x + l];
+        dy1[x] = s1[2 * x + l];
+    }
+    for (x=0; x<w/2; x++) {
+        du[x] = (s0[4 * x + c + 0] + s1[4 * x + c + 0] + 1) >> 1;
+        dv[x] = (s0[4 * x + c + 2] + s1[4 * x + c + 2] + 1) >> 1;
+    }
+}
+
+static void bgra_y_c(uint8_t *dy, uint8_t *src, int w)
+{
+    int x;
+    for (x=0; x<w; x++) dy[x] = RGB_Y(src[4 * x + 2], src[4 * x + 1], src[4 * x + 0]);
+}
+
+static void bgra_uv_c(uint8_t *du, uint8_t *dv, uint8_t *s0, uint8_t *s1, int w)
+{
+    int x, b, g, r;
+    for (x=0; x<w/2; x++) {
+        b = ((s0[8 * x + 0] + s1[8 * x + 0] + 1) >> 1) + ((s0[8 * x + 4] + s1[8 * x + 4] + 1) >> 1);
+        g = ((s0[8 * x + 1] + s1[8 * x + 1] + 1) >> 1) + ((s0[8 * x + 5] + s1[8 * x + 5] + 1) >> 1);
+        r = ((s0[8 * x + 2] + s1[8 * x + 2] + 1) >> 1) + ((s0[8 * x + 6] + s1[8 * x + 6] + 1) >> 1);
+        du[x] = RGB_U(r, g, b);
+        dv[x] = RGB_V(r, g, b);
+    }
+}
+
+static void widen_c(uint8_t *dst, uint8_t *src, int w, int rgb)
+{ // 24 bit to bgra, rgb has red first
+    int x, r = rgb ? 0 : 2, b = rgb ? 2 : 0;
+    for (x=0; x<w; x++) {
+        dst[4 * x + 0] = src[3 * x + b];
+        dst[4 * x + 1] = src[3 * x + 1];
+        dst[4 * x + 2] = src[3 * x + r];
+        dst[4 * x + 3] = 0;
+    }
+}
+
+#ifdef CONVERT_X86
+__attribute__((target("sse2")))
+static void split_sse2(uint8_t *du, uint8_t *dv, uint8_t *src, int w2)
+{
+    __m128i m = _mm_set1_epi16(0xFF), a, b;
+    int     x;
+    for (x=0; x+16<=w2; x+=16) {
+        a = _mm_loadu_si128((__m128i*)(src + 2 * x));
+        b = _mm_loadu_si128((__m128i*)(src + 2 * x + 16));
+        _mm_storeu_si128((__m128i*)(du + x), _mm_packus_epi16(_mm_and_si128(a, m), _mm_and_si128(b, m)));
+        _mm_storeu_si128((__m128i*)(dv + x), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    split_c(du + x, dv + x, src + 2 * x, w2 - x);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_sse2(uint8_t *dy0, uint8_t *dy1, uint8_t *du, uint8_t *dv, uint8_t *s0, uint8_t *s1, int w, int uyvy)
+{
+    __m128i m = _mm_set1_epi16(0xFF), z = _mm_setzero_si128(), a0, a1, b0, b1, c;
+    int     x;
+    for (x=0; x+16<=w; x+=16) {
+        a0 = _mm_loadu_si128((__m128i*)(s0 + 2 * x));
+        a1 = _mm_loadu_si128((__m128i*)(s0 + 2 * x + 16));
+        b0 = _mm_loadu_si128((__m128i*)(s1 + 2 * x));
+        b1 = _mm_loadu_si128((__m128i*)(s1 + 2 * x + 16));
+        if (uyvy) {
+            _mm_storeu_si128((__m128i*)(dy0 + x), _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8)));
+            _mm_storeu_si128((__m128i*)(dy1 + x), _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8)));
+            c = _mm_packus_epi16(_mm_and_si128(_mm_avg_epu8(a0, b0), m), _mm_and_si128(_mm_avg_epu8(a1, b1), m));
+        } else {
+            _mm_storeu_si128((__m128i*)(dy0 + x), _mm_packus_epi16(_mm_and_si128(a0, m), _mm_and_si128(a1, m)));
+            _mm_storeu_si128((__m128i*)(dy1 + x), _mm_packus_epi16(_mm_and_si128(b0, m), _mm_and_si128(b1, m)));
+            c = _mm_packus_epi16(_mm_srli_epi16(_mm_avg_epu8(a0, b0), 8), _mm_srli_epi16(_mm_avg_epu8(a1, b1), 8));
+        }
+        _mm_storel_epi64((__m128i*)(du + x / 2), _mm_packus_epi16(_mm_and_si128(c, m), z));
+        _mm_storel_epi64((__m128i*)(dv + x / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), z));
+    }
+    yuyv_c(dy0 + x, dy1 + x, du + x / 2, dv + x / 2, s0 + 2 * x, s1 + 2 * x, w - x, uyvy);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i pairsum(__m128i lo, __m128i hi) // 32 bit lanes [l0+l1, l2+l3, h0+h1, h2+h3]
+{
+    __m128 a = _mm_castsi128_ps(lo), b = _mm_castsi128_ps(hi);
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i bgra_y4(__m128i px, __m128i coef) // 4 pixels to 4 unshifted y sums
+{
+    __m128i z = _mm_setzero_si128();
+    return pairsum(_mm_madd_epi16(_mm_unpacklo_epi8(px, z), coef), _mm_madd_epi16(_mm_unpackhi_epi8(px, z), coef));
+}
+
+__attribute__((target("sse2")))
+static void bgra_y_sse2(uint8_t *dy, uint8_t *src, int w)
+{
+    __m128i coef = _mm_set_epi16(0, 66, 129, 25, 0, 66, 129, 25), r = _mm_set1_epi32(128), o = _mm_set1_epi16(16), lo, hi;
+    int     x;
+    for (x=0; x+16<=w; x+=16) {
+        lo = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(bgra_y4(_mm_loadu_si128((__m128i*)(src + 4 * x +  0)), coef), r), 8),
+                             _mm_srai_epi32(_mm_add_epi32(bgra_y4(_mm_loadu_si128((__m128i*)(src + 4 * x + 16)), coef), r), 8));
+        hi = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(bgra_y4(_mm_loadu_si128((__m128i*)(src + 4 * x + 32)), coef), r), 8),
+                             _mm_srai_epi32(_mm_add_epi32(bgra_y4(_mm_loadu_si128((__m128i*)(src + 4 * x + 48)), coef), r), 8));
+        _mm_storeu_si128((__m128i*)(dy + x), _mm_packus_epi16(_mm_add_epi16(lo, o), _mm_add_epi16(hi, o)));
+    }
+    bgra_y_c(dy + x, src + 4 * x, w - x);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i bgra_sum2(uint8_t *s0, uint8_t *s1) // 4 pixels of two lines to the 16 bit channel sums of 2 chroma pixels
+{
+    __m128i z = _mm_setzero_si128(), v = _mm_avg_epu8(_mm_loadu_si128((__m128i*)s0), _mm_loadu_si128((__m128i*)s1));
+    __m128i lo = _mm_unpacklo_epi8(v, z), hi = _mm_unpackhi_epi8(v, z);
+    return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+}
+
+__attribute__((target("sse2")))
+static void bgra_uv_sse2(uint8_t *du, uint8_t *dv, uint8_t *s0, uint8_t *s1, int w)
+{
+    __m128i ucoef = _mm_set_epi16(0, -38, -74, 112, 0, -38, -74, 112), vcoef = _mm_set_epi16(0, 112, -94, -18, 0, 112, -94, -18);
+    __m128i r = _mm_set1_epi32(256), o = _mm_set1_epi16(128), z = _mm_setzero_si128(), c[4], lo, hi;
+    int     x, i;
+    for (x=0; x+16<=w; x+=16) {
+        for (i=0; i<4; i++) c[i] = bgra_sum2(s0 + 4 * x + 16 * i, s1 + 4 * x + 16 * i);
+        lo = _mm_srai_epi32(_mm_add_epi32(pairsum(_mm_madd_epi16(c[0], ucoef), _mm_madd_epi16(c[1], ucoef)), r), 9);
+        hi = _mm_srai_epi32(_mm_add_epi32(pairsum(_mm_madd_epi16(c[2], ucoef), _mm_madd_epi16(c[3], ucoef)), r), 9);
+        _mm_storel_epi64((__m128i*)(du + x / 2), _mm_packus_epi16(_mm_add_epi16(_mm_packs_epi32(lo, hi), o), z));
+        lo = _mm_srai_epi32(_mm_add_epi32(pairsum(_mm_madd_epi16(c[0], vcoef), _mm_madd_epi16(c[1], vcoef)), r), 9);
+        hi = _mm_srai_epi32(_mm_add_epi32(pairsum(_mm_madd_epi16(c[2], vcoef), _mm_madd_epi16(c[3], vcoef)), r), 9);
+        _mm_storel_epi64((__m128i*)(dv + x / 2), _mm_packus_epi16(_mm_add_epi16(_mm_packs_epi32(lo, hi), o), z));
+    }
+    bgra_uv_c(du + x / 2, dv + x / 2, s0 + 4 * x, s1 + 4 * x, w - x);
+}
+
+__attribute__((target("ssse3")))
+static void widen_ssse3(uint8_t *dst, uint8_t *src, int w, int rgb)
+{
+    __m128i shuf = rgb ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1) : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    int     x;
+    for (x=0; x+6<=w; x+=4) _mm_storeu_si128((__m128i*)(dst + 4 * x), _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(src + 3 * x)), shuf)); // 16 byte load for 12, never past the line
+    widen_c(dst + 4 * x, src + 3 * x, w - x, rgb);
+}
+
+__attribute__((target("avx2")))
+static void split_avx2(uint8_t *du, uint8_t *dv, uint8_t *src, int w2)
+{
+    __m256i m = _mm256_set1_epi16(0xFF), a, b;
+    int     x;
+    for (x=0; x+32<=w2; x+=32) {
+        a = _mm256_loadu_si256((__m256i*)(src + 2 * x));
+        b = _mm256_loadu_si256((__m256i*)(src + 2 * x + 32));
+        _mm256_storeu_si256((__m256i*)(du + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(a, m), _mm256_and_si256(b, m)), 0xD8));
+        _mm256_storeu_si256((__m256i*)(dv + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xD8));
+    }
+    split_sse2(du + x, dv + x, src + 2 * x, w2 - x);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_avx2(uint8_t *dy0, uint8_t *dy1, uint8_t *du, uint8_t *dv, uint8_t *s0, uint8_t *s1, int w, int uyvy)
+{
+    __m256i m = _mm256_set1_epi16(0xFF), z = _mm256_setzero_si256(), a0, a1, b0, b1, c;
+    int     x;
+    for (x=0; x+32<=w; x+=32) {
+        a0 = _mm256_loadu_si256((__m256i*)(s0 + 2 * x));
+        a1 = _mm256_loadu_si256((__m256i*)(s0 + 2 * x + 32));
+        b0 = _mm256_loadu_si256((__m256i*)(s1 + 2 * x));
+        b1 = _mm256_loadu_si256((__m256i*)(s1 + 2 * x + 32));
+        if (uyvy) {
+            _mm256_storeu_si256((__m256i*)(dy0 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8)), 0xD8));
+            _mm256_storeu_si256((__m256i*)(dy1 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(b0, 8), _mm256_srli_epi16(b1, 8)), 0xD8));
+            c = _mm256_packus_epi16(_mm256_and_si256(_mm256_avg_epu8(a0, b0), m), _mm256_and_si256(_mm256_avg_epu8(a1, b1), m));
+        } else {
+            _mm256_storeu_si256((__m256i*)(dy0 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(a0, m), _mm256_and_si256(a1, m)), 0xD8));
+            _mm256_storeu_si256((__m256i*)(dy1 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(b0, m), _mm256_and_si256(b1, m)), 0xD8));
+            c = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_avg_epu8(a0, b0), 8), _mm256_srli_epi16(_mm256_avg_epu8(a1, b1), 8));
+        }
+        c = _mm256_permute4x64_epi64(c, 0xD8); // u v pairs in order
+        _mm_storeu_si128((__m128i*)(du + x / 2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(c, m), z), 0xD8)));
+        _mm_storeu_si128((__m128i*)(dv + x / 2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(c, 8), z), 0xD8)));
+    }
+    yuyv_sse2(dy0 + x, dy1 + x, du + x / 2, dv + x / 2, s0 + 2 * x, s1 + 2 * x, w - x, uyvy);
+}
+#endif
+
+static void (*s_split  )(uint8_t *du, uint8_t *dv, uint8_t *src, int w2) = split_c;
+static void (*s_yuyv   )(uint8_t *dy0, uint8_t *dy1, uint8_t *du, uint8_t *dv, uint8_t *s0, uint8_t *s1, int w, int uyvy) = yuyv_c;
+static void (*s_bgra_y )(uint8_t *dy, uint8_t *src, int w) = bgra_y_c;
+static void (*s_bgra_uv)(uint8_t *du, uint8_t *dv, uint8_t *s0, uint8_t *s1, int w) = bgra_uv_c;
+static void (*s_widen  )(uint8_t *dst, uint8_t *src, int w, int rgb) = widen_c;
+
+static void convert_dispatch(void)
+{
+#ifdef CONVERT_X86
+    int flags = get_cpu_flags();
+    if (flags & CPU_FLAG_SSE2 ) { s_split = split_sse2; s_yuyv = yuyv_sse2; s_bgra_y = bgra_y_sse2; s_bgra_uv = bgra_uv_sse2; }
+    if (flags & CPU_FLAG_SSSE3) s_widen = widen_ssse3;
+    if ((flags & CPU_FLAG_AVX2) && (flags & CPU_FLAG_SSE2)) { s_split = split_avx2; s_yuyv = yuyv_avx2; } // avx2 kernels finish the tail with sse2
+#endif
+}
+
+static void convert_frame(CONVERT *cv, uint8_t *dst, uint8_t *src)
+{
+    uint8_t *dy = dst, *du = dst + cv->vw * cv->vh, *dv = du + cv->vw * cv->vh / 4, *s0, *s1;
+    int      w  = cv->vw, h = cv->vh, s = cv->stride, y;
+    switch (cv->csp) {
+    case CONVERT_I420:
+        for (y=0; y<h; y++) memcpy(dy + y * w, src + y * s, w);
+        for (y=0; y<h/2; y++) {
+            memcpy(du + y * w / 2, src + s * h + y * s / 2, w / 2);
+            memcpy(dv + y * w / 2, src + s * h * 5 / 4 + y * s / 2, w / 2);
+        }
+        break;
+    case CONVERT_NV12:
+    case CONVERT_NV21:
+        for (y=0; y<h; y++) memcpy(dy + y * w, src + y * s, w);
+        for (y=0; y<h/2; y++) {
+            if (cv->csp == CONVERT_NV12) s_split(du + y * w / 2, dv + y * w / 2, src + s * h + y * s, w / 2);
+            else                         s_split(dv + y * w / 2, du + y * w / 2, src + s * h + y * s, w / 2);
+        }
+        break;
+    case CONVERT_YUYV:
+    case CONVERT_UYVY:
+        for (y=0; y<h; y+=2) s_yuyv(dy + y * w, dy + (y + 1) * w, du + y / 2 * w / 2, dv + y / 2 * w / 2, src + y * s, src + (y + 1) * s, w, cv->csp == CONVERT_UYVY);
+        break;
+    case CONVERT_RGB24:
+    case CONVERT_BGR24:
+    case CONVERT_BGRA:
+        for (y=0; y<h; y+=2) {
+            s0 = src + y * s;
+            s1 = src + (y + 1) * s;
+            if (cv->csp != CONVERT_BGRA) {
+                s_widen(cv->rows, s0, w, cv->csp == CONVERT_RGB24);
+                s_widen(cv->rows + w * 4, s1, w, cv->csp == CONVERT_RGB24);
+                s0 = cv->rows;
+                s1 = cv->rows + w * 4;
+            }
+            s_bgra_y (dy + y * w, s0, w);
+            s_bgra_y (dy + (y + 1) * w, s1, w);
+            s_bgra_uv(du + y / 2 * w / 2, dv + y / 2 * w / 2, s0, s1, w);
+        }
+        break;
+    }
+}
+
+static void convert_free(void *ctxt)
+{
+    CONVERT *cv = (CONVERT*)ctxt;
+    pthread_mutex_destroy(&cv->mutex);
+    pthread_cond_destroy (&cv->cond );
+    free(cv->rows);
+    free(cv);
+}
+
+static int convert_put(CONVERT *cv, uint8_t *buf, int64_t pts)
+{ // one whole source frame, converted right into next's input ring
+    uint8_t *buf1, *buf2;
+    int      len1 ,  len2, size = cv->vw * cv->vh * 3 / 2;
+    uint64_t t;
+    codec_stat_in(cv, 1, cv->srcsize);
+    if (codec_reserveframe(cv->next, size, 0, &buf1, &len1, &buf2, &len2) <= 0) {
+        ATOMIC_ADD(&cv->drops[CODEC_DROP_FULL], 1);
+        return 0;
+    }
+    if (len2) { // converting writes planes in place, needs them whole
+        codec_commitframe(cv->next, -1, 0, 0);
+        ATOMIC_ADD(&cv->drops[CODEC_DROP_FULL], 1);
+        return 0;
+    }
+    t = get_time_us();
+    convert_frame(cv, buf1, buf);
+    codec_stat_encode(cv, (uint32_t)(get_time_us() - t));
+    codec_commitframe(cv->next, size, 0, pts);
+    codec_stat_out(cv, 1, size);
+    return cv->srcsize;
+}
+
+static int convert_writeraw(void *ctxt, uint8_t *buf, int len, int64_t pts)
+{
+    CONVERT *cv = (CONVERT*)ctxt;
+    if (len != cv->srcsize) return -1;
+    return convert_put(cv, buf, pts ? pts : get_time_us());
+}
+
+static int convert_writebuf(void *ctxt, uint8_t *buf, int len)
+{
+    return convert_writeraw(ctxt, buf, len, 0);
+}
+
+static int convert_reserve(void *ctxt, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2)
+{ // capture fills buff, commit converts it into next, one producer thread
+    CONVERT *cv = (CONVERT*)ctxt;
+    if (size != cv->srcsize) return -1;
+    if (ppbuf1) *ppbuf1 = cv->buff;
+    if (plen1 ) *plen1  = size;
+    if (ppbuf2) *ppbuf2 = NULL;
+    if (plen2 ) *plen2  = 0;
+    return size;
+}
+
+static int convert_commit(void *ctxt, int len, uint32_t type, int64_t pts)
+{
+    CONVERT *cv = (CONVERT*)ctxt;
+    if (len < 0) return 0;
+    return convert_put(cv, cv->buff, pts ? pts : get_time_us());
+}
+
+static void convert_config(void *ctxt, int flags, void *param1, uint32_t param2)
+{
+    CONVERT *cv = (CONVERT*)ctxt;
+    codec_config(cv->next, flags, param1, param2);
+}
+
+void* convert_init(void *next, int csp, int w, int h, int stride)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    static const int bpp[] = { 1, 1, 1, 2, 2, 3, 3, 4 }; // bytes of a pixel in the first plane
+    CONVERT *cv;
+    int      srcsize;
+    if (!next || csp < CONVERT_I420 || csp > CONVERT_BGRA || w < 2 || h < 2 || (w & 1) || (h & 1)) return NULL;
+    if (!stride) stride = w * bpp[csp];
+    if (stride < w * bpp[csp] || (csp == CONVERT_I420 && (stride & 1))) {
+        printf("convert stride %d too small for %d pixels !\n", stride, w);
+        return NULL;
+    }
+    srcsize = csp <= CONVERT_NV21 ? stride * h * 3 / 2 : stride * h;
+    pthread_once(&once, convert_dispatch);
+    if (!(cv = codec_init("convert", sizeof(CONVERT), srcsize, next))) return NULL;
+    cv->free     = convert_free;
+    cv->writebuf = convert_writebuf;
+    cv->writeraw = convert_writeraw;
+    cv->config   = convert_config;
+    cv->reserve  = convert_reserve;
+    cv->commit   = convert_commit;
+    cv->csp      = csp;
+    cv->vw       = w;
+    cv->vh       = h;
+    cv->stride   = stride;
+    cv->srcsize  = srcsize;
+    if ((csp == CONVERT_RGB24 || csp == CONVERT_BGR24) && !(cv->rows = malloc(w * 4 * 2))) {
+        convert_free(cv);
+        return NULL;
+    }
+    return cv;
+}
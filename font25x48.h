@@ -4131,6 +4131,7 @@ static char watermark_font[] = {
 
 #define FONT_WIDTH  25
 #define FONT_HEIGHT 48
+#ifndef WATERMARK_FONT_ONLY
 static void watermark_putchar(void *ptr, int width, int x, int y, char c) {
     char *src;
     char *dst;
@@ -4171,6 +4172,7 @@ static void watermark_putstring(void *ptr, int width, int x, int y, char *str) {
         str++;
     }
 }
+#endif
 
 #endif
 
@@ -8,6 +8,8 @@
 #include "ringbuf.h"
 #include "codec.h"
 #include "x264.h"
+#include "trace.h"
+#include "worker.h"
 #include "utils.h"
 
 #define CODEC_FLAG_KEY_FRAME_DROPPED (1 << 3)
@@ -18,173 +20,577 @@ typedef struct {
     x264_param_t param;
     x264_t      *x264;
     int          vw, vh;
-    pthread_t    thread;
+    int          encoding; // head slot is being encoded outside the mutex
+    int          resvpos;  // tail slot handed out by reserve, -1 for none
+    uint32_t     resvgen;  // cleargen it was handed out in
+    uint32_t     cleargen; // CODEC_CONFIG_CLEAR_BUFF count, a slot reserved before a clear is not committed after it
+    x264_picture_t pic_in;
+    int64_t      last;     // pts of the last frame in, x264 wants them strictly increasing
+    int          bitrate;  // from CODEC_CONFIG_SET_BITRATE, applied by the encode step between frames, 0 for none
+    int          frmrate;
+    H264ENC_PARAMS opts;   // what it was opened with, the governor opens x264 again from it with a rung applied
+    H264ENC_RUNG ladder[H264ENC_MAX_RUNGS];
+    int          rungs;    // 0 when the governor is off
+    int          rung;
+    int          avgus;    // encode time per frame, moving average over 8
+    int          settle;   // frames before the governor judges a new rung
+    int          calm;     // frames in a row with headroom
+    int          upwait;   // calm frames it takes to step up, doubles when a step up is undone soon after
+    int          upframes; // frames since the last step up
+    uint32_t     seq;      // raw frames taken, for decimation
+    uint8_t     *small;    // input at half size for rungs with scale
+    int          gen;      // x264 opened again by the governor this many times, goes out with every frame so a file holds one sps
+    uint8_t     *nalbuf;   // slice output, a nal escaped by x264_nal_encode
+    int          nalsize;
+    int          aulen;    // bytes of the frame sent so far, 0 before its first nal
+    int          aukey;
+    int          audrop;   // rest of the frame goes nowhere
+    int          auscale;
+    pthread_t    thread;   // only when not running on the worker pool
+    int64_t      pts[]; // capture time of every raw frame slot in ring
 } H264ENC;
 
-static void* encode_thread_proc(void *param)
+static char *s_presets[] = { "placebo", "veryslow", "slower", "slow", "medium", "fast", "faster", "veryfast", "superfast", "ultrafast" }; // slowest first
+#define PRESET_NUM ((int)(sizeof(s_presets) / sizeof(s_presets[0])))
+
+static int h264enc_param(x264_param_t *param, int bitrate, int frmrate, int w, int h, H264ENC_PARAMS *params);
+
+static void h264enc_headers(H264ENC *enc)
+{
+    x264_nal_t *nals = NULL;
+    int         n, i;
+    if (enc->param.nalu_process) return; // they would go to nalu_process with no frame being encoded, key frames carry them anyway
+    x264_encoder_headers(enc->x264, &nals, &n);
+    for (i=0; i<n; i++) {
+        switch (nals[i].i_type) {
+        case NAL_SPS:
+            enc->spsinfo[0] = MIN(nals[i].i_payload, 255);
+            memcpy(enc->spsinfo + 1, nals[i].p_payload, enc->spsinfo[0]);
+            break;
+        case NAL_PPS:
+            enc->ppsinfo[0] = MIN(nals[i].i_payload, 255);
+            memcpy(enc->ppsinfo + 1, nals[i].p_payload, enc->ppsinfo[0]);
+            break;
+        }
+    }
+}
+
+static void h264enc_output(H264ENC *enc, x264_nal_t *nals, int num, int len, x264_picture_t *pic_out, int scale) // one frame out of x264 into next
+{
+    int key = pic_out->b_keyframe; // idr, or where an intra refresh sweep starts
+    int disp= (nals[num - 1].i_ref_idc == NAL_PRIORITY_DISPOSABLE); // slices come last, no later frame refers to a disposable one
+    codec_stat_out(enc, 1, len);
+    if ((enc->flags & CODEC_FLAG_KEY_FRAME_DROPPED) && !key) {
+        ATOMIC_ADD(&enc->drops[CODEC_DROP_NOKEY], 1);
+        printf("h264enc last reference frame has dropped, and current frame is non-key frame, so drop it !\n");
+    } else if (codec_writeframe_ex(enc->next, nals[0].p_payload, len, CODEC_FOURCC((key ? 'V' : 'v'), 0, (disp ? 'D' : 0), CODEC_VIDEO_STREAM(scale, enc->gen & 0x0F)), pic_out->i_pts, pic_out->i_dts) > 0) { // x264 nals payloads are sequential in memory, frames come in decode order
+        if (key) enc->flags &= ~CODEC_FLAG_KEY_FRAME_DROPPED;
+    } else if (!disp) { // later frames refer to it, drop them until the idr asked for right now
+        printf("h264enc %s frame dropped !\n", key ? "key" : "non-key");
+        pthread_mutex_lock(&enc->mutex);
+        enc->flags |= CODEC_FLAG_KEY_FRAME_DROPPED | CODEC_FLAG_REQIDR;
+        pthread_mutex_unlock(&enc->mutex);
+    }
+}
+
+static void h264enc_nalu(x264_t *h, x264_nal_t *nal, void *opaque) // slice output, x264 calls it from inside x264_encoder_encode as each nal is done
+{
+    H264ENC *enc = (H264ENC*)opaque;
+    int      mbs, first, last;
+    uint8_t *buf;
+    if (!enc) return; // benchmark frames
+    if (enc->nalsize < nal->i_payload * 3 / 2 + 5 + 64) {
+        if (!(buf = realloc(enc->nalbuf, nal->i_payload * 3 / 2 + 5 + 64))) return;
+        enc->nalbuf  = buf;
+        enc->nalsize = nal->i_payload * 3 / 2 + 5 + 64;
+    }
+    x264_nal_encode(h, enc->nalbuf, nal); // escaped with a start code, like the nals x264_encoder_encode returns
+    mbs   = ((enc->param.i_width + 15) / 16) * ((enc->param.i_height + 15) / 16);
+    first = enc->aulen == 0;
+    last  = (nal->i_type == NAL_SLICE || nal->i_type == NAL_SLICE_IDR) && nal->i_last_mb >= mbs - 1;
+    if (first) {
+        enc->aukey  = nal->i_type == NAL_SPS || nal->i_type == NAL_SLICE_IDR; // headers lead idr and intra refresh key frames
+        enc->audrop = (enc->flags & CODEC_FLAG_KEY_FRAME_DROPPED) && !enc->aukey;
+        if (enc->audrop) ATOMIC_ADD(&enc->drops[CODEC_DROP_NOKEY], 1);
+    }
+    enc->aulen += nal->i_payload;
+    codec_stat_out(enc, last, nal->i_payload);
+    if (!enc->audrop && codec_writeframe_ex(enc->next, nal->p_payload, nal->i_payload, CODEC_FOURCC((first && enc->aukey ? 'V' : 'v'), 0, (first && last ? 0 : first ? 'F' : last ? 'L' : 'P'), CODEC_VIDEO_STREAM(enc->auscale, enc->gen & 0x0F)), enc->pic_in.i_pts, enc->pic_in.i_pts) <= 0) {
+        printf("h264enc %s frame dropped at nal %d !\n", enc->aukey ? "key" : "non-key", nal->i_type); // the parts sent already are left without their last one
+        enc->audrop = 1;
+        pthread_mutex_lock(&enc->mutex);
+        enc->flags |= CODEC_FLAG_KEY_FRAME_DROPPED | CODEC_FLAG_REQIDR;
+        pthread_mutex_unlock(&enc->mutex);
+    } else if (last && !enc->audrop && enc->aukey) enc->flags &= ~CODEC_FLAG_KEY_FRAME_DROPPED;
+    if (last) enc->aulen = 0;
+}
+
+static int h264enc_ladder(H264ENC_RUNG *ladder, char *preset) // preset, the faster presets, then a frame rate and size cut
+{
+    int n = 0, i;
+    for (i=0; i<PRESET_NUM && strcmp(s_presets[i], preset); i++);
+    for (i=MIN(i, PRESET_NUM - 1); i<PRESET_NUM; i++,n++) {
+        ladder[n].preset   = s_presets[i];
+        ladder[n].decimate = 1;
+        ladder[n].scale    = 0;
+    }
+    ladder[n].preset = "ultrafast"; ladder[n].decimate = 2; ladder[n++].scale = 0;
+    ladder[n].preset = "ultrafast"; ladder[n].decimate = 2; ladder[n++].scale = 1;
+    ladder[n].preset = "ultrafast"; ladder[n].decimate = 3; ladder[n++].scale = 1;
+    return n;
+}
+
+static int h264enc_setrung(H264ENC *enc, int rung) // open x264 again, its first frame is an idr with the new headers
+{
+    H264ENC_RUNG  *r = &enc->ladder[rung];
+    H264ENC_PARAMS p = enc->opts;
+    x264_param_t   param;
+    x264_t        *x264;
+    x264_picture_t pic_out;
+    x264_nal_t    *nals;
+    int            len, num;
+    int            w = r->scale ? enc->vw / 2 & ~1 : enc->vw, h = r->scale ? enc->vh / 2 & ~1 : enc->vh;
+    p.preset = r->preset;
+    if (h264enc_param(&param, enc->param.rc.i_bitrate * 1000, MAX(1, enc->frmrate / r->decimate), w, h, &p) < 0 || !(x264 = x264_encoder_open(&param))) return -1;
+    x264_picture_init(&pic_out);
+    while (x264_encoder_delayed_frames(enc->x264) > 0 && (len = x264_encoder_encode(enc->x264, &nals, &num, NULL, &pic_out)) >= 0) { // b-frames still inside go out at the old size
+        if (len > 0) h264enc_output(enc, nals, num, len, &pic_out, enc->ladder[enc->rung].scale);
+    }
+    printf("h264enc governor rung %d -> %d, preset %s, 1 of %d frames, %dx%d, encode %d us a frame\n", enc->rung, rung, r->preset, r->decimate, w, h, enc->avgus);
+    x264_encoder_close(enc->x264);
+    enc->x264     = x264;
+    enc->param    = param;
+    enc->rung     = rung;
+    enc->gen     += 1; // new headers, the recorder starts a new file on the idr that carries them
+    enc->settle   = enc->frmrate / r->decimate; // a second for the average to catch up
+    enc->avgus    = 0;
+    enc->calm     = 0;
+    enc->pic_in.img.i_stride[0] = w;
+    enc->pic_in.img.i_stride[1] = w / 2;
+    enc->pic_in.img.i_stride[2] = w / 2;
+    h264enc_headers(enc);
+    return 0;
+}
+
+static void h264enc_govern(H264ENC *enc, int us, int backlog) // after every frame encoded, backlog is raw frames waiting
+{
+    int budget = 1000000 * enc->ladder[enc->rung].decimate / enc->frmrate; // us a frame may take at this rung
+    enc->avgus = enc->avgus ? (enc->avgus * 7 + us) / 8 : us;
+    if (enc->upframes++ == enc->frmrate * 60) enc->upwait = enc->frmrate * 5; // held a minute after stepping up, back to the quick step up
+    if (enc->settle > 0) { enc->settle--; return; }
+    if ((enc->avgus > budget * 9 / 10 || backlog > 1) && enc->rung < enc->rungs - 1) {
+        if (enc->upframes < enc->frmrate * 10) enc->upwait = MIN(enc->upwait * 2, enc->frmrate * 600); // the step up did not hold, wait longer before the next
+        h264enc_setrung(enc, enc->rung + 1);
+    } else if (enc->avgus < budget * 4 / 10 && !backlog && enc->rung > 0) {
+        if (++enc->calm >= enc->upwait && h264enc_setrung(enc, enc->rung - 1) == 0) enc->upframes = 0;
+    } else enc->calm = 0;
+}
+
+static void half_plane(uint8_t *dst, int dw, int dh, uint8_t *src, int sw) // 2x2 box
+{
+    uint8_t *s0, *s1;
+    int      x, y;
+    for (y=0; y<dh; y++,dst+=dw) {
+        s0 = src + 2 * y * sw;
+        s1 = s0 + sw;
+        for (x=0; x<dw; x++) dst[x] = (s0[2 * x] + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1] + 2) >> 2;
+    }
+}
+
+static int h264enc_encode(H264ENC *enc, int wait) // encode one raw frame, return 1 if there was one, the encode thread waits for it
 {
-    H264ENC    *enc = (H264ENC*)param;
     x264_nal_t *nals= NULL;
-    x264_picture_t pic_in, pic_out;
+    x264_picture_t *pic_in = &enc->pic_in, pic_out;
     int yuvsize = enc->vw * enc->vh * 3 / 2;
-    int len, key, num, i;
-    uint32_t size, type, pts;
+    int len = 0, num, bitrate = 0, skip, scale = 0, backlog, w, h, idr = 0;
+    int64_t  pts = 0;
+    uint64_t t;
 
-    x264_picture_init(&pic_in );
-    x264_picture_init(&pic_out);
-    pic_in.img.i_csp       = X264_CSP_I420;
-    pic_in.img.i_plane     = 3;
-    pic_in.img.i_stride[0] = enc->vw;
-    pic_in.img.i_stride[1] = enc->vw / 2;
-    pic_in.img.i_stride[2] = enc->vw / 2;
+    codec_lock(enc); // codec_start, commit and free all signal cond
+    while (wait && (enc->cursize == 0 || !(enc->flags & CODEC_FLAG_START)) && !(enc->flags & CODEC_FLAG_EXIT)) pthread_cond_wait(&enc->cond, &enc->mutex);
+    if ((enc->encoding = enc->cursize >= yuvsize && (enc->flags & CODEC_FLAG_START))) { // take the head slot, it stays in cursize so reserve never hands it out again until given back
+        pic_in->img.plane[0] = enc->buff + enc->head;
+        pic_in->img.plane[1] = enc->buff + enc->head + enc->vw * enc->vh * 4 / 4;
+        pic_in->img.plane[2] = enc->buff + enc->head + enc->vw * enc->vh * 5 / 4;
+        idr                  = enc->flags & CODEC_FLAG_REQIDR;
+        pic_in->i_type       =(idr && !enc->param.b_intra_refresh) ? X264_TYPE_IDR : 0;
+        enc->flags          &=~CODEC_FLAG_REQIDR;
+        pts                  = enc->pts[enc->head / yuvsize];
+        bitrate              = enc->bitrate;
+        enc->bitrate         = 0;
+    }
+    skip = enc->encoding && enc->rungs && enc->seq++ % enc->ladder[enc->rung].decimate; // governor drops frame rate, give the slot back untouched
+    if (skip) {
+        enc->head    += yuvsize;
+        enc->cursize -= yuvsize;
+        enc->encoding = 0;
+        if (enc->head == enc->maxsize) enc->head = 0;
+        if (idr) enc->flags |= CODEC_FLAG_REQIDR; // the next frame taken is the idr
+    }
+    pthread_mutex_unlock(&enc->mutex);
+    if (skip) return 1;
+    if (!enc->encoding) return 0;
 
-    while (!(enc->flags & CODEC_FLAG_EXIT)) {
-        if (!(enc->flags & CODEC_FLAG_START)) { usleep(100*1000); continue; }
+    if (enc->rungs && (scale = enc->ladder[enc->rung].scale)) { // governor halves the size, encode from a box filtered copy
+        w = enc->vw / 2 & ~1;
+        h = enc->vh / 2 & ~1;
+        half_plane(enc->small, w, h, pic_in->img.plane[0], enc->vw);
+        half_plane(enc->small + w * h, w / 2, h / 2, pic_in->img.plane[1], enc->vw / 2);
+        half_plane(enc->small + w * h * 5 / 4, w / 2, h / 2, pic_in->img.plane[2], enc->vw / 2);
+        pic_in->img.plane[0] = enc->small;
+        pic_in->img.plane[1] = enc->small + w * h;
+        pic_in->img.plane[2] = enc->small + w * h * 5 / 4;
+    }
 
-        pthread_mutex_lock(&enc->mutex);
-        while (enc->cursize == 0 && !(enc->flags & CODEC_FLAG_EXIT)) pthread_cond_wait(&enc->cond, &enc->mutex);
-        if (enc->cursize >= yuvsize) {
-            pic_in.img.plane[0] = enc->buff + enc->head;
-            pic_in.img.plane[1] = enc->buff + enc->head + enc->vw * enc->vh * 4 / 4;
-            pic_in.img.plane[2] = enc->buff + enc->head + enc->vw * enc->vh * 5 / 4;
-            pic_in.i_type       =(enc->flags & CODEC_FLAG_REQIDR) ? X264_TYPE_IDR : 0;
-            enc->flags         &=~CODEC_FLAG_REQIDR;
-            enc->head          += yuvsize;
-            enc->cursize       -= yuvsize;
-            if (enc->head == enc->maxsize) enc->head = 0;
-            pts = get_tick_count();
-            len = x264_encoder_encode(enc->x264, &nals, &num, &pic_in, &pic_out);
-        } else len = 0;
-        pthread_mutex_unlock(&enc->mutex);
+    if (bitrate) { // reconfig is only safe from the thread calling x264_encoder_encode
+        enc->param.rc.i_bitrate         = bitrate / 1000;
+        enc->param.rc.i_rc_method       = X264_RC_ABR;
+        enc->param.rc.f_rate_tolerance  = 2;
+        enc->param.rc.i_vbv_max_bitrate = 2 * bitrate / 1000;
+        enc->param.rc.i_vbv_buffer_size = 2 * bitrate / 1000;
+        printf("x264_encoder_reconfig bitrate: %d, ret: %d\n", bitrate, x264_encoder_reconfig(enc->x264, &enc->param));
+    }
 
-        if (len) { // get h264 data
-            key = (nals[0].i_type == NAL_SPS);
-            if ((enc->flags & CODEC_FLAG_KEY_FRAME_DROPPED) && !key) {
-                printf("h264enc last key frame has dropped, and current frame is non-key frame, so drop it !\n");
-            } else {
-                CODEC *next = (CODEC*)enc->next;
-                pthread_mutex_lock(&next->mutex);
-                if (sizeof(uint32_t) * 3 + len <= next->maxsize - next->cursize) {
-                    size = len; type = CODEC_FOURCC((key ? 'V' : 'v'), 0, 0, 0);
-                    next->tail    = ringbuf_write(next->buff, next->maxsize, next->tail, (uint8_t*)&size, sizeof(uint32_t));
-                    next->tail    = ringbuf_write(next->buff, next->maxsize, next->tail, (uint8_t*)&type, sizeof(uint32_t));
-                    next->tail    = ringbuf_write(next->buff, next->maxsize, next->tail, (uint8_t*)&pts , sizeof(uint32_t));
-                    next->cursize+= sizeof(uint32_t) * 3;
-                    for (i=0; i<num; i++) next->tail = ringbuf_write(next->buff, next->maxsize, next->tail, nals[i].p_payload, nals[i].i_payload);
-                    next->cursize+= len;
-                    pthread_cond_signal(&next->cond);
-                    if (key) enc->flags &= ~CODEC_FLAG_KEY_FRAME_DROPPED;
-                } else {
-                    printf("h264enc %s frame dropped !\n", key ? "key" : "non-key");
-                    if (key) enc->flags |=  CODEC_FLAG_KEY_FRAME_DROPPED;
-                }
-                pthread_mutex_unlock(&next->mutex);
-            }
-        }
+    if (idr && enc->param.b_intra_refresh) x264_encoder_intra_refresh(enc->x264); // a new sweep from this frame, with headers and a recovery point sei
+
+    // encode without the mutex, capture thread keeps filling other slots meanwhile
+    pts = enc->last = pts > enc->last ? pts : enc->last + 1; // x264 wants strictly increasing pts
+    pic_in->i_pts = pts;
+    enc->auscale  = scale;
+    x264_picture_init(&pic_out);
+    t   = get_time_us();
+    len = x264_encoder_encode(enc->x264, &nals, &num, pic_in, &pic_out); // x264 copies the picture into its own frame, slot is free once it returns
+    codec_stat_encode(enc, (uint32_t)(get_time_us() - t));
+    pts = pic_out.i_pts; // frame threads and lookahead hand out an earlier frame
+    if (g_trace_enabled) {
+        trace_stamp('v', pic_in->i_pts, TRACE_CAPTURE     , pic_in->i_pts);
+        trace_stamp('v', pic_in->i_pts, TRACE_ENCODE_START, t);
+        if (len > 0) trace_stamp('v', pts, TRACE_ENCODE_END, get_time_us());
     }
+    codec_lock(enc);
+    enc->head    += yuvsize;
+    enc->cursize -= yuvsize;
+    enc->encoding = 0;
+    if (enc->head == enc->maxsize) enc->head = 0;
+    backlog       = enc->cursize / yuvsize;
+    pthread_mutex_unlock(&enc->mutex);
+
+    if (len > 0 && !enc->param.nalu_process) h264enc_output(enc, nals, num, len, &pic_out, scale); // with slice output the nals went out already
+    if (enc->rungs) h264enc_govern(enc, (int)(get_time_us() - t), backlog); // after nals are written out, a rung change closes the x264 they live in
+    return 1;
+}
+
+static void* encode_thread_proc(void *param)
+{
+    H264ENC *enc = (H264ENC*)param;
+    while (!(enc->flags & CODEC_FLAG_EXIT)) h264enc_encode(enc, 1);
     return NULL;
 }
 
+static int encode_task_run(void *ctxt)
+{
+    return h264enc_encode((H264ENC*)ctxt, 0);
+}
+
 static void h264enc_free(void *ctxt)
 {
     H264ENC *enc = (H264ENC*)ctxt;
-    pthread_mutex_lock(&enc->mutex);
-    enc->flags |= CODEC_FLAG_EXIT;
-    pthread_cond_signal(&enc->cond);
-    pthread_mutex_unlock(&enc->mutex);
-    pthread_join(enc->thread, NULL);
+    if (enc->readers[0].task) worker_del(enc->readers[0].task);
+    else {
+        pthread_mutex_lock(&enc->mutex);
+        enc->flags |= CODEC_FLAG_EXIT;
+        pthread_cond_signal(&enc->cond);
+        pthread_mutex_unlock(&enc->mutex);
+        pthread_join(enc->thread, NULL);
+    }
     pthread_mutex_destroy(&enc->mutex);
     pthread_cond_destroy (&enc->cond );
     if (enc->x264) x264_encoder_close(enc->x264);
+    free(enc->small);
+    free(enc->nalbuf);
     free(enc);
 }
 
+static int h264enc_reserve(void *ctxt, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2)
+{ // input ring holds whole raw frames and never wraps inside a frame, only the capture thread writes tail
+    H264ENC *enc = (H264ENC*)ctxt;
+    int yuvsize  = enc->vw * enc->vh * 3 / 2, ret = 0;
+    if (size != yuvsize) return -1;
+    codec_lock(enc);
+    if (enc->cursize + yuvsize <= enc->maxsize) {
+        if (ppbuf1) *ppbuf1 = enc->buff + enc->tail;
+        if (plen1 ) *plen1  = yuvsize;
+        if (ppbuf2) *ppbuf2 = NULL;
+        if (plen2 ) *plen2  = 0;
+        ret = yuvsize;
+        enc->resvpos = enc->tail;
+        enc->resvgen = enc->cleargen;
+    }
+    pthread_mutex_unlock(&enc->mutex);
+    return ret;
+}
+
+static int h264enc_commit(void *ctxt, int len, uint32_t type, int64_t pts)
+{
+    H264ENC *enc = (H264ENC*)ctxt;
+    int yuvsize  = enc->vw * enc->vh * 3 / 2;
+    if (!pts) pts = get_time_us();
+    codec_lock(enc);
+    if (len < 0 || enc->resvpos != enc->tail || enc->resvgen != enc->cleargen) { // canceled, or the ring was cleared since reserve, the slot may be handed out again
+        enc->resvpos = -1;
+        pthread_mutex_unlock(&enc->mutex);
+        return 0;
+    }
+    enc->resvpos = -1;
+    enc->pts[enc->tail / yuvsize] = pts;
+    enc->tail    += yuvsize;
+    enc->cursize += yuvsize;
+    if (enc->tail == enc->maxsize) enc->tail = 0;
+    enc->stats.highwater = MAX(enc->stats.highwater, enc->cursize);
+    codec_stat_in(enc, 1, yuvsize);
+    pthread_cond_signal(&enc->cond);
+    worker_kick(enc->readers[0].task);
+    pthread_mutex_unlock(&enc->mutex);
+    return yuvsize;
+}
+
+static int h264enc_writeraw(void *ctxt, uint8_t *buf, int len, int64_t pts)
+{
+    uint8_t *dst;
+    if (h264enc_reserve(ctxt, len, 0, &dst, NULL, NULL, NULL) <= 0) return 0;
+    memcpy(dst, buf, len);
+    return h264enc_commit(ctxt, len, 0, pts);
+}
+
+static int h264enc_writebuf(void *ctxt, uint8_t *buf, int len) // whole frames only, the ring keeps a pts per frame slot
+{
+    return h264enc_writeraw(ctxt, buf, len, 0);
+}
+
 static void h264enc_config(void *ctxt, int flags, void *param1, uint32_t param2)
 {
     H264ENC *enc = (H264ENC*)ctxt;
     if (flags & CODEC_CONFIG_CLEAR_BUFF) {
         pthread_mutex_lock(&enc->mutex);
-        enc->head = enc->tail = enc->cursize = 0;
+        if (enc->encoding) { // keep the slot being encoded, encode thread gives it back later
+            enc->tail    = enc->head + enc->vw * enc->vh * 3 / 2;
+            enc->cursize = enc->vw * enc->vh * 3 / 2;
+            if (enc->tail == enc->maxsize) enc->tail = 0;
+        } else enc->head = enc->tail = enc->cursize = 0;
+        enc->cleargen++;
         pthread_mutex_unlock(&enc->mutex);
     }
     if (flags & CODEC_CONFIG_REQUEST_IDR) {
+        pthread_mutex_lock(&enc->mutex);
         enc->flags |= CODEC_FLAG_REQIDR;
+        pthread_mutex_unlock(&enc->mutex);
     }
-    if (flags & CODEC_CONFIG_SET_BITRATE) {
-        int bitrate = (int)param2, ret;
-        enc->param.rc.i_bitrate         = bitrate / 1000;
-        enc->param.rc.i_rc_method       = X264_RC_ABR;
-        enc->param.rc.f_rate_tolerance  = 2;
-        enc->param.rc.i_vbv_max_bitrate = 2 * bitrate / 1000;
-        enc->param.rc.i_vbv_buffer_size = 2 * bitrate / 1000;
-        ret = x264_encoder_reconfig(enc->x264, &enc->param);
-        printf("x264_encoder_reconfig bitrate: %d, ret: %d\n", (int)param2, ret);
+    if (flags & CODEC_CONFIG_SET_BITRATE) { // the latest one wins if several come in between two frames
+        pthread_mutex_lock(&enc->mutex);
+        enc->bitrate = (int)param2;
+        pthread_mutex_unlock(&enc->mutex);
     }
 }
 
-void* h264enc_init(int bufsize, void *next, int bitrate, int frmrate , int w, int h)
+static int h264enc_param(x264_param_t *param, int bitrate, int frmrate, int w, int h, H264ENC_PARAMS *params)
 {
-    x264_nal_t *nals= NULL;
-    H264ENC    *enc = NULL;
-    int         n, i;
-
-    if (bufsize < w * h * 3 / 2) bufsize = (w * h * 3 / 2) * 3;
-    else bufsize = bufsize - bufsize % (w * h * 3 / 2);
-    if (!(enc = codec_init("h264enc", sizeof(H264ENC), bufsize, next))) return NULL;
-    enc->free   = h264enc_free;
-    enc->config = h264enc_config;
-
-    x264_param_default_preset(&enc->param, "ultrafast", "zerolatency");
-    x264_param_apply_profile (&enc->param, "baseline");
-    enc->param.b_repeat_headers = 1;
-    enc->param.i_timebase_num   = 1;
-    enc->param.i_timebase_den   = 1000;
-    enc->param.i_csp            = X264_CSP_I420;
-    enc->param.i_width          = w;
-    enc->param.i_height         = h;
-    enc->param.i_fps_num        = frmrate;
-    enc->param.i_fps_den        = 1;
-//  enc->param.i_slice_count_max= 1;
-//  enc->param.i_threads        = 1;
-    enc->param.i_keyint_min     = frmrate * 2;
-    enc->param.i_keyint_max     = frmrate * 5;
-    enc->param.rc.i_bitrate     = bitrate / 1000;
+    H264ENC_PARAMS p = {0};
+    if (params) p = *params;
+    if (!p.preset ) p.preset  = "ultrafast";
+    if (!p.tune   ) p.tune    = p.bframes ? "" : "zerolatency"; // zerolatency turns b-frames and lookahead off
+    if (!p.profile) p.profile = p.bframes ? "main" : "baseline"; // baseline has no b-frames
+    if (x264_param_default_preset(param, p.preset, p.tune[0] ? p.tune : NULL) < 0) {
+        printf("h264enc unknown preset %s or tune %s !\n", p.preset, p.tune);
+        return -1;
+    }
+    param->b_repeat_headers = 1;
+    param->i_timebase_num   = 1;
+    param->i_timebase_den   = 1000000; // pts is capture time in us
+    param->i_csp            = X264_CSP_I420;
+    param->i_width          = w;
+    param->i_height         = h;
+    param->i_fps_num        = frmrate;
+    param->i_fps_den        = 1;
+    param->i_keyint_min     = frmrate * 2;
+    param->i_keyint_max     = frmrate * 5;
+    param->rc.i_bitrate     = bitrate / 1000;
 #if 0 // X264_RC_CQP
-    enc->param.rc.i_rc_method       = X264_RC_CQP;
-    enc->param.rc.i_qp_constant     = 35;
-    enc->param.rc.i_qp_min          = 25;
-    enc->param.rc.i_qp_max          = 50;
+    param->rc.i_rc_method       = X264_RC_CQP;
+    param->rc.i_qp_constant     = 35;
+    param->rc.i_qp_min          = 25;
+    param->rc.i_qp_max          = 50;
 #endif
 #if 0 // X264_RC_CRF
-    enc->param.rc.i_rc_method       = X264_RC_CRF;
-    enc->param.rc.f_rf_constant     = 25;
-    enc->param.rc.f_rf_constant_max = 50;
+    param->rc.i_rc_method       = X264_RC_CRF;
+    param->rc.f_rf_constant     = 25;
+    param->rc.f_rf_constant_max = 50;
 #endif
 #if 1 // X264_RC_ABR
-    enc->param.rc.i_rc_method       = X264_RC_ABR;
-    enc->param.rc.f_rate_tolerance  = 2;
-    enc->param.rc.i_vbv_max_bitrate = 2 * bitrate / 1000;
-    enc->param.rc.i_vbv_buffer_size = 2 * bitrate / 1000;
+    param->rc.i_rc_method       = X264_RC_ABR;
+    param->rc.f_rate_tolerance  = 2;
+    param->rc.i_vbv_max_bitrate = 2 * bitrate / 1000;
+    param->rc.i_vbv_buffer_size = 2 * bitrate / 1000;
 #endif
+    if (p.threads  ) param->i_threads         = p.threads;
+    if (p.threading) param->b_sliced_threads  = p.threading == H264ENC_THREADS_SLICED;
+    if (p.slices   ) param->i_slice_count_max = p.slices;
+    if (p.lookahead) param->rc.i_lookahead    = p.lookahead;
+    if (p.bframes  ) param->i_bframe          = p.bframes;
+    if (p.sliceout ) { // x264 must finish the frame it is given within the call and in slice order, one thread, no delay
+        param->nalu_process      = h264enc_nalu;
+        param->i_slice_count     = MAX(2, p.slices);
+        param->i_slice_count_max = 0;
+        param->i_threads         = 1;
+        param->b_sliced_threads  = 0;
+        param->i_bframe          = 0;
+        param->rc.i_lookahead    = 0;
+        param->i_sync_lookahead  = 0;
+        param->rc.b_mb_tree      = 0;
+    }
+    if (p.intrarefresh) { // i frames are spread over the sweep, the bitrate stays flat
+        param->b_intra_refresh = 1;
+        param->i_keyint_max    = frmrate * 2; // sweep length, a file opened on a recovery point is clean after it
+    }
+    if (x264_param_apply_profile(param, p.profile) < 0) { // last, it may undo settings the profile does not allow
+        printf("h264enc unknown profile %s !\n", p.profile);
+        return -1;
+    }
+    return 0;
+}
 
-    enc->vw   = w;
-    enc->vh   = h;
-    enc->x264 = x264_encoder_open(&enc->param);
+void* h264enc_init(int bufsize, void *next, int bitrate, int frmrate , int w, int h)
+{
+    return h264enc_init_ex(bufsize, next, bitrate, frmrate, w, h, NULL);
+}
 
-    x264_encoder_headers(enc->x264, &nals, &n);
-    for (i=0; i<n; i++) {
-        switch (nals[i].i_type) {
-        case NAL_SPS:
-            enc->spsinfo[0] = MIN(nals[i].i_payload, 255);
-            memcpy(enc->spsinfo + 1, nals[i].p_payload, enc->spsinfo[0]);
-            break;
-        case NAL_PPS:
-            enc->ppsinfo[0] = MIN(nals[i].i_payload, 255);
-            memcpy(enc->ppsinfo + 1, nals[i].p_payload, enc->ppsinfo[0]);
-            break;
+void* h264enc_init_ex(int bufsize, void *next, int bitrate, int frmrate, int w, int h, H264ENC_PARAMS *params)
+{
+    H264ENC    *enc = NULL;
+    H264ENC_PARAMS p = {0};
+    int         i;
+
+    if (bufsize < w * h * 3 / 2) bufsize = (w * h * 3 / 2) * 3;
+    else bufsize = bufsize - bufsize % (w * h * 3 / 2);
+    if (!(enc = codec_init("h264enc", sizeof(H264ENC) + bufsize / (w * h * 3 / 2) * sizeof(int64_t), bufsize, next))) return NULL;
+    if (params) p = *params;
+    enc->readers[0].task = worker_add(encode_task_run, enc, WORKER_PRIO_NORMAL);
+    if (enc->readers[0].task && !p.threads) p.threads = 1; // the pool already encodes channels in parallel, x264 threads on top of it only oversubscribe
+    if (p.governor) {
+        if (p.ladder && p.rungs > 0) memcpy(enc->ladder, p.ladder, MIN(p.rungs, H264ENC_MAX_RUNGS) * sizeof(H264ENC_RUNG));
+        enc->rungs = p.ladder && p.rungs > 0 ? MIN(p.rungs, H264ENC_MAX_RUNGS) : h264enc_ladder(enc->ladder, p.preset ? p.preset : "ultrafast");
+        for (i=0; i<enc->rungs; i++) {
+            enc->ladder[i].decimate = MAX(1, enc->ladder[i].decimate);
+            enc->ladder[i].scale    = MIN(1, MAX(0, enc->ladder[i].scale)); // half size only
+            if (enc->ladder[i].scale && !enc->small) enc->small = malloc(w * h * 3 / 8 + 16);
         }
+        p.preset      = enc->ladder[0].preset;
+        enc->frmrate  = frmrate;
+        enc->upwait   = frmrate * 5;
+        enc->opts     = p;
+        enc->opts.ladder = NULL;
+    }
+    if ((enc->rungs && !enc->ladder[0].preset) || (enc->ladder[0].scale && !enc->small) || h264enc_param(&enc->param, bitrate, frmrate, w, h, &p) < 0 || !(enc->x264 = x264_encoder_open(&enc->param))) {
+        worker_del(enc->readers[0].task);
+        codec_free(enc);
+        return NULL;
     }
+    enc->free    = h264enc_free;
+    enc->config  = h264enc_config;
+    enc->reserve = h264enc_reserve;
+    enc->commit  = h264enc_commit;
+    enc->writebuf= h264enc_writebuf;
+    enc->writeraw= h264enc_writeraw;
+    enc->vw      = w;
+    enc->vh      = h;
+    enc->resvpos = -1;
+    x264_picture_init(&enc->pic_in);
+    enc->pic_in.opaque          = enc; // for h264enc_nalu
+    enc->pic_in.img.i_csp       = X264_CSP_I420;
+    enc->pic_in.img.i_plane     = 3;
+    enc->pic_in.img.i_stride[0] = w;
+    enc->pic_in.img.i_stride[1] = w / 2;
+    enc->pic_in.img.i_stride[2] = w / 2;
 
-    pthread_create(&enc->thread, NULL, encode_thread_proc, enc);
+    h264enc_headers(enc);
+    if (enc->rungs && (enc->ladder[0].decimate > 1 || enc->ladder[0].scale)) h264enc_setrung(enc, 0);
+
+    if (!enc->readers[0].task) pthread_create(&enc->thread, NULL, encode_thread_proc, enc);
     return enc;
 }
+
+int h264enc_benchmark(int bitrate, int frmrate, int w, int h, H264ENC_PARAMS *params, int frames, H264ENC_BENCH *bench)
+{ // frames go in back to back, latency counts frames x264 holds for frame threads and lookahead
+    #define BENCH_PICS 8
+    x264_param_t   param;
+    x264_picture_t pic_in, pic_out;
+    x264_nal_t    *nals;
+    x264_t        *x264;
+    uint8_t       *yuv;
+    uint64_t      *tin, start, now, total = 0;
+    int            yuvsize = w * h * 3 / 2, len, num, i, x, y;
+
+    memset(bench, 0, sizeof(H264ENC_BENCH));
+    if (h264enc_param(&param, bitrate, frmrate, w, h, params) < 0) return -1;
+    param.i_log_level = X264_LOG_WARNING;
+    yuv = malloc(yuvsize * BENCH_PICS);
+    tin = calloc(frames, sizeof(uint64_t));
+    if (!yuv || !tin || !(x264 = x264_encoder_open(&param))) { free(yuv); free(tin); return -1; }
+    x264_encoder_parameters(x264, &param);
+    bench->threads = param.i_threads;
+
+    for (i=0; i<BENCH_PICS; i++) { // moving gradient with noise, so motion search and residual coding both have work
+        uint8_t *p = yuv + i * yuvsize;
+        for (y=0; y<h; y++) for (x=0; x<w; x++) p[y * w + x] = (uint8_t)(x + y + i * 8 + (rand() & 15));
+        memset(p + w * h, 128 + i, w * h / 2);
+    }
+    x264_picture_init(&pic_in );
+    x264_picture_init(&pic_out);
+    pic_in.img.i_csp       = X264_CSP_I420;
+    pic_in.img.i_plane     = 3;
+    pic_in.img.i_stride[0] = w;
+    pic_in.img.i_stride[1] = w / 2;
+    pic_in.img.i_stride[2] = w / 2;
+
+    start = get_time_us();
+    for (i=0; i<frames || x264_encoder_delayed_frames(x264) > 0; ) {
+        if (i < frames) {
+            pic_in.img.plane[0] = yuv + i % BENCH_PICS * yuvsize;
+            pic_in.img.plane[1] = pic_in.img.plane[0] + w * h;
+            pic_in.img.plane[2] = pic_in.img.plane[0] + w * h * 5 / 4;
+            pic_in.i_pts = (int64_t)i * 1000000 / frmrate; // us at the frame rate, so ratecontrol sees real frame durations
+            tin[i++]     = get_time_us();
+            len = x264_encoder_encode(x264, &nals, &num, &pic_in, &pic_out);
+        } else len = x264_encoder_encode(x264, &nals, &num, NULL, &pic_out); // flush frames still inside x264
+        if (len <= 0) continue;
+        now = get_time_us() - tin[MIN(frames - 1, (int)((pic_out.i_pts * frmrate + 500000) / 1000000))]; // back to the frame index
+        total += now;
+        bench->latency_max = MAX(bench->latency_max, (uint32_t)now);
+        bench->frames++;
+    }
+    now = get_time_us() - start;
+    bench->fps         = now ? bench->frames * 1000000.0f / now : 0;
+    bench->latency_avg = bench->frames ? (uint32_t)(total / bench->frames) : 0;
+    x264_encoder_close(x264);
+    free(yuv);
+    free(tin);
+    return 0;
+}
+
+char* h264enc_calibrate(int bitrate, int frmrate, int w, int h, int load, H264ENC_PARAMS *params)
+{ // one thread each, as on the pool, from the fastest preset up while the core keeps up
+    H264ENC_PARAMS p = {0};
+    H264ENC_BENCH  bench;
+    char          *best = "ultrafast";
+    int            i;
+    if (params) p = *params;
+    p.threads = 1;
+    for (i=PRESET_NUM-1; i>=0; i--) { // slower than medium is never worth it live
+        p.preset = s_presets[i];
+        if (h264enc_benchmark(bitrate, frmrate, w, h, &p, frmrate * 2, &bench) < 0 || bench.fps < (float)frmrate * MAX(1, load) * 5 / 4) break;
+        best = s_presets[i];
+        if (strcmp(best, "medium") == 0) break;
+    }
+    printf("h264enc calibrate %dx%d@%d x %d: preset %s\n", w, h, frmrate, MAX(1, load), best);
+    if (params) params->preset = best;
+    return best;
+}
@@ -26,11 +26,15 @@
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
 #define MP4_FOURCC(a, b, c, d)  (((a) << 0) | ((b) << 8) | ((c) << 16) | ((d) << 24))
 
 #define ENABLE_RECALCULATE_DURATION     1
-#define VIDEO_TIMESCALE_BY_FRAME_RATE   1
-#define AUDIO_TIMESCALE_BY_SAMPLE_RATE  1
+#define VIDEO_TIMESCALE_BY_FRAME_RATE   0 // 0 gives every frame its own duration from pts, variable frame rate
+#define AUDIO_TIMESCALE_BY_SAMPLE_RATE  1 // audio pts come from sample counts, every frame lasts sampnum exactly
+#define VIDEO_PTS_TIMESCALE             90000
 
 #pragma pack(1)
 typedef struct {
@@ -83,6 +87,15 @@ typedef struct {
     uint32_t  tkhdv_width;
     uint32_t  tkhdv_height;
 
+    uint32_t  edtsv_size; // the track starts after the other one by an empty edit, see write_edts
+    uint32_t  edtsv_type;
+    uint32_t  elstv_size;
+    uint32_t  elstv_type;
+    uint8_t   elstv_version;
+    uint8_t   elstv_flags[3];
+    uint32_t  elstv_count;
+    uint32_t  elstv_entry[6]; // segment duration, media time and rate of each edit, a free box after a single one
+
     uint32_t  mdiav_size;
     uint32_t  mdiav_type;
 
@@ -164,6 +177,12 @@ typedef struct {
     uint8_t   sttsv_flags[3];
     uint32_t  sttsv_count;
 
+    uint32_t  cttsv_size; // a free box until a frame has its pts apart from its dts
+    uint32_t  cttsv_type;
+    uint8_t   cttsv_version;
+    uint8_t   cttsv_flags[3];
+    uint32_t  cttsv_count;
+
     uint32_t  stssv_size;
     uint32_t  stssv_type;
     uint8_t   stssv_version;
@@ -192,6 +211,22 @@ typedef struct {
     uint8_t   stcov_flags[3];
     uint32_t  stcov_count;
 
+    uint32_t  sgpdv_size; // roll group of intra refresh recovery points, they are not sync samples, free boxes until one comes
+    uint32_t  sgpdv_type;
+    uint8_t   sgpdv_version;  // 1
+    uint8_t   sgpdv_flags[3];
+    uint32_t  sgpdv_grouping; // 'roll'
+    uint32_t  sgpdv_deflen;   // 2
+    uint32_t  sgpdv_count;    // 1
+    int16_t   sgpdv_roll;     // recovery_frame_cnt, samples to decode before the picture is clean
+
+    uint32_t  sbgpv_size;
+    uint32_t  sbgpv_type;
+    uint8_t   sbgpv_version;
+    uint8_t   sbgpv_flags[3];
+    uint32_t  sbgpv_grouping;
+    uint32_t  sbgpv_count;
+
     // audio track
     uint32_t  traka_size;
     uint32_t  traka_type;
@@ -215,6 +250,15 @@ typedef struct {
     uint32_t  tkhda_width;
     uint32_t  tkhda_height;
 
+    uint32_t  edtsa_size;
+    uint32_t  edtsa_type;
+    uint32_t  elsta_size;
+    uint32_t  elsta_type;
+    uint8_t   elsta_version;
+    uint8_t   elsta_flags[3];
+    uint32_t  elsta_count;
+    uint32_t  elsta_entry[6];
+
     uint32_t  mdiaa_size;
     uint32_t  mdiaa_type;
 
@@ -346,14 +390,18 @@ typedef struct {
     int       sampnum;
 
     int       sttsv_off;
+    int       cttsv_off;
     int       stssv_off;
     int       stszv_off;
     int       stcov_off;
+    int       sgpdv_off;
     int       sttsv_cur;
+    int       cttsv_cur;
     int       stssv_cur;
     int       stszv_cur;
     int       stcov_cur;
 
+    int       edtsa_off;
     int       sttsa_off;
     int       stsza_off;
     int       stcoa_off;
@@ -362,15 +410,24 @@ typedef struct {
     int       stcoa_cur;
 
     int       chunk_off;
-    uint32_t  vpts_last;
-    uint32_t  apts_last;
+    int64_t   ctsbase; // pts - dts of the first frame in timescale units, its composition offset is 0
+    int64_t   vpts_first;
+    int64_t   vpts_last;
+    int64_t   apts_last;
+    int64_t   vstart; // capture time at media time 0 of each track, the edit lists line them up
+    int64_t   astart;
     int       aframemax;
     int       vframemax;
     int       syncf_max;
+    int       sbgpv_max;  // runs sbgpv_buf holds
+    int       sbgpv_last; // samples the runs cover
+    int       rollmax;
     uint32_t *sttsv_buf;
+    uint32_t *cttsv_buf;
     uint32_t *stssv_buf;
     uint32_t *stszv_buf;
     uint32_t *stcov_buf;
+    uint32_t *sbgpv_buf;
     uint32_t *sttsa_buf;
     uint32_t *stsza_buf;
     uint32_t *stcoa_buf;
@@ -423,6 +480,17 @@ static uint8_t getbyte(uint8_t *buf1, int len1, uint8_t *buf2, int len2, int i)
     return (i < len1) ? buf1[i] : buf2[i - len1];
 }
 
+static int sei_recovery_cnt(uint8_t *buf1, int len1, uint8_t *buf2, int len2, int i, int end) // ue(v) recovery_frame_cnt of a recovery point sei payload at i, -1 if cut short
+{
+    int zeros = 0, val = 0, pos = i * 8, k;
+    #define SEI_BIT(pos) ((getbyte(buf1, len1, buf2, len2, (pos) / 8) >> (7 - (pos) % 8)) & 1)
+    for (; pos < end * 8 && !SEI_BIT(pos); pos++) zeros++;
+    if (zeros > 15 || pos + 1 + zeros > end * 8) return -1;
+    for (pos++,k=0; k<zeros; k++,pos++) val = val * 2 + SEI_BIT(pos);
+    #undef SEI_BIT
+    return (1 << zeros) - 1 + val;
+}
+
 static void getdata(uint8_t *buf1, int len1, uint8_t *buf2, int len2, int i, uint8_t *data, int size)
 {
     int n;
@@ -451,9 +519,25 @@ static void writedata(uint8_t *buf1, int len1, uint8_t *buf2, int len2, int i, i
     }
 }
 
+static int h26x_find_start_code(uint8_t *data, int len, int idx, int *hsize) // flat buffer version of h26x_parse_nalu_header
+{
+    uint8_t *p = data + idx, *end = data + len;
+    int      n;
+    while (p < end && (p = memchr(p, 0x01, end - p))) {
+        if (p - data >= idx + 2 && p[-1] == 0 && p[-2] == 0) {
+            for (n = 2; p - data - n > idx && p[-n - 1] == 0; n++);
+            *hsize = n + 1;
+            return p - data + 1;
+        }
+        p++;
+    }
+    return -1;
+}
+
 static int h26x_parse_nalu_header(uint8_t *data1, int len1, uint8_t *data2, int len2, int idx, int *hsize)
 {
     int len = len1 + len2, counter, i;
+    if (len2 == 0) return h26x_find_start_code(data1, len1, idx, hsize);
     for (counter = 0, i = idx; i < len; i++) {
         uint8_t byte = getbyte(data1, len1, data2, len2, i);
         if (byte == 0) counter++;
@@ -565,13 +649,71 @@ static void mp4muxer_write_hev1_box(MP4FILE *mp4, uint8_t *vpsbuf, int vpslen, u
     fseek(mp4->fp, 0, SEEK_END);
 }
 
+static uint32_t pts_delta(int64_t pts, int64_t last, int timescale) // us apart in timescale units, rounded by absolute time so it never drifts
+{
+    return (uint32_t)(pts * timescale / 1000000 - last * timescale / 1000000);
+}
+
+static uint32_t trackv_duration(MP4FILE *mp4) // ms
+{
+    if (!mp4->stszv_count) return 0;
+#if VIDEO_TIMESCALE_BY_FRAME_RATE
+    return ntohl(mp4->stszv_count) * 1000 / mp4->frate;
+#else
+    return (uint32_t)((mp4->vpts_last - mp4->vpts_first) / 1000 + ntohl(mp4->sttsv_buf[ntohl(mp4->sttsv_count) * 2 - 1]) * 1000 / VIDEO_PTS_TIMESCALE);
+#endif
+}
+
+static uint32_t tracka_duration(MP4FILE *mp4) // ms
+{
+    if (!mp4->stsza_count) return 0;
+#if AUDIO_TIMESCALE_BY_SAMPLE_RATE
+    return (uint32_t)((int64_t)ntohl(mp4->stsza_count) * mp4->sampnum * 1000 / mp4->samprate);
+#else
+    return (uint32_t)((mp4->apts_last - mp4->astart) / 1000 + ntohl(mp4->sttsa_buf[ntohl(mp4->sttsa_count) * 2 - 1]));
+#endif
+}
+
+static uint32_t track_delay(MP4FILE *mp4, int64_t start) // ms a track starting at start begins after the earlier one
+{
+    int64_t first = start;
+    if (mp4->stszv_count && mp4->vstart < first) first = mp4->vstart;
+    if (mp4->stsza_count && mp4->astart < first) first = mp4->astart;
+    return (uint32_t)((start - first) / 1000);
+}
+
+static void write_edts(MP4FILE *mp4, uint32_t *edts, int off, uint32_t delay, uint32_t duration) // edts points to the 12 words from edts_size, elst gets an empty edit for the delay and one for the track
+{
+    uint32_t *e = edts + 6, n = 0;
+    if (delay) { // nothing of this track is shown until the other one has played delay ms
+        e[0] = htonl(delay);
+        e[1] = htonl(0xFFFFFFFF);
+        e[2] = htonl(0x00010000);
+        e += 3; n++;
+    }
+    e[0] = htonl(duration);
+    e[1] = 0;
+    e[2] = htonl(0x00010000);
+    e += 3; n++;
+    if (n == 1) { // the room of the empty edit
+        e[0] = htonl(12);
+        e[1] = MP4_FOURCC('f', 'r', 'e', 'e');
+        e[2] = 0;
+    }
+    edts[2] = htonl(16 + n * 12);
+    edts[5] = htonl(n);
+    fseek(mp4->fp, off, SEEK_SET);
+    fwrite(edts, sizeof(uint32_t) * 12, 1, mp4->fp);
+}
+
 static void write_fixed_trackv_data(MP4FILE *mp4)
 {
     if (ENABLE_RECALCULATE_DURATION) { // re-calculate and re-write duration
-        mp4->mvhd_duration = htonl((ntohl(mp4->stszv_count) + mp4->frate - 1) / mp4->frate * 1000);
+        mp4->mvhd_duration = htonl(MAX(track_delay(mp4, mp4->vstart) + trackv_duration(mp4), track_delay(mp4, mp4->astart) + tracka_duration(mp4)));
         fseek(mp4->fp, offsetof(MP4FILE, mvhd_duration), SEEK_SET);
         fwrite(&mp4->mvhd_duration, sizeof(uint32_t) * 1, 1, mp4->fp);
     }
+    if (mp4->stszv_count) write_edts(mp4, &mp4->edtsv_size, offsetof(MP4FILE, edtsv_size), track_delay(mp4, mp4->vstart), trackv_duration(mp4));
 #if VIDEO_TIMESCALE_BY_FRAME_RATE
     if (1) {
         fseek(mp4->fp, mp4->sttsv_off + 12, SEEK_SET);
@@ -584,9 +726,16 @@ static void write_fixed_trackv_data(MP4FILE *mp4)
         fwrite(&mp4->sttsv_count, sizeof(uint32_t), 1, mp4->fp);
         fseek(mp4->fp, mp4->sttsv_cur * sizeof(uint32_t) * 2, SEEK_CUR);
         fwrite(&mp4->sttsv_buf[mp4->sttsv_cur], (ntohl(mp4->sttsv_count) - mp4->sttsv_cur) * sizeof(uint32_t) * 2, 1, mp4->fp);
-        mp4->sttsv_cur = ntohl(mp4->sttsv_count);
+        mp4->sttsv_cur = ntohl(mp4->sttsv_count) - 1; // the last duration is a guess until the next sample comes
     }
 #endif
+    if (mp4->cttsv_buf && mp4->cttsv_type == MP4_FOURCC('c', 't', 't', 's') && mp4->cttsv_cur < (int)ntohl(mp4->cttsv_count)) {
+        fseek(mp4->fp, mp4->cttsv_off, SEEK_SET);
+        fwrite(&mp4->cttsv_size, 16, 1, mp4->fp); // the box was free until now
+        fseek(mp4->fp, mp4->cttsv_cur * sizeof(uint32_t) * 2, SEEK_CUR);
+        fwrite(&mp4->cttsv_buf[mp4->cttsv_cur * 2], (ntohl(mp4->cttsv_count) - mp4->cttsv_cur) * sizeof(uint32_t) * 2, 1, mp4->fp);
+        mp4->cttsv_cur = ntohl(mp4->cttsv_count);
+    }
     if (mp4->stssv_buf && mp4->stssv_cur < (int)ntohl(mp4->stssv_count)) {
         fseek(mp4->fp, mp4->stssv_off + 12, SEEK_SET);
         fwrite(&mp4->stssv_count, sizeof(uint32_t), 1, mp4->fp);
@@ -608,6 +757,12 @@ static void write_fixed_trackv_data(MP4FILE *mp4)
         fwrite(&mp4->stcov_buf[mp4->stcov_cur], (ntohl(mp4->stcov_count) - mp4->stcov_cur) * sizeof(uint32_t), 1, mp4->fp);
         mp4->stcov_cur = ntohl(mp4->stcov_count);
     }
+    if (mp4->sbgpv_buf && mp4->sbgpv_count) { // the last run may have grown, all of them are written again, there are few
+        fseek(mp4->fp, mp4->sgpdv_off, SEEK_SET);
+        fwrite(&mp4->sgpdv_size, 26, 1, mp4->fp);
+        fwrite(&mp4->sbgpv_size, 20, 1, mp4->fp);
+        fwrite(mp4->sbgpv_buf, ntohl(mp4->sbgpv_count) * sizeof(uint32_t) * 2, 1, mp4->fp);
+    }
     fseek(mp4->fp, ntohl(mp4->ftyp_size) + (int)ntohl(mp4->moov_size), SEEK_SET);
     fwrite(&mp4->mdat_size, sizeof(uint32_t), 1, mp4->fp);
     fseek(mp4->fp, 0, SEEK_END);
@@ -615,6 +770,7 @@ static void write_fixed_trackv_data(MP4FILE *mp4)
 
 static void write_fixed_tracka_data(MP4FILE *mp4)
 {
+    if (mp4->stsza_count) write_edts(mp4, &mp4->edtsa_size, mp4->edtsa_off, track_delay(mp4, mp4->astart), tracka_duration(mp4));
 #if AUDIO_TIMESCALE_BY_SAMPLE_RATE
     if (1) {
         fseek(mp4->fp, mp4->sttsa_off + 12, SEEK_SET);
@@ -627,7 +783,7 @@ static void write_fixed_tracka_data(MP4FILE *mp4)
         fwrite(&mp4->sttsa_count, sizeof(uint32_t), 1, mp4->fp);
         fseek(mp4->fp, mp4->sttsa_cur * sizeof(uint32_t) * 2, SEEK_CUR);
         fwrite(&mp4->sttsa_buf[mp4->sttsa_cur], (ntohl(mp4->sttsa_count) - mp4->sttsa_cur) * sizeof(uint32_t) * 2, 1, mp4->fp);
-        mp4->sttsa_cur = ntohl(mp4->sttsa_count);
+        mp4->sttsa_cur = ntohl(mp4->sttsa_count) - 1;
     }
 #endif
     if (mp4->stsza_buf && mp4->stsza_cur < (int)ntohl(mp4->stsza_count)) {
@@ -692,7 +848,7 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
     // video track
     mp4->trakv_size          = offsetof(MP4FILE, mdiav_size) - offsetof(MP4FILE, trakv_size);
     mp4->trakv_type          = MP4_FOURCC('t', 'r', 'a', 'k');
-    mp4->tkhdv_size          = htonl(offsetof(MP4FILE, mdiav_size) - offsetof(MP4FILE, tkhdv_size));
+    mp4->tkhdv_size          = htonl(offsetof(MP4FILE, edtsv_size) - offsetof(MP4FILE, tkhdv_size));
     mp4->tkhdv_type          = MP4_FOURCC('t', 'k', 'h', 'd');
     mp4->tkhdv_flags[2]      = 0xF;
     mp4->tkhdv_trackid       = htonl(1         );
@@ -702,6 +858,9 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
     mp4->tkhdv_matrix[8]     = htonl(0x40000000);
     mp4->tkhdv_width         = htonl(w << 16   );
     mp4->tkhdv_height        = htonl(h << 16   );
+    mp4->edtsv_size          = htonl(offsetof(MP4FILE, mdiav_size) - offsetof(MP4FILE, edtsv_size));
+    mp4->edtsv_type          = MP4_FOURCC('e', 'd', 't', 's');
+    mp4->elstv_type          = MP4_FOURCC('e', 'l', 's', 't');
 
     mp4->mdiav_size          = offsetof(MP4FILE, minfv_size) - offsetof(MP4FILE, mdiav_size);
     mp4->mdiav_type          = MP4_FOURCC('m', 'd', 'i', 'a');
@@ -711,8 +870,8 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
     mp4->mdhdv_timescale     = htonl(frate);
     mp4->mdhdv_duration      = htonl(duration * frate / 1000);
 #else
-    mp4->mdhdv_timescale     = htonl(1000 );
-    mp4->mdhdv_duration      = htonl(duration);
+    mp4->mdhdv_timescale     = htonl(VIDEO_PTS_TIMESCALE);
+    mp4->mdhdv_duration      = htonl((uint32_t)((int64_t)duration * VIDEO_PTS_TIMESCALE / 1000));
 #endif
     mp4->hdlrv_size          = htonl(offsetof(MP4FILE, minfv_size) - offsetof(MP4FILE, hdlrv_size));
     mp4->hdlrv_type          = MP4_FOURCC('h', 'd', 'l', 'r');
@@ -753,6 +912,10 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
 #endif
     mp4->sttsv_type          = MP4_FOURCC('s', 't', 't', 's');
 
+    mp4->cttsv_size          = 16 + mp4->vframemax * sizeof(uint32_t) * 2;
+    mp4->cttsv_type          = MP4_FOURCC('f', 'r', 'e', 'e');
+    mp4->cttsv_version       = 1; // signed offsets, b-frames come out before the first frame's offset
+
     mp4->stssv_size          = 16 + mp4->syncf_max * sizeof(uint32_t) * 1;
     mp4->stssv_type          = MP4_FOURCC('s', 't', 's', 's');
 
@@ -770,28 +933,46 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
     mp4->stcov_size          = 16 + mp4->vframemax * sizeof(uint32_t) * 1;
     mp4->stcov_type          = MP4_FOURCC('s', 't', 'c', 'o');
 
+    mp4->sbgpv_max           = mp4->syncf_max * 2 + 2; // a run of other samples before each recovery point
+    mp4->sgpdv_size          = 26;
+    mp4->sgpdv_type          = MP4_FOURCC('f', 'r', 'e', 'e');
+    mp4->sgpdv_version       = 1;
+    mp4->sgpdv_grouping      = MP4_FOURCC('r', 'o', 'l', 'l');
+    mp4->sgpdv_deflen        = htonl(2);
+    mp4->sgpdv_count         = htonl(1);
+    mp4->sbgpv_size          = 20 + mp4->sbgpv_max * sizeof(uint32_t) * 2;
+    mp4->sbgpv_type          = MP4_FOURCC('f', 'r', 'e', 'e');
+    mp4->sbgpv_grouping      = MP4_FOURCC('r', 'o', 'l', 'l');
+
     mp4->stsdv_size         += mp4->stsdv_ahvc1_size;
-    mp4->stblv_size         += mp4->stsdv_size + mp4->sttsv_size + mp4->stssv_size + mp4->stscv_size + mp4->stszv_size + mp4->stcov_size;
+    mp4->stblv_size         += mp4->stsdv_size + mp4->sttsv_size + mp4->cttsv_size + mp4->stssv_size + mp4->stscv_size + mp4->stszv_size + mp4->stcov_size + mp4->sgpdv_size + mp4->sbgpv_size;
     mp4->minfv_size         += mp4->stblv_size;
     mp4->mdiav_size         += mp4->minfv_size;
     mp4->trakv_size         += mp4->mdiav_size;
     mp4->moov_size          += mp4->trakv_size;
 
     mp4->sttsv_off           = offsetof(MP4FILE, sttsv_size);
-    mp4->stssv_off           = mp4->sttsv_off + mp4->sttsv_size;
+    mp4->cttsv_off           = mp4->sttsv_off + mp4->sttsv_size;
+    mp4->stssv_off           = mp4->cttsv_off + mp4->cttsv_size;
     mp4->stszv_off           = mp4->stssv_off + mp4->stssv_size + mp4->stscv_size;
     mp4->stcov_off           = mp4->stszv_off + mp4->stszv_size;
+    mp4->sgpdv_off           = mp4->stcov_off + mp4->stcov_size;
 
     mp4->sttsv_buf           = calloc(1, mp4->sttsv_size - 16);
+    mp4->cttsv_buf           = calloc(1, mp4->cttsv_size - 16);
     mp4->stssv_buf           = calloc(1, mp4->stssv_size - 16);
     mp4->stszv_buf           = calloc(1, mp4->stszv_size - 20);
     mp4->stcov_buf           = calloc(1, mp4->stcov_size - 16);
+    mp4->sbgpv_buf           = calloc(1, mp4->sbgpv_size - 20);
 
     mp4->sttsv_size          = htonl(mp4->sttsv_size);
+    mp4->cttsv_size          = htonl(mp4->cttsv_size);
     mp4->stssv_size          = htonl(mp4->stssv_size);
     mp4->stscv_size          = htonl(mp4->stscv_size);
     mp4->stszv_size          = htonl(mp4->stszv_size);
     mp4->stcov_size          = htonl(mp4->stcov_size);
+    mp4->sgpdv_size          = htonl(mp4->sgpdv_size);
+    mp4->sbgpv_size          = htonl(mp4->sbgpv_size);
 
     mp4->stsdv_ahvc1_size    = htonl(mp4->stsdv_ahvc1_size);
     mp4->stsdv_size          = htonl(mp4->stsdv_size);
@@ -803,12 +984,15 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
     // audio track
     mp4->traka_size          = offsetof(MP4FILE, mdiaa_size) - offsetof(MP4FILE, traka_size);
     mp4->traka_type          = MP4_FOURCC('t', 'r', 'a', 'k');
-    mp4->tkhda_size          = htonl(offsetof(MP4FILE, mdiaa_size) - offsetof(MP4FILE, tkhda_size));
+    mp4->tkhda_size          = htonl(offsetof(MP4FILE, edtsa_size) - offsetof(MP4FILE, tkhda_size));
     mp4->tkhda_type          = MP4_FOURCC('t', 'k', 'h', 'd');
     mp4->tkhda_flags[2]      = 0xF;
     mp4->tkhda_trackid       = htonl(2       );
     mp4->tkhda_duration      = htonl(duration);
     mp4->tkhda_volume        = 0x0100;
+    mp4->edtsa_size          = htonl(offsetof(MP4FILE, mdiaa_size) - offsetof(MP4FILE, edtsa_size));
+    mp4->edtsa_type          = MP4_FOURCC('e', 'd', 't', 's');
+    mp4->elsta_type          = MP4_FOURCC('e', 'l', 's', 't');
 
     mp4->mdiaa_size          = offsetof(MP4FILE, minfa_size) - offsetof(MP4FILE, mdiaa_size);
     mp4->mdiaa_type          = MP4_FOURCC('m', 'd', 'i', 'a');
@@ -901,6 +1085,7 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
     mp4->traka_size         += mp4->mdiaa_size;
     mp4->moov_size          += mp4->traka_size;
 
+    mp4->edtsa_off           = offsetof(MP4FILE, trakv_size) + ntohl(mp4->trakv_size) + offsetof(MP4FILE, edtsa_size) - offsetof(MP4FILE, traka_size);
     mp4->sttsa_off           = offsetof(MP4FILE, trakv_size) + ntohl(mp4->trakv_size) + offsetof(MP4FILE, sttsa_size) - offsetof(MP4FILE, traka_size);
     mp4->stsza_off           = mp4->sttsa_off + mp4->sttsa_size + mp4->stsca_size;
     mp4->stcoa_off           = mp4->stsza_off + mp4->stsza_size;
@@ -928,10 +1113,13 @@ void* mp4muxer_init(char *file, int duration, int w, int h, int frate, int gop,
 
     fwrite(mp4, offsetof(MP4FILE, sttsv_size), 1, mp4->fp);
     fwrite(&mp4->sttsv_size, 16, 1, mp4->fp); fseek(mp4->fp, ntohl(mp4->sttsv_size) - 16, SEEK_CUR);
+    fwrite(&mp4->cttsv_size, 16, 1, mp4->fp); fseek(mp4->fp, ntohl(mp4->cttsv_size) - 16, SEEK_CUR);
     fwrite(&mp4->stssv_size, 16, 1, mp4->fp); fseek(mp4->fp, ntohl(mp4->stssv_size) - 16, SEEK_CUR);
     fwrite(&mp4->stscv_size, ntohl(mp4->stscv_size), 1, mp4->fp);
     fwrite(&mp4->stszv_size, 20, 1, mp4->fp); fseek(mp4->fp, ntohl(mp4->stszv_size) - 20, SEEK_CUR);
     fwrite(&mp4->stcov_size, 16, 1, mp4->fp); fseek(mp4->fp, ntohl(mp4->stcov_size) - 16, SEEK_CUR);
+    fwrite(&mp4->sgpdv_size, 26, 1, mp4->fp);
+    fwrite(&mp4->sbgpv_size, 20, 1, mp4->fp); fseek(mp4->fp, ntohl(mp4->sbgpv_size) - 20, SEEK_CUR);
     fwrite(&mp4->traka_size, offsetof(MP4FILE, sttsa_size) - offsetof(MP4FILE, traka_size), 1, mp4->fp);
     fwrite(&mp4->sttsa_size, 16, 1, mp4->fp); fseek(mp4->fp, ntohl(mp4->sttsa_size) - 16, SEEK_CUR);
     fwrite(&mp4->stsca_size, ntohl(mp4->stsca_size), 1, mp4->fp);
@@ -951,9 +1139,11 @@ void mp4muxer_exit(void *ctx)
         write_fixed_tracka_data(mp4);
         fclose(mp4->fp);
         if (mp4->sttsv_buf) free(mp4->sttsv_buf);
+        if (mp4->cttsv_buf) free(mp4->cttsv_buf);
         if (mp4->stssv_buf) free(mp4->stssv_buf);
         if (mp4->stszv_buf) free(mp4->stszv_buf);
         if (mp4->stcov_buf) free(mp4->stcov_buf);
+        if (mp4->sbgpv_buf) free(mp4->sbgpv_buf);
         if (mp4->sttsa_buf) free(mp4->sttsa_buf);
         if (mp4->stsza_buf) free(mp4->stsza_buf);
         if (mp4->stcoa_buf) free(mp4->stcoa_buf);
@@ -961,16 +1151,18 @@ void mp4muxer_exit(void *ctx)
     }
 }
 
-void mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts)
+void mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts, int64_t dts)
 {
     MP4FILE *mp4 = (MP4FILE*)ctx;
+    int64_t  cts;
     uint8_t  vpsbuf[256], spsbuf[256], ppsbuf[256];
     int      vpslen = 0,  spslen = 0,  ppslen = 0;
     int      nalu_idx, nalu_len, nalu_type, hsize;
-    int      len = len1 + len2, i = 0;
+    int      len = len1 + len2, i = 0, roll = -1, n;
     uint32_t framesize = 0, u32tempvalue;
     if (!ctx) return;
 
+    key = 0;
     for (i = h26x_parse_nalu_header(buf1, len1, buf2, len2, i, &hsize); i >= 0 && i < len; ) {
         nalu_idx = i;
         i = h26x_parse_nalu_header(buf1, len1, buf2, len2, i, &hsize);
@@ -978,7 +1170,8 @@ void mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
 
         if (mp4->flags & FLAG_VIDEO_H265_ENCODE) {
             nalu_type = (getbyte(buf1, len1, buf2, len2, nalu_idx) & 0x7F) >> 1;
-            key = nalu_type == 19 || nalu_type == 20;
+            key|= nalu_type == 19 || nalu_type == 20; // idr, only those are sync samples
+            if (nalu_type == 39 && nalu_len > 4 && getbyte(buf1, len1, buf2, len2, nalu_idx + 2) == 6) roll = sei_recovery_cnt(buf1, len1, buf2, len2, nalu_idx + 4, nalu_idx + nalu_len); // prefix sei with a recovery point
             if (!(mp4->flags & FLAG_AVC1_HEV1_WRITTEN)) {
                 switch (nalu_type) {
                 case 32: vpslen = nalu_len < sizeof(vpsbuf) ? nalu_len : sizeof(vpsbuf); getdata(buf1, len1, buf2, len2, nalu_idx, vpsbuf, vpslen); break;
@@ -992,7 +1185,8 @@ void mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
             }
         } else {
             nalu_type = (getbyte(buf1, len1, buf2, len2, nalu_idx) & 0x1F) >> 0;
-            key = nalu_type == 5;
+            key|= nalu_type == 5; // idr, only those are sync samples
+            if (nalu_type == 6 && nalu_len > 3 && getbyte(buf1, len1, buf2, len2, nalu_idx + 1) == 6) roll = sei_recovery_cnt(buf1, len1, buf2, len2, nalu_idx + 3, nalu_idx + nalu_len); // sei with a recovery point for intra refresh
             if (!(mp4->flags & FLAG_AVC1_HEV1_WRITTEN)) {
                 switch (nalu_type) {
                 case 7: spslen = nalu_len < sizeof(spsbuf) ? nalu_len : sizeof(spsbuf); getdata(buf1, len1, buf2, len2, nalu_idx, spsbuf, spslen); break;
@@ -1020,6 +1214,34 @@ void mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
         mp4->stssv_buf[ntohl(mp4->stssv_count)] = mp4->stszv_count;
         mp4->stssv_count = htonl(ntohl(mp4->stssv_count) + 1);
     }
+    if (mp4->sbgpv_buf && roll >= 0 && !key && ntohl(mp4->sbgpv_count) + 2 <= (uint32_t)mp4->sbgpv_max) { // a gradual decoder refresh starts here, it is clean roll samples later
+        n = ntohl(mp4->stszv_count) - 1 - mp4->sbgpv_last; // samples since the last run, not in the group
+        if (n > 0) {
+            mp4->sbgpv_buf[ntohl(mp4->sbgpv_count) * 2 + 0] = htonl(n);
+            mp4->sbgpv_buf[ntohl(mp4->sbgpv_count) * 2 + 1] = htonl(0);
+            mp4->sbgpv_count = htonl(ntohl(mp4->sbgpv_count) + 1);
+        }
+        if (n == 0 && mp4->sbgpv_count) mp4->sbgpv_buf[ntohl(mp4->sbgpv_count) * 2 - 2] = htonl(ntohl(mp4->sbgpv_buf[ntohl(mp4->sbgpv_count) * 2 - 2]) + 1);
+        else {
+            mp4->sbgpv_buf[ntohl(mp4->sbgpv_count) * 2 + 0] = htonl(1);
+            mp4->sbgpv_buf[ntohl(mp4->sbgpv_count) * 2 + 1] = htonl(1);
+            mp4->sbgpv_count = htonl(ntohl(mp4->sbgpv_count) + 1);
+        }
+        mp4->sbgpv_last = ntohl(mp4->stszv_count);
+        mp4->rollmax     = MIN(0x7FFF, roll > mp4->rollmax ? roll : mp4->rollmax); // the longest one, decoding from further back is always safe
+        mp4->sgpdv_roll  = (int16_t)(htonl(mp4->rollmax ? mp4->rollmax : 1) >> 16);
+        mp4->sgpdv_type  = MP4_FOURCC('s', 'g', 'p', 'd');
+        mp4->sbgpv_type  = MP4_FOURCC('s', 'b', 'g', 'p');
+    }
+    if (mp4->cttsv_buf && (int)ntohl(mp4->cttsv_count) < mp4->vframemax) { // samples are in decode order, stts goes by dts and ctts takes pts
+        cts = pts * ntohl(mp4->mdhdv_timescale) / 1000000 - dts * ntohl(mp4->mdhdv_timescale) / 1000000;
+        if (!mp4->cttsv_count) mp4->ctsbase = cts;
+        cts -= mp4->ctsbase;
+        if (cts) mp4->cttsv_type = MP4_FOURCC('c', 't', 't', 's');
+        mp4->cttsv_buf[ntohl(mp4->cttsv_count) * 2 + 0] = htonl(1);
+        mp4->cttsv_buf[ntohl(mp4->cttsv_count) * 2 + 1] = htonl((uint32_t)(int32_t)cts);
+        mp4->cttsv_count = htonl(ntohl(mp4->cttsv_count) + 1);
+    }
 #if VIDEO_TIMESCALE_BY_FRAME_RATE
     if (mp4->sttsv_buf) {
         mp4->sttsv_buf[0] = mp4->stszv_count;
@@ -1027,13 +1249,16 @@ void mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
         mp4->sttsv_count  = htonl(1);
     }
 #else
-    if (mp4->sttsv_buf && (int)ntohl(mp4->sttsv_count) < mp4->vframemax) {
-        mp4->sttsv_buf[ntohl(mp4->sttsv_count) * 2 + 0] = htonl(1);
-        mp4->sttsv_buf[ntohl(mp4->sttsv_count) * 2 + 1] = htonl(mp4->vpts_last ? pts - mp4->vpts_last : 1000 / mp4->frate);
-        mp4->sttsv_count = htonl(ntohl(mp4->sttsv_count) + 1);
-        mp4->vpts_last   = pts;
+    if (mp4->sttsv_buf && (int)(n = ntohl(mp4->sttsv_count)) < mp4->vframemax) { // a sample lasts until the next one, so a gap stays behind the sample before it
+        if (n) mp4->sttsv_buf[n * 2 - 1] = htonl(pts_delta(dts, mp4->vpts_last, VIDEO_PTS_TIMESCALE));
+        mp4->sttsv_buf[n * 2 + 0] = htonl(1);
+        mp4->sttsv_buf[n * 2 + 1] = n ? mp4->sttsv_buf[n * 2 - 1] : htonl(VIDEO_PTS_TIMESCALE / mp4->frate); // as long as the one before until the next comes, the last one keeps it
+        mp4->sttsv_count = htonl(n + 1);
+        if (!n) mp4->vpts_first = dts;
+        mp4->vpts_last   = dts;
     }
 #endif
+    if (ntohl(mp4->stszv_count) == 1) mp4->vstart = pts; // the first sample composes at media time 0
     if (mp4->stcov_buf && (int)ntohl(mp4->stcov_count) < mp4->vframemax) {
         mp4->stcov_buf[ntohl(mp4->stcov_count)] = htonl(mp4->chunk_off);
         mp4->stcov_count = htonl(ntohl(mp4->stcov_count) + 1);
@@ -1048,7 +1273,7 @@ void mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
 #endif
 }
 
-void mp4muxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts)
+void mp4muxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts)
 {
     MP4FILE *mp4 = (MP4FILE*)ctx;
     int      len = len1 + len2;
@@ -1057,6 +1282,7 @@ void mp4muxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
     if (mp4->stsza_buf && (int)ntohl(mp4->stsza_count) < mp4->aframemax) {
         mp4->stsza_buf[ntohl(mp4->stsza_count)] = htonl(len);
         mp4->stsza_count = htonl(ntohl(mp4->stsza_count) + 1);
+        if (ntohl(mp4->stsza_count) == 1) mp4->astart = pts;
     }
 
 #if AUDIO_TIMESCALE_BY_SAMPLE_RATE
@@ -1066,10 +1292,12 @@ void mp4muxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf
         mp4->sttsa_count  = htonl(1);
     }
 #else
-    if (mp4->sttsa_buf && (int)ntohl(mp4->sttsa_count) < mp4->aframemax) {
-        mp4->sttsa_buf[ntohl(mp4->sttsa_count) * 2 + 0] = htonl(1);
-        mp4->sttsa_buf[ntohl(mp4->sttsa_count) * 2 + 1] = htonl(mp4->apts_last ? pts - mp4->apts_last : 1000 * mp4->sampnum / mp4->samprate);
-        mp4->sttsa_count = htonl(ntohl(mp4->sttsa_count) + 1);
+    if (mp4->sttsa_buf && (int)ntohl(mp4->sttsa_count) < mp4->aframemax) { // like video, a sample lasts until the next one
+        int n = ntohl(mp4->sttsa_count);
+        if (n) mp4->sttsa_buf[n * 2 - 1] = htonl(pts_delta(pts, mp4->apts_last, 1000));
+        mp4->sttsa_buf[n * 2 + 0] = htonl(1);
+        mp4->sttsa_buf[n * 2 + 1] = n ? mp4->sttsa_buf[n * 2 - 1] : htonl(1000 * mp4->sampnum / mp4->samprate);
+        mp4->sttsa_count = htonl(n + 1);
         mp4->apts_last = pts;
     }
 #endif
@@ -1,10 +1,12 @@
 #ifndef __MP4MUXER_H__
 #define __MP4MUXER_H__
 
+#include <stdint.h>
+
 void* mp4muxer_init (char *file, int duration, int w, int h, int frate, int gop, int h265, int chnum, int samprate, int sampbits, int sampnum, unsigned char *aacspecinfo);
 void  mp4muxer_exit (void *ctx);
-void  mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts);
-void  mp4muxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, unsigned pts);
+void  mp4muxer_video(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts, int64_t dts); // pts is capture time in us, frames come in decode order, dts = pts without b-frames
+void  mp4muxer_audio(void *ctx, unsigned char *buf1, int len1, unsigned char *buf2, int len2, int key, int64_t pts);
 
 #endif
 
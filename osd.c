@@ -0,0 +1,341 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "codec.h"
+#define WATERMARK_FONT_ONLY
+#include "font25x48.h"
+#include "utils.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OSD_X86
+#include <immintrin.h>
+#endif
+
+#define OSD_GLYPHS   55 // '(' to ']' and a blank one for everything else
+#define OSD_MAX_CHARS 64
+#define OSD_FG_Y     235
+#define OSD_BG_Y     16
+
+typedef struct {
+    int      size;  // glyph height
+    int      gw;    // glyph width
+    uint8_t *masks; // OSD_GLYPHS alpha masks of gw x size
+} ATLAS;
+
+typedef struct { // one line of text prerendered into alpha and premultiplied value strips, blended onto every frame
+    int      x, y;
+    int      bgalpha;
+    int      len;
+    char     str[OSD_MAX_CHARS];
+    ATLAS   *atlas;
+    int      sw, sh; // strip size, OSD_MAX_CHARS glyphs wide
+    uint8_t *ya, *yv; // luma alpha and premultiplied value
+    uint8_t *ca, *cv; // same for chroma, sw/2 x sh/2, text and background are both neutral
+} TEXT;
+
+typedef struct {
+    CODEC_COMMON_MEMBERS
+
+    int      vw, vh;
+    uint8_t *frame; // reserved in next, blended on commit
+    TEXT     texts [OSD_MAX_TEXTS];
+    ATLAS    atlases[OSD_MAX_TEXTS];
+} OSD;
+
+// dst = dst * (256 - a) / 256 + v, a scaled so 255 covers fully
+static void blend_c(uint8_t *dst, uint8_t *a, uint8_t *v, int n)
+{
+    int i;
+    for (i=0; i<n; i++) dst[i] = ((dst[i] * (256 - a[i] - (a[i] >> 7))) >> 8) + v[i];
+}
+
+#ifdef OSD_X86
+__attribute__((target("sse2")))
+static void blend_sse2(uint8_t *dst, uint8_t *a, uint8_t *v, int n)
+{
+    __m128i z = _mm_setzero_si128(), full = _mm_set1_epi16(256), d, m, p, lo, hi;
+    int     i;
+    for (i=0; i+16<=n; i+=16) {
+        d  = _mm_loadu_si128((__m128i*)(dst + i));
+        m  = _mm_loadu_si128((__m128i*)(a   + i));
+        p  = _mm_loadu_si128((__m128i*)(v   + i));
+        lo = _mm_unpacklo_epi8(m, z);
+        hi = _mm_unpackhi_epi8(m, z);
+        lo = _mm_sub_epi16(full, _mm_add_epi16(lo, _mm_srli_epi16(lo, 7)));
+        hi = _mm_sub_epi16(full, _mm_add_epi16(hi, _mm_srli_epi16(hi, 7)));
+        lo = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, z), lo), 8), _mm_unpacklo_epi8(p, z));
+        hi = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, z), hi), 8), _mm_unpackhi_epi8(p, z));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blend_c(dst + i, a + i, v + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blend_avx2(uint8_t *dst, uint8_t *a, uint8_t *v, int n)
+{
+    __m256i full = _mm256_set1_epi16(256), d, m, p;
+    __m128i r;
+    int     i;
+    for (i=0; i+16<=n; i+=16) {
+        d = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(dst + i)));
+        m = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(a   + i)));
+        p = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(v   + i)));
+        m = _mm256_sub_epi16(full, _mm256_add_epi16(m, _mm256_srli_epi16(m, 7)));
+        d = _mm256_add_epi16(_mm256_srli_epi16(_mm256_mullo_epi16(d, m), 8), p);
+        r = _mm_packus_epi16(_mm256_castsi256_si128(d), _mm256_extracti128_si256(d, 1));
+        _mm_storeu_si128((__m128i*)(dst + i), r);
+    }
+    blend_c(dst + i, a + i, v + i, n - i);
+}
+#endif
+
+static void (*s_blend)(uint8_t *dst, uint8_t *a, uint8_t *v, int n) = blend_c;
+
+static void osd_dispatch(void)
+{
+#ifdef OSD_X86
+    int flags = get_cpu_flags();
+    if (flags & CPU_FLAG_SSE2) s_blend = blend_sse2;
+    if (flags & CPU_FLAG_AVX2) s_blend = blend_avx2;
+#endif
+}
+
+static int atlas_build(ATLAS *atlas, int size)
+{ // every glyph resampled once by area coverage, works for shrinking and growing
+    float fx0, fx1, fy0, fy1, wx, wy, sum, sx, sy;
+    int   gw = MAX(1, (FONT_WIDTH * size + FONT_HEIGHT / 2) / FONT_HEIGHT), g, x, y, i, j;
+    if (!(atlas->masks = malloc(OSD_GLYPHS * gw * size))) return -1;
+    atlas->size = size;
+    atlas->gw   = gw;
+    sx = (float)FONT_WIDTH  / gw;
+    sy = (float)FONT_HEIGHT / size;
+    for (g=0; g<OSD_GLYPHS; g++) {
+        uint8_t *src = (uint8_t*)watermark_font + g * FONT_WIDTH * FONT_HEIGHT, *dst = atlas->masks + g * gw * size;
+        for (y=0; y<size; y++) {
+            fy0 = y * sy;
+            fy1 = fy0 + sy;
+            for (x=0; x<gw; x++) {
+                fx0 = x * sx;
+                fx1 = fx0 + sx;
+                for (sum=0,i=(int)fy0; i<FONT_HEIGHT && i<fy1; i++) {
+                    wy = MIN(fy1, i + 1) - MAX(fy0, i);
+                    for (j=(int)fx0; j<FONT_WIDTH && j<fx1; j++) {
+                        wx   = MIN(fx1, j + 1) - MAX(fx0, j);
+                        sum += src[i * FONT_WIDTH + j] * wx * wy;
+                    }
+                }
+                dst[y * gw + x] = (uint8_t)MIN(255, sum / (sx * sy) + 0.5f);
+            }
+        }
+    }
+    return 0;
+}
+
+static ATLAS* atlas_get(OSD *osd, int size)
+{
+    int i;
+    for (i=0; i<OSD_MAX_TEXTS; i++) {
+        if (osd->atlases[i].size == size) return &osd->atlases[i];
+    }
+    for (i=0; i<OSD_MAX_TEXTS; i++) { // texts only hold as many sizes as there are texts, drop one nobody uses
+        int j, used = 0;
+        for (j=0; j<OSD_MAX_TEXTS; j++) used |= osd->texts[j].atlas == &osd->atlases[i];
+        if (used) continue;
+        free(osd->atlases[i].masks);
+        memset(&osd->atlases[i], 0, sizeof(ATLAS));
+        return atlas_build(&osd->atlases[i], size) == 0 ? &osd->atlases[i] : NULL;
+    }
+    return NULL;
+}
+
+static void text_free(TEXT *t)
+{
+    free(t->ya);
+    memset(t, 0, sizeof(TEXT));
+}
+
+static int text_alloc(TEXT *t, ATLAS *atlas, int bgalpha)
+{ // one block for the four strips
+    text_free(t);
+    t->sw = ALIGN(OSD_MAX_CHARS * atlas->gw, 2);
+    t->sh = ALIGN(atlas->size, 2);
+    if (!(t->ya = calloc(1, t->sw * t->sh * 3))) return -1;
+    t->yv      = t->ya + t->sw * t->sh;
+    t->ca      = t->yv + t->sw * t->sh;
+    t->cv      = t->ca + t->sw * t->sh / 4;
+    t->atlas   = atlas;
+    t->bgalpha = bgalpha;
+    return 0;
+}
+
+static void text_cell(TEXT *t, int i, char c)
+{ // glyph over the background box, as alpha and premultiplied luma
+    ATLAS   *atlas = t->atlas;
+    uint8_t *mask  = atlas->masks + ((c >= '(' && c <= ']') ? c - '(' : OSD_GLYPHS - 1) * atlas->gw * atlas->size;
+    int      x, y, ta, a, col, off;
+    for (y=0; y<atlas->size; y++) {
+        for (x=0; x<atlas->gw; x++) {
+            off = y * t->sw + i * atlas->gw + x;
+            ta  = c ? mask[y * atlas->gw + x] : 0;
+            a   = c ? ta + ((255 - ta) * t->bgalpha + 127) / 255 : 0;
+            col = a ? (OSD_FG_Y * ta + OSD_BG_Y * (a - ta) + a / 2) / a : 0;
+            t->ya[off] = a;
+            t->yv[off] = (col * (a + (a >> 7))) >> 8;
+        }
+    }
+}
+
+static void text_chroma(TEXT *t, int x0, int x1)
+{ // chroma of luma columns [x0, x1), 2x2 average alpha towards neutral 128
+    int x, y, a;
+    for (y=0; y<t->sh/2; y++) {
+        for (x=x0/2; x<(x1+1)/2; x++) {
+            a = (t->ya[2 * y * t->sw + 2 * x] + t->ya[2 * y * t->sw + 2 * x + 1] + t->ya[(2 * y + 1) * t->sw + 2 * x] + t->ya[(2 * y + 1) * t->sw + 2 * x + 1] + 2) >> 2;
+            t->ca[y * t->sw / 2 + x] = a;
+            t->cv[y * t->sw / 2 + x] = (128 * (a + (a >> 7))) >> 8;
+        }
+    }
+}
+
+static void osd_blend(OSD *osd, uint8_t *frame)
+{
+    uint8_t *u = frame + osd->vw * osd->vh, *v = u + osd->vw * osd->vh / 4;
+    TEXT    *t;
+    int      i, r, bw, bh;
+    for (i=0; i<OSD_MAX_TEXTS; i++) {
+        t = &osd->texts[i];
+        if (!t->len || t->x >= osd->vw || t->y >= osd->vh) continue;
+        bw = MIN(t->len * t->atlas->gw, osd->vw - t->x);
+        bh = MIN(t->atlas->size, osd->vh - t->y);
+        for (r=0; r<bh; r++) s_blend(frame + (t->y + r) * osd->vw + t->x, t->ya + r * t->sw, t->yv + r * t->sw, bw);
+        for (r=0; r<(bh+1)/2; r++) {
+            s_blend(u + (t->y / 2 + r) * osd->vw / 2 + t->x / 2, t->ca + r * t->sw / 2, t->cv + r * t->sw / 2, (bw + 1) / 2);
+            s_blend(v + (t->y / 2 + r) * osd->vw / 2 + t->x / 2, t->ca + r * t->sw / 2, t->cv + r * t->sw / 2, (bw + 1) / 2);
+        }
+    }
+}
+
+void osd_settext(void *ctxt, int id, int x, int y, int size, int bgalpha, char *str)
+{
+    OSD   *osd = (OSD*)ctxt;
+    TEXT  *t;
+    ATLAS *atlas;
+    int    n, i, x0 = -1, x1 = 0;
+    if (!osd || id < 0 || id >= OSD_MAX_TEXTS) return;
+    t       = &osd->texts[id];
+    size    = MIN(MAX(size, 8), 192);
+    bgalpha = MIN(MAX(bgalpha, 0), 255);
+    n       = str ? MIN((int)strlen(str), OSD_MAX_CHARS) : 0;
+    pthread_mutex_lock(&osd->mutex);
+    if (!n) {
+        t->len = 0;
+    } else if (t->atlas && t->atlas->size == size && t->bgalpha == bgalpha) { // only cells whose character changed
+        for (i=0; i<MAX(n, t->len); i++) {
+            if (i < t->len && i < n && t->str[i] == str[i]) continue;
+            text_cell(t, i, i < n ? str[i] : 0);
+            if (x0 < 0) x0 = i * t->atlas->gw;
+            x1 = (i + 1) * t->atlas->gw;
+        }
+    } else {
+        text_free(t); // lets its atlas go before picking one for the new size
+        if ((atlas = atlas_get(osd, size)) && text_alloc(t, atlas, bgalpha) == 0) {
+            for (i=0; i<n; i++) text_cell(t, i, str[i]);
+            x0 = 0;
+            x1 = n * atlas->gw;
+        } else n = 0;
+    }
+    if (x0 >= 0) text_chroma(t, x0 & ~1, x1);
+    if (n) memcpy(t->str, str, n);
+    t->len = n;
+    t->x   = MAX(x, 0) & ~1; // even, so chroma lines up
+    t->y   = MAX(y, 0) & ~1;
+    pthread_mutex_unlock(&osd->mutex);
+}
+
+static void osd_free(void *ctxt)
+{
+    OSD *osd = (OSD*)ctxt;
+    int  i;
+    pthread_mutex_destroy(&osd->mutex);
+    pthread_cond_destroy (&osd->cond );
+    for (i=0; i<OSD_MAX_TEXTS; i++) {
+        text_free(&osd->texts[i]);
+        free(osd->atlases[i].masks);
+    }
+    free(osd);
+}
+
+static int osd_reserve(void *ctxt, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2)
+{ // the frame is filled right in next, one producer thread
+    OSD     *osd = (OSD*)ctxt;
+    uint8_t *buf1, *buf2;
+    int      len1 ,  len2, ret;
+    if (size != osd->vw * osd->vh * 3 / 2) return -1;
+    if ((ret = codec_reserveframe(osd->next, size, type, &buf1, &len1, &buf2, &len2)) <= 0) return ret;
+    if (len2) { // blending needs the planes whole
+        codec_commitframe(osd->next, -1, type, 0);
+        return 0;
+    }
+    osd->frame = buf1;
+    if (ppbuf1) *ppbuf1 = buf1;
+    if (plen1 ) *plen1  = size;
+    if (ppbuf2) *ppbuf2 = NULL;
+    if (plen2 ) *plen2  = 0;
+    return size;
+}
+
+static int osd_commit(void *ctxt, int len, uint32_t type, int64_t pts)
+{
+    OSD     *osd = (OSD*)ctxt;
+    uint64_t t;
+    if (len >= 0) {
+        if (!pts) pts = get_time_us(); // captured before the blend
+        t = get_time_us();
+        pthread_mutex_lock(&osd->mutex);
+        osd_blend(osd, osd->frame);
+        pthread_mutex_unlock(&osd->mutex);
+        codec_stat_encode(osd, (uint32_t)(get_time_us() - t));
+        codec_stat_in (osd, 1, len);
+        codec_stat_out(osd, 1, len);
+    }
+    return codec_commitframe(osd->next, len, type, pts);
+}
+
+static int osd_writeraw(void *ctxt, uint8_t *buf, int len, int64_t pts)
+{
+    uint8_t *dst;
+    if (osd_reserve(ctxt, len, 0, &dst, NULL, NULL, NULL) <= 0) return 0;
+    memcpy(dst, buf, len);
+    return osd_commit(ctxt, len, 0, pts);
+}
+
+static int osd_writebuf(void *ctxt, uint8_t *buf, int len)
+{
+    return osd_writeraw(ctxt, buf, len, 0);
+}
+
+static void osd_config(void *ctxt, int flags, void *param1, uint32_t param2)
+{
+    OSD *osd = (OSD*)ctxt;
+    codec_config(osd->next, flags, param1, param2);
+}
+
+void* osd_init(void *next, int w, int h)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    OSD *osd;
+    if (!next || w < 2 || h < 2 || (w & 1) || (h & 1)) return NULL;
+    pthread_once(&once, osd_dispatch);
+    if (!(osd = codec_init("osd", sizeof(OSD), 0, next))) return NULL;
+    osd->free     = osd_free;
+    osd->writebuf = osd_writebuf;
+    osd->writeraw = osd_writeraw;
+    osd->config   = osd_config;
+    osd->reserve  = osd_reserve;
+    osd->commit   = osd_commit;
+    osd->vw       = w;
+    osd->vh       = h;
+    return osd;
+}
@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "codec.h"
+#include "recorder.h"
+#include "recmgr.h"
+#include "worker.h"
+#include "utils.h"
+
+typedef struct {
+    CODEC    *codeclist[3]; // buffer the recorder reads, video and audio encoders writing to it
+    void     *recorder;
+    int       ratectrl; // the recorder runs its closed loop under target
+    int       bitrate;  // video bitrate it was added with
+    int       floor;    // video bitrate bounds under a disk rate
+    int       ceiling;
+    int       weight;
+    int       target;   // video bitrate given by the allocator, 0 before the first round
+    uint64_t  vbytes;   // bytes_out of the encoders at the last round
+    uint64_t  abytes;
+    int       polled;   // vbytes and abytes were read once, the first round only does that
+} CHANNEL;
+
+typedef struct {
+    CHANNEL  *chans[RECMGR_MAX_CHANNELS];
+    uint32_t  epoch; // files of every channel are aligned to it
+    int       workers;
+    char     *preset; // h264enc_calibrate result, NULL for the default
+    int       diskrate; // bits per second of all channels together, 0 for no limit
+    uint32_t  alloctick;
+    #define RECMGR_ALLOC_INTERVAL 1000
+    #define FLAG_EXIT   (1 << 0)
+    #define FLAG_THREAD (1 << 1)
+    uint32_t  flags;
+    pthread_t thread;  // allocator, started with the first disk rate
+    pthread_mutex_t mutex; // add, del, start, stats and allocation, capture goes to the encoders without it
+} RECMGR;
+
+static void channel_free(CHANNEL *chan)
+{
+    int i;
+    ffrecorder_exit(chan->recorder);
+    for (i=2; i>=0; i--) codec_free(chan->codeclist[i]); // encoders before the buffer they write to
+    free(chan);
+}
+
+static CHANNEL* channel_init(RECMGR_CHANNEL *p, uint32_t epoch, char *preset)
+{
+    H264ENC_PARAMS hp  = {0};
+    int            avi = p->type && strcmp(p->type, "avi") == 0;
+    CHANNEL       *chan= calloc(1, sizeof(CHANNEL));
+    if (!chan) return NULL;
+    chan->codeclist[0] = codec_init("buffer", sizeof(CODEC), p->bufsize ? p->bufsize : 256 * 1024, NULL);
+    codec_config(chan->codeclist[0], CODEC_CONFIG_SET_POLICY, NULL, CODEC_POLICY_DROP_NONREF|CODEC_POLICY_AUDIO_LAST); // locked mode, so it can borrow from the budget
+    hp.preset   = preset;
+    hp.governor = 1; // a channel falling behind gets cheaper instead of dropping frames at random
+    hp.bframes  = p->bframes;
+    hp.intrarefresh = p->intrarefresh;
+    chan->codeclist[1] = h264enc_init_ex(0, chan->codeclist[0], p->bitrate ? p->bitrate : 512000, p->fps ? p->fps : 25, p->width, p->height, &hp);
+    if (p->samprate) {
+        chan->codeclist[2] = avi ? alawenc_init(0, chan->codeclist[0]) : aacenc_init(0, chan->codeclist[0], p->abitrate ? p->abitrate : 32000, p->samprate, MAX(1, p->channels));
+    }
+    if (!chan->codeclist[0] || !chan->codeclist[1] || (p->samprate && !chan->codeclist[2])) {
+        channel_free(chan);
+        return NULL;
+    }
+    chan->recorder = ffrecorder_init(p->name, avi ? "avi" : "mp4", p->duration ? p->duration : 60000, MAX(1, p->channels), p->samprate,
+                                     p->width, p->height, p->fps ? p->fps : 25, chan->codeclist, p->samprate ? 3 : 2);
+    if (!chan->recorder) {
+        channel_free(chan);
+        return NULL;
+    }
+    ffrecorder_setepoch(chan->recorder, epoch);
+    chan->bitrate = p->bitrate ? p->bitrate : 512000;
+    chan->floor   = p->minrate ? MIN(p->minrate, chan->bitrate) : chan->bitrate / 4;
+    chan->ceiling = p->maxrate ? MAX(p->maxrate, chan->bitrate) : chan->bitrate * 2;
+    chan->weight  = MAX(1, p->weight);
+    if ((chan->ratectrl = p->minrate > 0)) {
+        RECORDER_RATECTRL rc = { p->minrate, chan->bitrate, 0 };
+        ffrecorder_ratectrl(chan->recorder, &rc);
+    }
+    return chan;
+}
+
+void* recmgr_init(int workers, int budget)
+{
+    RECMGR *mgr = calloc(1, sizeof(RECMGR));
+    if (!mgr) return NULL;
+    pthread_mutex_init(&mgr->mutex, NULL);
+    mgr->epoch = get_tick_count() | 1;
+    mgr->workers = worker_init(workers);
+    if (budget > 0) codec_setbudget(budget, 0);
+    return mgr;
+}
+
+void recmgr_exit(void *ctxt)
+{
+    RECMGR *mgr = (RECMGR*)ctxt;
+    int     i;
+    if (!mgr) return;
+    if (mgr->flags & FLAG_THREAD) {
+        mgr->flags |= FLAG_EXIT;
+        pthread_join(mgr->thread, NULL);
+    }
+    for (i=0; i<RECMGR_MAX_CHANNELS; i++) recmgr_del(mgr, i);
+    worker_exit();
+    pthread_mutex_destroy(&mgr->mutex);
+    free(mgr);
+}
+
+int recmgr_add(void *ctxt, RECMGR_CHANNEL *p)
+{
+    RECMGR  *mgr = (RECMGR*)ctxt;
+    CHANNEL *chan;
+    int      i;
+    if (!mgr || !p || !p->name || p->width <= 0 || p->height <= 0) return -1;
+    pthread_mutex_lock(&mgr->mutex);
+    for (i=0; i<RECMGR_MAX_CHANNELS && mgr->chans[i]; i++);
+    if (i < RECMGR_MAX_CHANNELS && (chan = channel_init(p, mgr->epoch, mgr->preset))) mgr->chans[i] = chan;
+    else i = -1;
+    pthread_mutex_unlock(&mgr->mutex);
+    if (i < 0) printf("recmgr failed to add channel %s !\n", p->name);
+    return i;
+}
+
+char* recmgr_calibrate(void *ctxt, RECMGR_CHANNEL *p, int channels)
+{
+    RECMGR *mgr = (RECMGR*)ctxt;
+    char   *preset;
+    int     load;
+    if (!mgr || !p || p->width <= 0 || p->height <= 0) return NULL;
+    load   = (MAX(1, channels) + mgr->workers - 1) / MAX(1, mgr->workers); // channels each core encodes
+    preset = h264enc_calibrate(p->bitrate ? p->bitrate : 512000, p->fps ? p->fps : 25, p->width, p->height, load, NULL); // seconds long, not under the mutex
+    pthread_mutex_lock(&mgr->mutex);
+    mgr->preset = preset; // a static name, the one it replaces needs no freeing
+    pthread_mutex_unlock(&mgr->mutex);
+    return preset;
+}
+
+void recmgr_del(void *ctxt, int id)
+{
+    RECMGR  *mgr = (RECMGR*)ctxt;
+    CHANNEL *chan= NULL;
+    if (!mgr || id < 0 || id >= RECMGR_MAX_CHANNELS) return;
+    pthread_mutex_lock(&mgr->mutex);
+    chan = mgr->chans[id];
+    mgr->chans[id] = NULL;
+    pthread_mutex_unlock(&mgr->mutex);
+    if (chan) channel_free(chan); // without the mutex, closing a file must not hold up the other channels
+}
+
+static void recmgr_allocate(RECMGR *mgr, int ms) // weighted max-min share of the disk rate, each channel asks for what it uses
+{
+    CHANNEL       *list[RECMGR_MAX_CHANNELS], *chan;
+    int64_t        want[RECMGR_MAX_CHANNELS], give[RECMGR_MAX_CHANNELS], left = mgr->diskrate, used, add;
+    CODEC_STATS    cs;
+    RECORDER_STATS rs;
+    int            n = 0, i, rate, cur, wsum, changed = 0, over;
+
+    for (i=0; i<RECMGR_MAX_CHANNELS; i++) {
+        if (!(chan = mgr->chans[i])) continue;
+        ffrecorder_getstats(chan->recorder, &rs);
+        codec_getstats(chan->codeclist[1], &cs);
+        rate = chan->polled ? (int)((cs.bytes_out - chan->vbytes) * 8 * 1000 / ms) : -1; // bytes since the channel was added are no rate over one interval
+        chan->vbytes = cs.bytes_out;
+        if (chan->codeclist[2]) { // audio is not shaped, it comes off the top
+            codec_getstats(chan->codeclist[2], &cs);
+            if (chan->polled) left -= (int64_t)(cs.bytes_out - chan->abytes) * 8 * 1000 / ms;
+            chan->abytes = cs.bytes_out;
+        }
+        chan->polled = 1;
+        if (!rs.recording) continue;
+        cur = chan->ratectrl ? rs.bitrate : chan->target ? chan->target : chan->bitrate;
+        want[n] = rate < 0 ? cur : (int64_t)rate * 10 >= (int64_t)cur * 9 ? cur + cur / 4 : rate + rate / 8; // using nearly all it has is busy and asks for more, otherwise it gives back what it leaves unused, a new one keeps its rate
+        want[n] = MAX(chan->floor, MIN(chan->ceiling, want[n]));
+        give[n] = chan->floor;
+        left   -= chan->floor;
+        list[n++] = chan;
+    }
+    over = left < 0;
+    while (left > 0) { // floors are always given, the rest goes out by weight to the channels still asking, until it runs out or all are served
+        for (wsum=0,i=0; i<n; i++) if (give[i] < want[i]) wsum += list[i]->weight;
+        if (!wsum) break;
+        for (used=0,i=0; i<n; i++) {
+            if (give[i] >= want[i]) continue;
+            add = MIN(MIN(want[i] - give[i], left - used), MAX(1, left * list[i]->weight / wsum));
+            give[i] += add;
+            used    += add;
+        }
+        left -= used;
+    }
+    for (i=0; i<n; i++) {
+        chan = list[i];
+        if (give[i] * 20 > (int64_t)chan->target * 21 || give[i] * 20 < (int64_t)chan->target * 19) { // within 5% is left alone, so encoders are not reconfigured every round
+            chan->target = (int)give[i];
+            changed++;
+            if (chan->ratectrl) {
+                RECORDER_RATECTRL rc = { MIN(chan->floor, chan->target), chan->target, 0 };
+                ffrecorder_ratectrl(chan->recorder, &rc);
+            } else codec_config(chan->codeclist[1], CODEC_CONFIG_SET_BITRATE, NULL, chan->target);
+        }
+    }
+    if (changed) {
+        for (used=0,i=0; i<n; i++) used += list[i]->target;
+        printf("recmgr disk rate %d, %d channels recording, %d retargeted, video total %lld%s\n", mgr->diskrate, n, changed, (long long)used, over ? ", floors alone are over it !" : "");
+    }
+}
+
+static void* recmgr_thread_proc(void *param)
+{
+    RECMGR  *mgr = (RECMGR*)param;
+    uint32_t now;
+    while (!(mgr->flags & FLAG_EXIT)) {
+        usleep(100 * 1000);
+        now = get_tick_count();
+        if ((int32_t)(now - mgr->alloctick) < RECMGR_ALLOC_INTERVAL) continue;
+        pthread_mutex_lock(&mgr->mutex);
+        if (mgr->diskrate > 0) recmgr_allocate(mgr, (int32_t)(now - mgr->alloctick));
+        mgr->alloctick = now;
+        pthread_mutex_unlock(&mgr->mutex);
+    }
+    return NULL;
+}
+
+void recmgr_diskrate(void *ctxt, int bps)
+{
+    RECMGR  *mgr = (RECMGR*)ctxt;
+    CHANNEL *chan;
+    int      i;
+    if (!mgr) return;
+    pthread_mutex_lock(&mgr->mutex);
+    mgr->diskrate  = MAX(0, bps);
+    mgr->alloctick = get_tick_count();
+    for (i=0; i<RECMGR_MAX_CHANNELS && !mgr->diskrate; i++) { // no limit any more, back to the bitrates they were added with
+        if (!(chan = mgr->chans[i]) || !chan->target) continue;
+        if (chan->ratectrl) {
+            RECORDER_RATECTRL rc = { chan->floor, chan->bitrate, 0 };
+            ffrecorder_ratectrl(chan->recorder, &rc);
+        } else codec_config(chan->codeclist[1], CODEC_CONFIG_SET_BITRATE, NULL, chan->bitrate);
+        chan->target = 0;
+    }
+    if (mgr->diskrate && !(mgr->flags & FLAG_THREAD)) {
+        mgr->flags |= FLAG_THREAD;
+        pthread_create(&mgr->thread, NULL, recmgr_thread_proc, mgr);
+    }
+    pthread_mutex_unlock(&mgr->mutex);
+}
+
+void recmgr_start(void *ctxt, int id, int start)
+{
+    RECMGR *mgr = (RECMGR*)ctxt;
+    int     i;
+    if (!mgr) return;
+    pthread_mutex_lock(&mgr->mutex);
+    for (i=0; i<RECMGR_MAX_CHANNELS; i++) {
+        if ((id < 0 || id == i) && mgr->chans[i]) ffrecorder_start(mgr->chans[i]->recorder, start);
+    }
+    pthread_mutex_unlock(&mgr->mutex);
+}
+
+static CHANNEL* channel_get(RECMGR *mgr, int id)
+{
+    return (mgr && id >= 0 && id < RECMGR_MAX_CHANNELS) ? mgr->chans[id] : NULL;
+}
+
+void* recmgr_getcodec(void *ctxt, int id, int video)
+{
+    CHANNEL *chan = channel_get((RECMGR*)ctxt, id);
+    return chan ? chan->codeclist[video ? 1 : 2] : NULL;
+}
+
+int recmgr_video(void *ctxt, int id, uint8_t *buf, int len, int64_t pts)
+{
+    CHANNEL *chan = channel_get((RECMGR*)ctxt, id);
+    return chan ? codec_writeraw(chan->codeclist[1], buf, len, pts) : -1;
+}
+
+int recmgr_audio(void *ctxt, int id, uint8_t *buf, int len, int64_t pts)
+{
+    CHANNEL *chan = channel_get((RECMGR*)ctxt, id);
+    return chan && chan->codeclist[2] ? codec_writeraw(chan->codeclist[2], buf, len, pts) : -1;
+}
+
+static void stats_add(CODEC_STATS *sum, CODEC *codec)
+{
+    CODEC_STATS cs;
+    int         i;
+    if (!codec) return;
+    codec_getstats(codec, &cs);
+    sum->frames_in   += cs.frames_in;
+    sum->frames_out  += cs.frames_out;
+    sum->bytes_in    += cs.bytes_in;
+    sum->bytes_out   += cs.bytes_out;
+    for (i=0; i<CODEC_DROP_REASONS; i++) sum->drops[i] += cs.drops[i];
+    sum->cursize     += cs.cursize;
+    sum->maxsize     += cs.maxsize;
+    sum->highwater   += cs.highwater;
+    sum->lockwait_us += cs.lockwait_us;
+    sum->lockwait_max = MAX(sum->lockwait_max, cs.lockwait_max);
+    sum->encode_us   += cs.encode_us;
+    sum->encode_max   = MAX(sum->encode_max, cs.encode_max);
+}
+
+void recmgr_getstats(void *ctxt, int id, RECMGR_STATS *stats)
+{
+    RECMGR        *mgr = (RECMGR*)ctxt;
+    RECORDER_STATS rs;
+    CHANNEL       *chan;
+    int            i;
+    if (!mgr || !stats) return;
+    memset(stats, 0, sizeof(RECMGR_STATS));
+    pthread_mutex_lock(&mgr->mutex);
+    for (i=0; i<RECMGR_MAX_CHANNELS; i++) {
+        if ((id >= 0 && id != i) || !(chan = mgr->chans[i])) continue;
+        ffrecorder_getstats(chan->recorder, &rs);
+        stats->channels++;
+        stats->rec.frames   += rs.frames;
+        stats->rec.bytes    += rs.bytes;
+        stats->rec.segments += rs.segments;
+        stats->rec.mux_us   += rs.mux_us;
+        stats->rec.mux_max   = MAX(stats->rec.mux_max, rs.mux_max);
+        stats->rec.firstbyte = MAX(stats->rec.firstbyte, rs.firstbyte);
+        stats->rec.recording+= rs.recording;
+        stats->rec.bitrate  += rs.bitrate;
+        stats->rec.ratechanges += rs.ratechanges;
+        stats->target       += chan->target;
+        stats_add(&stats->buffer, chan->codeclist[0]);
+        stats_add(&stats->venc  , chan->codeclist[1]);
+        stats_add(&stats->aenc  , chan->codeclist[2]);
+    }
+    pthread_mutex_unlock(&mgr->mutex);
+}
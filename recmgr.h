@@ -0,0 +1,60 @@
+#ifndef __RECMGR_H__
+#define __RECMGR_H__
+
+#include <stdint.h>
+#include "codec.h"
+#include "recorder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RECMGR_MAX_CHANNELS 64
+
+typedef struct { // one camera, 0 keeps the default
+    char *name;      // file name prefix
+    char *type;      // "mp4" with aac, or "avi" with g.711 alaw
+    int   duration;  // ms per file, 60000 by default
+    int   width;     // i420 capture
+    int   height;
+    int   fps;       // 25 by default
+    int   bitrate;   // video, 512000 by default
+    int   samprate;  // pcm capture, 0 for no audio, avi only takes 8000
+    int   channels;
+    int   abitrate;  // aac, 32000 by default
+    int   bufsize;   // ring between encoders and recorder, 256KB by default, grows from the shared budget
+    int   minrate;   // video bitrate may go down to it when the disk falls behind, 0 keeps bitrate fixed
+    int   maxrate;   // video bitrate a busy channel may borrow up to from idle ones under a disk rate, 2 x bitrate by default
+    int   weight;    // share of the disk rate against other busy channels, 1 by default
+    int   bframes;   // b-frames for archival channels, smaller files for a few frames more latency, 0 for none
+    int   intrarefresh; // 1 for intra refresh instead of idr frames, no key frame bursts in the ring and on disk
+} RECMGR_CHANNEL;
+
+typedef struct { // counters summed over channels, the xxx_max and firstbyte fields are the largest
+    int            channels;
+    RECORDER_STATS rec;    // rec.recording is the channels with a file open
+    CODEC_STATS    venc;
+    CODEC_STATS    aenc;
+    CODEC_STATS    buffer;
+    int            target; // video bitrates given out under the disk rate, 0 without one
+} RECMGR_STATS;
+
+// many cameras in one process, their encoders and recorders run as tasks on one worker pool
+// and their rings borrow from one memory budget, instead of a process with its own threads per camera.
+void* recmgr_init    (int workers, int budget); // workers 0 for one per core, budget bytes rings may borrow, 0 for none
+void  recmgr_exit    (void *mgr); // removes every channel
+int   recmgr_add     (void *mgr, RECMGR_CHANNEL *chan); // return channel id, -1 if full or it failed
+void  recmgr_del     (void *mgr, int id); // capture must have stopped writing to it
+char* recmgr_calibrate(void *mgr, RECMGR_CHANNEL *chan, int channels); // benchmark the preset channels like chan added after it use, before capture starts, return a static preset name
+void  recmgr_diskrate(void *mgr, int bps); // bits per second all channels may write together, shared by weight and by how much each uses, 0 for no limit
+void  recmgr_start   (void *mgr, int id, int start); // id < 0 for all channels, files of all channels roll over at the same time
+int   recmgr_video   (void *mgr, int id, uint8_t *buf, int len, int64_t pts); // i420 picture, pts as in codec_writeraw
+int   recmgr_audio   (void *mgr, int id, uint8_t *buf, int len, int64_t pts); // 16 bit pcm
+void* recmgr_getcodec(void *mgr, int id, int video); // encoder to capture into directly by reserve/commit, NULL if none
+void  recmgr_getstats(void *mgr, int id, RECMGR_STATS *stats); // id < 0 sums all channels
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
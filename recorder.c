@@ -8,6 +8,8 @@
 #include "mp4muxer.h"
 #include "recorder.h"
 #include "codec.h"
+#include "trace.h"
+#include "worker.h"
 #include "utils.h"
 
 #ifdef _MSC_VER
@@ -26,18 +28,49 @@ typedef struct {
     int       width;
     int       height;
     int       fps;
+    int       scale;     // CODEC_VIDEO_SCALE of the file open, the encoder governor may halve the size
+    int       gen;       // CODEC_VIDEO_GEN of the file open, the governor reopens x264 with new headers
+    time_t    opentime;  // when the last file was opened, files opened in the same second get a -n suffix
+    int       openseq;
     uint32_t  rectype;
     uint32_t  starttick;
+    uint32_t  epoch;     // files end on multiples of duration after it, so recorders sharing it roll over together, 0 for none
+    uint32_t  reqtick;   // when ffrecorder_start was called, 0 once the first frame is written
+    RECORDER_STATS stats; // only written by record thread
 
     #define MAX_CODEC_NUM 8
     CODEC    *codeclist[MAX_CODEC_NUM];
     int       codecnum;
+    int       reader; // reader id on codeclist[0], -1 when not attached
     uint8_t   aacinfo[256];
+    int       venc;   // index of h264enc in codeclist, -1 for none
+
+    RECORDER_RATECTRL ratectrl; // ceiling 0 when off
+    uint32_t  rctick;   // tick of the last check
+    int       rccalm;   // checks in a row without pressure
+    uint32_t  rcdrops;  // drops of codeclist[0] at the last check
+    uint64_t  rcmux;    // stats.mux_us at the last check
+
+    uint8_t  *aubuf;    // a video frame sent in parts put back together, muxers take whole frames
+    int       ausize;
+    int       aulen;
+    int       auopen;   // its first part is in
+    uint32_t  autype;
+    int64_t   aupts;
+    int64_t   audts;
 
     #define FLAG_EXIT  (1 << 0)
     #define FLAG_START (1 << 1)
     #define FLAG_NEXT  (1 << 2)
+    #define FLAG_DONE  (1 << 3) // the pool task has closed everything after exit
     uint32_t  flags;
+    pthread_mutex_t mutex; // start, stop and exit are signaled by cond
+    pthread_cond_t  cond;
+    void     *muxer_ctxt;
+    void    (*muxer_exit )(void*);
+    void    (*muxer_video)(void*, unsigned char*, int, unsigned char*, int, int, int64_t, int64_t);
+    void    (*muxer_audio)(void*, unsigned char*, int, unsigned char*, int, int, int64_t);
+    void     *task;   // on the worker pool, NULL when running its own thread
     pthread_t pthread;
 } RECORDER;
 
@@ -46,60 +79,210 @@ typedef struct {
 #define IS_VIDEO_H265_ENC(type) ((((type) >> 8) & 0xFF) == '5')
 #define IS_VIDEO_FRAME(type)    ((char)(type) == 'V' || (char)(type) == 'v')
 
-static void* record_thread_proc(void *argv)
+#define RATECTRL_RING_HIGH   50 // % of the buffer queued that counts as pressure
+#define RATECTRL_RING_LOW    20 // below it, no drops and a muxer mostly idle is calm
+#define RATECTRL_MUX_HIGH    60 // % of the interval spent in muxer calls, the disk is falling behind
+#define RATECTRL_MUX_LOW     30
+#define RATECTRL_CALM_CHECKS 3  // calm checks in a row before going up, so it does not flap
+
+static void record_ratectrl(RECORDER *recorder) // lower fast on pressure, raise slowly once calm, hold in between
+{
+    RECORDER_RATECTRL *rc = &recorder->ratectrl;
+    CODEC_STATS cs;
+    uint32_t    now = get_tick_count(), drops;
+    int         ring, busy, rate, i;
+
+    pthread_mutex_lock(&recorder->mutex); // ffrecorder_ratectrl moves the bounds and the rate from the allocator thread
+    if (!rc->ceiling || recorder->venc < 0 || (int32_t)(now - recorder->rctick) < rc->interval) goto done;
+    codec_getstats(recorder->codeclist[0], &cs);
+    for (drops=0,i=0; i<CODEC_DROP_REASONS; i++) drops += cs.drops[i];
+    ring = cs.maxsize ? (int)((int64_t)cs.cursize * 100 / cs.maxsize) : 0;
+    busy = (int)((recorder->stats.mux_us - recorder->rcmux) / 10 / MAX(1, (int32_t)(now - recorder->rctick))); // us per ms in %
+    drops -= recorder->rcdrops;
+    recorder->rcdrops += drops;
+    recorder->rcmux    = recorder->stats.mux_us;
+    recorder->rctick   = now;
+
+    rate = recorder->stats.bitrate;
+    if (drops || ring > RATECTRL_RING_HIGH || busy > RATECTRL_MUX_HIGH) {
+        rate = MAX(rc->floor, rate * 3 / 4);
+        recorder->rccalm = 0;
+    } else if (ring < RATECTRL_RING_LOW && busy < RATECTRL_MUX_LOW) {
+        if (++recorder->rccalm >= RATECTRL_CALM_CHECKS) rate = MIN(rc->ceiling, rate + rc->ceiling / 10);
+    } else recorder->rccalm = 0;
+    if (rate == recorder->stats.bitrate) goto done;
+    printf("ffrecorder %s bitrate %d -> %d, ring: %d%% drops: %u muxer busy: %d%%\n", recorder->filename, recorder->stats.bitrate, rate, ring, drops, busy);
+    recorder->stats.bitrate = rate;
+    recorder->stats.ratechanges++;
+    recorder->rccalm = 0;
+    codec_config(recorder->codeclist[recorder->venc], CODEC_CONFIG_SET_BITRATE, NULL, rate);
+done:
+    pthread_mutex_unlock(&recorder->mutex);
+}
+
+static int record_part(RECORDER *recorder, uint8_t *buf1, int len1, uint8_t *buf2, int len2, uint32_t *type, int64_t *pts, int64_t *dts) // return 1 with the frame type and times once its last part is in
+{
+    int      part = CODEC_VIDEO_PART(*type);
+    uint8_t *buf;
+    if (part == 'F') { // a frame still open lost its last part to a drop, start over
+        recorder->aulen  = 0;
+        recorder->auopen = 1;
+        recorder->autype = *type & ~CODEC_FOURCC(0, 0, 0xFF, 0);
+        recorder->aupts  = *pts;
+        recorder->audts  = *dts;
+    }
+    if (!recorder->auopen) return 0; // its first part was dropped
+    if (recorder->aulen + len1 + len2 > recorder->ausize) {
+        if (!(buf = realloc(recorder->aubuf, recorder->aulen + len1 + len2))) { recorder->auopen = 0; return 0; }
+        recorder->aubuf  = buf;
+        recorder->ausize = recorder->aulen + len1 + len2;
+    }
+    memcpy(recorder->aubuf + recorder->aulen, buf1, len1); recorder->aulen += len1;
+    if (len2) { memcpy(recorder->aubuf + recorder->aulen, buf2, len2); recorder->aulen += len2; }
+    if (part != 'L') return 0;
+    recorder->auopen = 0;
+    *type = recorder->autype;
+    *pts  = recorder->aupts;
+    *dts  = recorder->audts;
+    return 1;
+}
+
+static void record_close(RECORDER *recorder) // close the file and let go of the buffer
+{
+    if (recorder->muxer_ctxt) { recorder->muxer_exit(recorder->muxer_ctxt); recorder->muxer_ctxt = NULL; recorder->stats.recording = 0; }
+    if (recorder->reader >= 0) {
+        codec_settask  (recorder->codeclist[0], recorder->reader, NULL);
+        codec_delreader(recorder->codeclist[0], recorder->reader);
+        recorder->reader = -1;
+    }
+}
+
+static int record_step(RECORDER *recorder, int wait) // write one frame, return 1 if there was one, the record thread waits for it
 {
-    RECORDER *recorder = (RECORDER*)argv;
     char      filepath[273] = "";
-    void    (*muxer_exit )(void*) = (recorder->rectype == RECTYPE_AVI) ? avimuxer_exit : mp4muxer_exit;
-    void    (*muxer_video)(void*, unsigned char*, int, unsigned char*, int, int, unsigned) = (recorder->rectype == RECTYPE_AVI) ? avimuxer_video : mp4muxer_video;
-    void    (*muxer_audio)(void*, unsigned char*, int, unsigned char*, int, int, unsigned) = (recorder->rectype == RECTYPE_AVI) ? avimuxer_audio : mp4muxer_audio;
-    void     *muxer_ctxt = NULL;
     uint8_t  *buf1, *buf2;
-    int       len1,  len2, ret, i;
-    uint32_t  type, pts;
+    int       len1,  len2, ret, size, i, timeout, w, h;
+    uint32_t  type, us;
+    int64_t   pts, dts;
+    uint64_t  t;
 
-    while (!(recorder->flags & FLAG_EXIT)) {
-        if (!(recorder->flags & FLAG_START)) {
-            if (muxer_ctxt) { muxer_exit(muxer_ctxt); muxer_ctxt = NULL; }
-            recorder->starttick = 0; usleep(100*1000); continue;
+    if (wait) {
+        pthread_mutex_lock(&recorder->mutex); // idle until started, stopped after cleaning up, or exit
+        while (!(recorder->flags & (FLAG_EXIT|FLAG_START)) && !recorder->muxer_ctxt && recorder->reader < 0) pthread_cond_wait(&recorder->cond, &recorder->mutex);
+        pthread_mutex_unlock(&recorder->mutex);
+    }
+    if (recorder->flags & FLAG_EXIT) return 0;
+    if (!(recorder->flags & FLAG_START)) {
+        record_close(recorder);
+        recorder->starttick = 0; return 0;
+    }
+    if (recorder->reader < 0) {
+        if ((recorder->reader = codec_addreader(recorder->codeclist[0])) < 0) { // on the pool it is tried again on the next start
+            printf("ffrecorder no free reader on %s !\n", recorder->codeclist[0]->name);
+            if (wait) usleep(100*1000);
+            return 0;
         }
+        codec_settask(recorder->codeclist[0], recorder->reader, recorder->task); // kicked by every frame written for us
+    }
 
-        ret = codec_lockframe(recorder->codeclist[0], &buf1, &len1, &buf2, &len2, &type, &pts, 100);
-        if (ret > 0 && (recorder->flags & FLAG_NEXT) && IS_VIDEO_KEYFRAME(type)) { // if record stop or change to next record file
-            muxer_exit(muxer_ctxt); muxer_ctxt = NULL;
-            recorder->flags &= ~FLAG_NEXT;
-        }
-        if ((recorder->flags & FLAG_START) && ret > 0) { // if recorder started, and got video data
-            if (!muxer_ctxt && IS_VIDEO_KEYFRAME(type)) { // if muxer not created and this is video key frame
-                time_t     now= time(NULL);
-                struct tm *tm = localtime(&now);
-                snprintf(filepath, sizeof(filepath), "%s-%04d%02d%02d-%02d%02d%02d.%s", recorder->filename,
-                        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec,
-                        recorder->rectype == RECTYPE_AVI ? "avi" : "mp4");
-                if (recorder->rectype == RECTYPE_AVI) {
-                    muxer_ctxt = avimuxer_init(filepath, recorder->duration, recorder->width, recorder->height, recorder->fps, recorder->fps * 2, IS_VIDEO_H265_ENC(type), 0);
-                } else {
-                    muxer_ctxt = mp4muxer_init(filepath, recorder->duration, recorder->width, recorder->height, recorder->fps, recorder->fps * 2, IS_VIDEO_H265_ENC(type), recorder->channels, recorder->samprate, 16, 1024, recorder->aacinfo);
-                }
-                if (recorder->starttick == 0 && muxer_ctxt) {
-                    recorder->starttick = get_tick_count();
-                    recorder->starttick = recorder->starttick ? recorder->starttick : 1;
-                }
+    // on the pool nothing waits for the timeout, files are rotated on the first frame after it
+    timeout = !wait ? 0 : recorder->starttick ? MAX(1, recorder->duration - ((int32_t)get_tick_count() - (int32_t)recorder->starttick)) : -1; // wake up for the next file
+    ret = codec_lockframe_ex(recorder->codeclist[0], recorder->reader, &buf1, &len1, &buf2, &len2, &type, &pts, &dts, timeout);
+    if (g_trace_enabled && ret > 0) trace_stamp(TRACE_STREAM(type), pts, TRACE_LOCKFRAME, get_time_us());
+    size = ret;
+    if (ret > 0 && IS_VIDEO_FRAME(type) && CODEC_VIDEO_PART(type)) { // slice output of h264enc, mux it once whole
+        if (record_part(recorder, buf1, len1, buf2, len2, &type, &pts, &dts)) {
+            buf1 = recorder->aubuf; len1 = size = recorder->aulen;
+            buf2 = NULL;            len2 = 0;
+        } else size = 0;
+    }
+    if (size > 0 && recorder->muxer_ctxt && IS_VIDEO_KEYFRAME(type) && (CODEC_VIDEO_SCALE(type) != recorder->scale || CODEC_VIDEO_GEN(type) != recorder->gen)) { // encoder opened again, a file holds one size and one sps
+        printf("ffrecorder %s video scale %d -> %d, gen %d -> %d, next file\n", recorder->filename, recorder->scale, CODEC_VIDEO_SCALE(type), recorder->gen, CODEC_VIDEO_GEN(type));
+        recorder->flags |= FLAG_NEXT;
+    }
+    if (size > 0 && (recorder->flags & FLAG_NEXT) && IS_VIDEO_KEYFRAME(type)) { // if record stop or change to next record file
+        recorder->muxer_exit(recorder->muxer_ctxt); recorder->muxer_ctxt = NULL;
+        recorder->flags &= ~FLAG_NEXT;
+        recorder->stats.recording = 0;
+    }
+    if ((recorder->flags & FLAG_START) && size > 0) { // if recorder started, and got video data
+        if (!recorder->muxer_ctxt && IS_VIDEO_KEYFRAME(type)) { // if muxer not created and this is video key frame
+            time_t     now= time(NULL);
+            struct tm *tm = localtime(&now);
+            char       seq[16] = "";
+            recorder->openseq = now == recorder->opentime ? recorder->openseq + 1 : 0; // a new encoder stream may start a file in the same second
+            recorder->opentime= now;
+            if (recorder->openseq) snprintf(seq, sizeof(seq), "-%d", recorder->openseq);
+            snprintf(filepath, sizeof(filepath), "%s-%04d%02d%02d-%02d%02d%02d%s.%s", recorder->filename,
+                    tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, seq,
+                    recorder->rectype == RECTYPE_AVI ? "avi" : "mp4");
+            recorder->scale = CODEC_VIDEO_SCALE(type);
+            recorder->gen   = CODEC_VIDEO_GEN(type);
+            w = recorder->scale ? recorder->width  / 2 & ~1 : recorder->width;
+            h = recorder->scale ? recorder->height / 2 & ~1 : recorder->height;
+            if (recorder->rectype == RECTYPE_AVI) {
+                recorder->muxer_ctxt = avimuxer_init(filepath, recorder->duration, w, h, recorder->fps, recorder->fps * 2, IS_VIDEO_H265_ENC(type), 0);
+            } else {
+                recorder->muxer_ctxt = mp4muxer_init(filepath, recorder->duration, w, h, recorder->fps, recorder->fps * 2, IS_VIDEO_H265_ENC(type), recorder->channels, recorder->samprate, 16, 1024, recorder->aacinfo);
+            }
+            if (recorder->muxer_ctxt) {
+                recorder->stats.segments++;
+                recorder->stats.recording = 1;
+            }
+            if (recorder->starttick == 0 && recorder->muxer_ctxt) {
+                recorder->starttick = get_tick_count();
+                if (recorder->epoch && recorder->duration > 0) recorder->starttick -= (recorder->starttick - recorder->epoch) % recorder->duration; // the first file is cut short to line up
+                recorder->starttick = recorder->starttick ? recorder->starttick : 1;
             }
-            (IS_VIDEO_FRAME(type) ? muxer_video : muxer_audio)(muxer_ctxt, buf1, len1, buf2, len2, IS_VIDEO_KEYFRAME(type), pts);
         }
-        codec_unlockframe(recorder->codeclist[0], ret);
-
-        if (recorder->starttick && (int32_t)get_tick_count() - (int32_t)recorder->starttick >= recorder->duration) {
-            recorder->starttick += recorder->duration;
-            recorder->flags     |= FLAG_NEXT;
-            for (i=0; i<recorder->codecnum; i++) codec_config(recorder->codeclist[i], CODEC_CONFIG_REQUEST_IDR, NULL, 0);
+        t  = get_time_us();
+        if (IS_VIDEO_FRAME(type)) recorder->muxer_video(recorder->muxer_ctxt, buf1, len1, buf2, len2, IS_VIDEO_KEYFRAME(type), pts, dts);
+        else recorder->muxer_audio(recorder->muxer_ctxt, buf1, len1, buf2, len2, 0, pts);
+        us = (uint32_t)(get_time_us() - t);
+        if (g_trace_enabled && recorder->muxer_ctxt) trace_stamp(TRACE_STREAM(type), pts, TRACE_WRITTEN, t + us);
+        if (recorder->muxer_ctxt) {
+            recorder->stats.frames++;
+            recorder->stats.bytes  += size;
+            recorder->stats.mux_us += us;
+            recorder->stats.mux_max = MAX(recorder->stats.mux_max, us);
+        }
+        if (recorder->muxer_ctxt && recorder->reqtick) {
+            recorder->stats.firstbyte = (int32_t)get_tick_count() - (int32_t)recorder->reqtick;
+            recorder->reqtick = 0;
+            printf("ffrecorder %s first frame written %d ms after start\n", recorder->filename, recorder->stats.firstbyte);
         }
     }
-    muxer_exit(muxer_ctxt);
+    codec_unlockframe_r(recorder->codeclist[0], recorder->reader, ret);
+    record_ratectrl(recorder);
+
+    if (recorder->starttick && (int32_t)get_tick_count() - (int32_t)recorder->starttick >= recorder->duration) {
+        recorder->starttick += recorder->duration;
+        recorder->flags     |= FLAG_NEXT;
+        for (i=0; i<recorder->codecnum; i++) codec_config(recorder->codeclist[i], CODEC_CONFIG_REQUEST_IDR, NULL, 0);
+    }
+    return ret > 0;
+}
+
+static void* record_thread_proc(void *argv)
+{
+    RECORDER *recorder = (RECORDER*)argv;
+    while (!(recorder->flags & FLAG_EXIT)) record_step(recorder, 1);
+    record_close(recorder);
     return NULL;
 }
 
+static int record_task_run(void *ctxt)
+{
+    RECORDER *recorder = (RECORDER*)ctxt;
+    if (!(recorder->flags & FLAG_EXIT)) return record_step(recorder, 0);
+    record_close(recorder); // detach from the buffer here, so nothing kicks the task once worker_del has freed it
+    pthread_mutex_lock(&recorder->mutex);
+    recorder->flags |= FLAG_DONE;
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->mutex);
+    return 0;
+}
+
 void* ffrecorder_init(char *name, char *type, int duration, int channels, int samprate, int width, int height, int fps, void *codeclist, int codecnum)
 {
     int       i;
@@ -113,19 +296,28 @@ void* ffrecorder_init(char *name, char *type, int duration, int channels, int sa
     recorder->width    = width;
     recorder->height   = height;
     recorder->fps      = fps;
+    recorder->reader   = -1;
     recorder->codecnum = MIN(codecnum, MAX_CODEC_NUM);
+    pthread_mutex_init(&recorder->mutex, NULL);
+    pthread_cond_init (&recorder->cond , NULL);
     memcpy(recorder->codeclist, codeclist, recorder->codecnum * sizeof(void*));
     if (strcmp(type, "mp4") == 0) recorder->rectype = RECTYPE_MP4;
     if (strcmp(type, "avi") == 0) recorder->rectype = RECTYPE_AVI;
+    recorder->muxer_exit  = (recorder->rectype == RECTYPE_AVI) ? avimuxer_exit  : mp4muxer_exit;
+    recorder->muxer_video = (recorder->rectype == RECTYPE_AVI) ? avimuxer_video : mp4muxer_video;
+    recorder->muxer_audio = (recorder->rectype == RECTYPE_AVI) ? avimuxer_audio : mp4muxer_audio;
 
+    recorder->venc = -1;
     for (i=0; i<recorder->codecnum; i++) {
+        if (strcmp(recorder->codeclist[i]->name, "h264enc") == 0 && recorder->venc < 0) recorder->venc = i;
         if (strcmp(recorder->codeclist[i]->name, "aacenc") == 0) {
             memcpy(recorder->aacinfo, recorder->codeclist[i]->aacinfo, MIN(sizeof(recorder->aacinfo), sizeof(recorder->codeclist[i]->aacinfo)));
         }
     }
 
-    // create server thread
-    pthread_create(&recorder->pthread, NULL, record_thread_proc, recorder);
+    // run on the worker pool, or create server thread
+    recorder->task = worker_add(record_task_run, recorder, WORKER_PRIO_LOW); // muxing is only bounded by the buffer, encoders go first
+    if (!recorder->task) pthread_create(&recorder->pthread, NULL, record_thread_proc, recorder);
     return recorder;
 }
 
@@ -134,24 +326,91 @@ void ffrecorder_exit(void *ctxt)
     RECORDER *recorder = (RECORDER*)ctxt;
     if (!ctxt) return;
     ffrecorder_start(ctxt, 0);
+    pthread_mutex_lock(&recorder->mutex);
     recorder->flags |= FLAG_EXIT;
-    pthread_join(recorder->pthread, NULL);
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->mutex);
+    codec_wakeup(recorder->codeclist[0]);
+    if (recorder->task) {
+        worker_kick(recorder->task);
+        pthread_mutex_lock(&recorder->mutex);
+        while (!(recorder->flags & FLAG_DONE)) pthread_cond_wait(&recorder->cond, &recorder->mutex);
+        pthread_mutex_unlock(&recorder->mutex);
+        worker_del(recorder->task);
+    } else pthread_join(recorder->pthread, NULL);
+    pthread_mutex_destroy(&recorder->mutex);
+    pthread_cond_destroy (&recorder->cond );
+    free(recorder->aubuf);
     free(recorder);
 }
 
+void ffrecorder_ratectrl(void *ctxt, RECORDER_RATECTRL *rc)
+{
+    RECORDER   *recorder = (RECORDER*)ctxt;
+    CODEC_STATS cs;
+    int         i;
+    if (!recorder) return;
+    pthread_mutex_lock(&recorder->mutex); // record_ratectrl decides under it too
+    if (rc && rc->ceiling > 0 && recorder->venc >= 0 && recorder->ratectrl.ceiling) { // new bounds while running, the bitrate only moves if it is out of them now
+        recorder->ratectrl.floor    = MAX(1000, MIN(rc->floor, rc->ceiling));
+        recorder->ratectrl.ceiling  = rc->ceiling;
+        recorder->ratectrl.interval = rc->interval > 0 ? rc->interval : 1000;
+        i = MAX(recorder->ratectrl.floor, MIN(recorder->stats.bitrate, rc->ceiling));
+        if (i != recorder->stats.bitrate) codec_config(recorder->codeclist[recorder->venc], CODEC_CONFIG_SET_BITRATE, NULL, i);
+        recorder->stats.bitrate = i;
+    } else if (rc && rc->ceiling > 0 && recorder->venc >= 0) {
+        recorder->ratectrl = *rc;
+        recorder->ratectrl.floor    = MAX(1000, MIN(rc->floor, rc->ceiling));
+        recorder->ratectrl.interval = rc->interval > 0 ? rc->interval : 1000;
+        recorder->stats.bitrate     = rc->ceiling;
+        recorder->rctick = get_tick_count();
+        recorder->rccalm = 0;
+        recorder->rcmux  = recorder->stats.mux_us;
+        codec_getstats(recorder->codeclist[0], &cs); // only drops from now on count
+        for (recorder->rcdrops=0,i=0; i<CODEC_DROP_REASONS; i++) recorder->rcdrops += cs.drops[i];
+        codec_config(recorder->codeclist[recorder->venc], CODEC_CONFIG_SET_BITRATE, NULL, rc->ceiling);
+    } else {
+        memset(&recorder->ratectrl, 0, sizeof(recorder->ratectrl));
+        recorder->stats.bitrate = 0;
+    }
+    pthread_mutex_unlock(&recorder->mutex);
+}
+
+void ffrecorder_setepoch(void *ctxt, uint32_t epoch)
+{
+    RECORDER *recorder = (RECORDER*)ctxt;
+    if (recorder) recorder->epoch = epoch;
+}
+
+void ffrecorder_getstats(void *ctxt, RECORDER_STATS *stats)
+{
+    RECORDER *recorder = (RECORDER*)ctxt;
+    if (recorder && stats) *stats = recorder->stats;
+}
+
 void ffrecorder_start(void *ctxt, int start)
 {
     int       i;
     RECORDER *recorder = (RECORDER*)ctxt;
     if (!ctxt) return;
     if (start && !(recorder->flags & FLAG_START)) {
-        recorder->flags |= FLAG_START;
-        for (i=0; i<recorder->codecnum; i++) {
-            codec_config(recorder->codeclist[i], CODEC_CONFIG_CLEAR_BUFF|CODEC_CONFIG_REQUEST_IDR, NULL, 0);
+        for (i=0; i<recorder->codecnum; i++) { // a broadcast buffer is shared with other recorders, our reader starts from its newest frame anyway
+            codec_config(recorder->codeclist[i], ((recorder->codeclist[i]->mode & CODEC_MODE_BROADCAST) ? 0 : CODEC_CONFIG_CLEAR_BUFF)|CODEC_CONFIG_REQUEST_IDR, NULL, 0);
             codec_start (recorder->codeclist[i], 1);
         }
+        pthread_mutex_lock(&recorder->mutex); // cleared before the task is kicked, so it starts on the new frames
+        recorder->flags  |= FLAG_START;
+        recorder->reqtick = get_tick_count() | 1;
+        pthread_cond_signal(&recorder->cond);
+        pthread_mutex_unlock(&recorder->mutex);
+        worker_kick(recorder->task);
     } else if (!start && (recorder->flags & FLAG_START)) {
+        pthread_mutex_lock(&recorder->mutex);
         recorder->flags &=~FLAG_START;
+        pthread_cond_signal(&recorder->cond);
+        pthread_mutex_unlock(&recorder->mutex);
+        worker_kick(recorder->task); // closes the file
+        codec_wakeup(recorder->codeclist[0]); // the thread may be waiting for a frame
         for (i=0; i<recorder->codecnum; i++) {
             codec_start (recorder->codeclist[i], 0);
         }
@@ -1,8 +1,31 @@
 #ifndef __RECORDER_H__
 #define __RECORDER_H__
 
+#include <stdint.h>
+
+typedef struct {
+    uint32_t frames;    // frames written to muxer
+    uint64_t bytes;
+    uint32_t segments;  // files opened
+    uint64_t mux_us;    // time spent in muxer calls, divide by frames for per frame
+    uint32_t mux_max;
+    int      firstbyte; // ms from the last ffrecorder_start to the first frame written
+    int      recording; // muxer is open
+    int      bitrate;   // video bitrate the controller set last, 0 when it is off
+    uint32_t ratechanges; // times the controller changed it
+} RECORDER_STATS;
+
+typedef struct { // closed loop video bitrate, lowered when the buffer fills, drops or the muxer gets slow, raised again once all is calm
+    int floor;    // bits per second it never goes below
+    int ceiling;  // nor above, where it starts and returns to
+    int interval; // ms between checks, 1000 by default
+} RECORDER_RATECTRL;
+
 void* ffrecorder_init (char *name, char *type, int duration, int channels, int samprate, int width, int height, int fps, void *codeclist, int codecnum);
 void  ffrecorder_exit (void *ctxt);
 void  ffrecorder_start(void *ctxt, int start);
+void  ffrecorder_getstats(void *ctxt, RECORDER_STATS *stats); // snapshot without locking
+void  ffrecorder_ratectrl(void *ctxt, RECORDER_RATECTRL *rc); // NULL turns it off and leaves the bitrate where it is, calling it again while on only moves the bounds
+void  ffrecorder_setepoch(void *ctxt, uint32_t epoch); // get_tick_count() files are aligned to, takes effect on the next start
 
 #endif
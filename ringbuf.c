@@ -1,3 +1,8 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,3 +29,45 @@ int ringbuf_read(uint8_t *rbuf, int maxsize, int head, uint8_t *dst, int len)
     if (dst) memcpy(dst + len1, buf2, len2);
     return len2 ? len2 : head + len1;
 }
+
+#ifdef __linux__
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static uint8_t* mirror_map(int size, int huge)
+{
+    uint8_t *rbuf;
+    int      fd = memfd_create("ringbuf", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, size) != 0) { close(fd); return NULL; }
+    rbuf = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); // reserve address space for both views
+    if (rbuf != MAP_FAILED) {
+        if (  mmap(rbuf + 0   , size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+           || mmap(rbuf + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(rbuf, size * 2);
+            rbuf = MAP_FAILED;
+        }
+    }
+    close(fd);
+    return rbuf == MAP_FAILED ? NULL : rbuf;
+}
+
+uint8_t* ringbuf_mirror_alloc(int *size)
+{
+    int      pagesize = (int)sysconf(_SC_PAGESIZE);
+    uint8_t *rbuf;
+    if (*size >= HUGE_PAGE_SIZE) { // big rings go to huge pages when the system has some reserved
+        int hugesize = (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if ((rbuf = mirror_map(hugesize, 1))) { *size = hugesize; return rbuf; }
+    }
+    *size = (*size + pagesize - 1) / pagesize * pagesize;
+    return mirror_map(*size, 0);
+}
+
+void ringbuf_mirror_free(uint8_t *rbuf, int size)
+{
+    if (rbuf) munmap(rbuf, size * 2);
+}
+#else
+uint8_t* ringbuf_mirror_alloc(int *size) { return NULL; }
+void     ringbuf_mirror_free (uint8_t *rbuf, int size) {}
+#endif
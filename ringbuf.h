@@ -6,4 +6,9 @@
 int ringbuf_write(uint8_t *rbuf, int maxsize, int tail, uint8_t *src, int len);
 int ringbuf_read (uint8_t *rbuf, int maxsize, int head, uint8_t *dst, int len);
 
+// the returned memory of *size bytes is mapped twice back to back, so rbuf[i] and rbuf[i + *size] are the same byte.
+// *size is rounded up to page size (or huge page size if possible), return NULL if not supported on this system.
+uint8_t* ringbuf_mirror_alloc(int *size);
+void     ringbuf_mirror_free (uint8_t *rbuf, int size);
+
 #endif
@@ -0,0 +1,311 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "codec.h"
+#include "utils.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCALER_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    void    *next;
+    int      w, h;
+    int      fps;
+    int      filter;
+    int64_t  due; // pts of the next frame to keep
+    int      rem; // 1000000 % fps carried, so due stays exact over time
+} OUTPUT;
+
+typedef struct {
+    CODEC_COMMON_MEMBERS
+
+    int       vw, vh;
+    OUTPUT    outputs[SCALER_MAX_OUTPUTS];
+    int       n;
+    uint8_t  *src;     // frame the producer fills, reserved in next or buff when next is full
+    uint8_t  *half[2]; // halved planes ping pong
+    uint16_t *row;     // vertically interpolated source row, 7 bit fraction
+    int      *xpos;    // bilinear source position of every output column in 1/128
+} SCALER;
+
+// dst[x] is the 2x2 average of s0[2x], s0[2x+1], s1[2x], s1[2x+1]
+static void box2x_c(uint8_t *dst, uint8_t *s0, uint8_t *s1, int dw)
+{
+    int x;
+    for (x=0; x<dw; x++) dst[x] = (s0[2 * x] + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1] + 2) >> 2;
+}
+
+// dst[x] = s0[x] * (128 - fy) + s1[x] * fy
+static void vert_c(uint16_t *dst, uint8_t *s0, uint8_t *s1, int fy, int w)
+{
+    int x;
+    for (x=0; x<w; x++) dst[x] = s0[x] * (128 - fy) + s1[x] * fy;
+}
+
+#ifdef SCALER_X86
+__attribute__((target("sse2")))
+static void box2x_sse2(uint8_t *dst, uint8_t *s0, uint8_t *s1, int dw)
+{
+    __m128i m = _mm_set1_epi16(0xFF), two = _mm_set1_epi16(2), a, b, lo, hi;
+    int     x;
+    for (x=0; x+16<=dw; x+=16) {
+        a  = _mm_loadu_si128((__m128i*)(s0 + 2 * x));
+        b  = _mm_loadu_si128((__m128i*)(s1 + 2 * x));
+        lo = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, m), _mm_srli_epi16(a, 8)), _mm_add_epi16(_mm_and_si128(b, m), _mm_srli_epi16(b, 8)));
+        a  = _mm_loadu_si128((__m128i*)(s0 + 2 * x + 16));
+        b  = _mm_loadu_si128((__m128i*)(s1 + 2 * x + 16));
+        hi = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, m), _mm_srli_epi16(a, 8)), _mm_add_epi16(_mm_and_si128(b, m), _mm_srli_epi16(b, 8)));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+    }
+    box2x_c(dst + x, s0 + 2 * x, s1 + 2 * x, dw - x);
+}
+
+__attribute__((target("sse2")))
+static void vert_sse2(uint16_t *dst, uint8_t *s0, uint8_t *s1, int fy, int w)
+{
+    __m128i w0 = _mm_set1_epi16(128 - fy), w1 = _mm_set1_epi16(fy), z = _mm_setzero_si128(), a, b;
+    int     x;
+    for (x=0; x+16<=w; x+=16) {
+        a = _mm_loadu_si128((__m128i*)(s0 + x));
+        b = _mm_loadu_si128((__m128i*)(s1 + x));
+        _mm_storeu_si128((__m128i*)(dst + x + 0), _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, z), w0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, z), w1)));
+        _mm_storeu_si128((__m128i*)(dst + x + 8), _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, z), w0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, z), w1)));
+    }
+    vert_c(dst + x, s0 + x, s1 + x, fy, w - x);
+}
+
+__attribute__((target("avx2")))
+static void box2x_avx2(uint8_t *dst, uint8_t *s0, uint8_t *s1, int dw)
+{
+    __m256i m = _mm256_set1_epi16(0xFF), two = _mm256_set1_epi16(2), a, b, lo, hi;
+    int     x;
+    for (x=0; x+32<=dw; x+=32) {
+        a  = _mm256_loadu_si256((__m256i*)(s0 + 2 * x));
+        b  = _mm256_loadu_si256((__m256i*)(s1 + 2 * x));
+        lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a, m), _mm256_srli_epi16(a, 8)), _mm256_add_epi16(_mm256_and_si256(b, m), _mm256_srli_epi16(b, 8)));
+        a  = _mm256_loadu_si256((__m256i*)(s0 + 2 * x + 32));
+        b  = _mm256_loadu_si256((__m256i*)(s1 + 2 * x + 32));
+        hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a, m), _mm256_srli_epi16(a, 8)), _mm256_add_epi16(_mm256_and_si256(b, m), _mm256_srli_epi16(b, 8)));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8)); // packus works per 128 bit lane
+    }
+    box2x_c(dst + x, s0 + 2 * x, s1 + 2 * x, dw - x);
+}
+
+__attribute__((target("avx2")))
+static void vert_avx2(uint16_t *dst, uint8_t *s0, uint8_t *s1, int fy, int w)
+{
+    __m256i w0 = _mm256_set1_epi16(128 - fy), w1 = _mm256_set1_epi16(fy), a, b;
+    int     x;
+    for (x=0; x+16<=w; x+=16) {
+        a = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(s0 + x)));
+        b = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(s1 + x)));
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_add_epi16(_mm256_mullo_epi16(a, w0), _mm256_mullo_epi16(b, w1)));
+    }
+    vert_c(dst + x, s0 + x, s1 + x, fy, w - x);
+}
+#endif
+
+static void (*s_box2x)(uint8_t *dst, uint8_t *s0, uint8_t *s1, int dw) = box2x_c;
+static void (*s_vert )(uint16_t *dst, uint8_t *s0, uint8_t *s1, int fy, int w) = vert_c;
+
+static void scaler_dispatch(void)
+{
+#ifdef SCALER_X86
+    int flags = get_cpu_flags();
+    if (flags & CPU_FLAG_SSE2) { s_box2x = box2x_sse2; s_vert = vert_sse2; }
+    if (flags & CPU_FLAG_AVX2) { s_box2x = box2x_avx2; s_vert = vert_avx2; }
+#endif
+}
+
+static int bilinear_pos(int d, int sn, int dn) // source position of output d in 1/128, pixel centers aligned
+{
+    int p = (int)(((int64_t)(2 * d + 1) * sn * 64) / dn) - 64;
+    return MAX(p, 0);
+}
+
+static void bilinear(SCALER *sc, uint8_t *dst, int dw, int dh, uint8_t *src, int sw, int sh)
+{
+    int x, y, p, yi, fy, xi, fx;
+    for (x=0; x<dw; x++) {
+        p = bilinear_pos(x, sw, dw);
+        sc->xpos[x] = MIN(p, (sw - 1) << 7);
+    }
+    for (y=0; y<dh; y++) {
+        p  = bilinear_pos(y, sh, dh);
+        yi = MIN(p >> 7, sh - 1);
+        fy = yi < sh - 1 ? p & 127 : 0;
+        s_vert(sc->row, src + yi * sw, src + MIN(yi + 1, sh - 1) * sw, fy, sw);
+        sc->row[sw] = sc->row[sw - 1]; // last column reads one past with weight 0
+        for (x=0; x<dw; x++) {
+            xi = sc->xpos[x] >> 7;
+            fx = sc->xpos[x] - (xi << 7);
+            dst[y * dw + x] = (sc->row[xi] * (128 - fx) + sc->row[xi + 1] * fx + (1 << 13)) >> 14;
+        }
+    }
+}
+
+static void scale_plane(SCALER *sc, uint8_t *dst, int dw, int dh, uint8_t *src, int sw, int sh, int filter)
+{
+    uint8_t *out;
+    int      y, hw, hh;
+    while (filter == SCALER_BOX && sw / 2 >= dw && sh / 2 >= dh) { // each halving reads every source pixel once, no aliasing
+        hw  = sw / 2;
+        hh  = sh / 2;
+        out = (hw == dw && hh == dh) ? dst : (src == sc->half[0] ? sc->half[1] : sc->half[0]);
+        for (y=0; y<hh; y++) s_box2x(out + y * hw, src + 2 * y * sw, src + (2 * y + 1) * sw, hw);
+        src = out;
+        sw  = hw;
+        sh  = hh;
+    }
+    if (src == dst) return;
+    if (sw == dw && sh == dh) memcpy(dst, src, dw * dh);
+    else if (sw == 1 || sh == 1) for (y=0; y<dh; y++) memset(dst + y * dw, src[0], dw);
+    else bilinear(sc, dst, dw, dh, src, sw, sh);
+}
+
+static void scaler_output(SCALER *sc, OUTPUT *o, int64_t pts)
+{
+    uint8_t *buf1, *buf2;
+    int      len1 ,  len2, size = o->w * o->h * 3 / 2, period;
+    int64_t  diff;
+    if (o->fps) {
+        period = 1000000 / o->fps;
+        diff   = pts - o->due;
+        if (diff > period || diff < -2 * period) { o->due = pts; o->rem = 0; diff = 0; } // first frame, or fell a whole period behind, start over from now
+        if (diff < -period / 4) return; // a quarter period early still counts, capture pts jitter
+        o->rem += 1000000 % o->fps;
+        o->due += period + o->rem / o->fps;
+        o->rem %= o->fps;
+    }
+    if (codec_reserveframe(o->next, size, 0, &buf1, &len1, &buf2, &len2) <= 0) {
+        ATOMIC_ADD(&sc->drops[CODEC_DROP_FULL], 1);
+        return;
+    }
+    if (len2) { // scaling writes planes in place, needs them whole
+        codec_commitframe(o->next, -1, 0, pts);
+        ATOMIC_ADD(&sc->drops[CODEC_DROP_FULL], 1);
+        return;
+    }
+    scale_plane(sc, buf1, o->w, o->h, sc->src, sc->vw, sc->vh, o->filter);
+    scale_plane(sc, buf1 + o->w * o->h, o->w / 2, o->h / 2, sc->src + sc->vw * sc->vh, sc->vw / 2, sc->vh / 2, o->filter);
+    scale_plane(sc, buf1 + o->w * o->h * 5 / 4, o->w / 2, o->h / 2, sc->src + sc->vw * sc->vh * 5 / 4, sc->vw / 2, sc->vh / 2, o->filter);
+    codec_commitframe(o->next, size, 0, pts);
+    codec_stat_out(sc, 1, size);
+}
+
+static void scaler_free(void *ctxt)
+{
+    SCALER *sc = (SCALER*)ctxt;
+    pthread_mutex_destroy(&sc->mutex);
+    pthread_cond_destroy (&sc->cond );
+    free(sc->half[0]);
+    free(sc->row);
+    free(sc->xpos);
+    free(sc);
+}
+
+static int scaler_reserve(void *ctxt, int size, uint32_t type, uint8_t **ppbuf1, int *plen1, uint8_t **ppbuf2, int *plen2)
+{ // one producer thread, frame goes straight into next's input ring, buff takes it when next is full so outputs still get it
+    SCALER  *sc = (SCALER*)ctxt;
+    uint8_t *buf1, *buf2;
+    int      len1 ,  len2;
+    if (size != sc->vw * sc->vh * 3 / 2) return -1;
+    sc->src = sc->buff;
+    if (sc->next && codec_reserveframe(sc->next, size, type, &buf1, &len1, &buf2, &len2) > 0) {
+        if (len2) codec_commitframe(sc->next, -1, type, 0);
+        else sc->src = buf1;
+    }
+    if (ppbuf1) *ppbuf1 = sc->src;
+    if (plen1 ) *plen1  = size;
+    if (ppbuf2) *ppbuf2 = NULL;
+    if (plen2 ) *plen2  = 0;
+    return size;
+}
+
+static int scaler_commit(void *ctxt, int len, uint32_t type, int64_t pts)
+{
+    SCALER  *sc = (SCALER*)ctxt;
+    int      size = sc->vw * sc->vh * 3 / 2, i;
+    uint64_t t;
+    if (len < 0) {
+        if (sc->src != sc->buff) codec_commitframe(sc->next, -1, type, pts);
+        return 0;
+    }
+    if (!pts) pts = get_time_us();
+    if (sc->src != sc->buff) codec_commitframe(sc->next, size, type, pts); // next encodes meanwhile, it only reads the frame and nobody else reserves it
+    codec_stat_in(sc, 1, size);
+    t = get_time_us();
+    for (i=0; i<sc->n; i++) scaler_output(sc, &sc->outputs[i], pts);
+    codec_stat_encode(sc, (uint32_t)(get_time_us() - t));
+    return size;
+}
+
+static int scaler_writeraw(void *ctxt, uint8_t *buf, int len, int64_t pts)
+{
+    uint8_t *dst;
+    if (scaler_reserve(ctxt, len, 0, &dst, NULL, NULL, NULL) < 0) return -1;
+    memcpy(dst, buf, len);
+    return scaler_commit(ctxt, len, 0, pts);
+}
+
+static int scaler_writebuf(void *ctxt, uint8_t *buf, int len)
+{
+    return scaler_writeraw(ctxt, buf, len, 0);
+}
+
+static void scaler_config(void *ctxt, int flags, void *param1, uint32_t param2)
+{
+    SCALER *sc = (SCALER*)ctxt;
+    int     i;
+    if (sc->next) codec_config(sc->next, flags, param1, param2);
+    for (i=0; i<sc->n; i++) codec_config(sc->outputs[i].next, flags & (CODEC_CONFIG_CLEAR_BUFF|CODEC_CONFIG_REQUEST_IDR), param1, param2); // bitrate and the rest are per stream
+}
+
+void* scaler_init(void *next, int w, int h, SCALER_OUTPUT *outputs, int n)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    SCALER *sc;
+    int     i;
+    if (n < 0 || n > SCALER_MAX_OUTPUTS || w < 2 || h < 2 || (w & 1) || (h & 1)) return NULL;
+    for (i=0; i<n; i++) {
+        if (!outputs[i].next || outputs[i].w < 2 || outputs[i].h < 2 || (outputs[i].w & 1) || (outputs[i].h & 1) || outputs[i].w > w || outputs[i].h > h || outputs[i].fps < 0) {
+            printf("scaler output %d %dx%d invalid for %dx%d source !\n", i, outputs[i].w, outputs[i].h, w, h);
+            return NULL;
+        }
+    }
+    pthread_once(&once, scaler_dispatch);
+    if (!(sc = codec_init("scaler", sizeof(SCALER), w * h * 3 / 2, next))) return NULL;
+    sc->half[0] = malloc((w / 2) * (h / 2) * 2);
+    sc->half[1] = sc->half[0] + (w / 2) * (h / 2);
+    sc->row     = malloc((w + 1) * sizeof(uint16_t));
+    sc->xpos    = malloc(w * sizeof(int));
+    sc->free     = scaler_free;
+    sc->writebuf = scaler_writebuf;
+    sc->writeraw = scaler_writeraw;
+    sc->config   = scaler_config;
+    sc->reserve  = scaler_reserve;
+    sc->commit   = scaler_commit;
+    if (!sc->half[0] || !sc->row || !sc->xpos) {
+        scaler_free(sc);
+        return NULL;
+    }
+    sc->vw = w;
+    sc->vh = h;
+    sc->n  = n;
+    for (i=0; i<n; i++) {
+        sc->outputs[i].next   = outputs[i].next;
+        sc->outputs[i].w      = outputs[i].w;
+        sc->outputs[i].h      = outputs[i].h;
+        sc->outputs[i].fps    = outputs[i].fps;
+        sc->outputs[i].filter = outputs[i].filter;
+    }
+    return sc;
+}
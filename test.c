@@ -6,16 +6,25 @@
 #include <pthread.h>
 #include <time.h>
 #include "codec.h"
-#include "font25x48.h"
 #include "recorder.h"
+#include "recmgr.h"
+#include "trace.h"
+#include "worker.h"
 #include "utils.h"
 
 typedef struct {
     CODEC    *codeclist[4];
+    CODEC    *osd;     // capture goes through it to the scaler with the time drawn in
+    CODEC    *scaler;  // capture goes through it to h264enc and to the sub stream
+    CODEC    *subenc;  // 320x240 at 12 fps for live view
+    CODEC    *live;    // sub stream frames a live view client would read
     void     *recorder;
     #define FLAG_EXIT (1 << 0)
     uint32_t  flags;
     pthread_t thread;
+    uint32_t  writes;    // producer side latency of handing video frames to h264enc, reserve + commit without drawing
+    uint64_t  write_us;
+    uint32_t  write_max;
 } TESTCTXT;
 
 static void gen_sin_wav(int16_t *pcm, int n, int samprate, int freq)
@@ -30,36 +39,190 @@ static void* thread_proc(void *param)
     int32_t   tick_sleep= 0;
     uint16_t  counter   = 0;
     int16_t   abuf[8000 / 25] = {0};
-    uint8_t   vbuf[640 * 480 * 3 / 2] = {0};
+    uint8_t  *vbuf, *buf1, *buf2;
+    int       vlen, len1, len2, size;
+    uint32_t  type;
+    int64_t   pts, captured;
     char      str [256];
+    uint64_t  t, us;
 
     gen_sin_wav(abuf, sizeof(abuf)/sizeof(int16_t)/2, 8000, 500);
     while (!(test->flags & FLAG_EXIT)) {
         time_t     now= time(NULL);
         struct tm *tm = localtime(&now);
         snprintf(str, sizeof(str), "%04d-%02d-%02d %02d:%02d:%02d %d", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, counter++);
-        memset(vbuf, 0, sizeof(vbuf));
-        watermark_putstring(vbuf, 640, 10, 20, str);
 
         tick_sleep = (int32_t)tick_next - (int32_t)get_tick_count();
         tick_next += 40;
 
-        codec_writebuf(test->codeclist[2], (uint8_t*)abuf, sizeof(abuf));
-        codec_writebuf(test->codeclist[3], (uint8_t*)vbuf, sizeof(vbuf));
+        codec_writeraw(test->codeclist[2], (uint8_t*)abuf, sizeof(abuf), 0); // pcm just captured, pts of later frames goes by sample count
+        t = captured = get_time_us();
+        osd_settext(test->osd, 0, 10, 20, 48, 255, str); // only the characters that changed render again
+        if (codec_reserveframe(test->osd, 640 * 480 * 3 / 2, 0, &vbuf, &vlen, NULL, NULL) > 0) { // capture fills the frame right in h264enc's input ring, here it stays as the zeroed ring and the opaque box covers the old time
+            us = get_time_us() - t;
+            t  = get_time_us();
+            codec_commitframe(test->osd, vlen, 0, captured);
+            us+= get_time_us() - t;
+            test->writes++;
+            test->write_us += us;
+            test->write_max = MAX(test->write_max, (uint32_t)us);
+        }
+
+        while ((size = codec_lockframe(test->live, &buf1, &len1, &buf2, &len2, &type, &pts, 0)) > 0) codec_unlockframe(test->live, size); // no live view client here
+
+        if (tick_sleep > 0) usleep(tick_sleep * 1000);
+    }
+    return NULL;
+}
 
+static void benchmark(int w, int h, int bitrate)
+{ // ./test bench [w h [bitrate]], what each x264 setting costs on this machine
+    static H264ENC_PARAMS settings[] = {
+        { 1, 0, 0, 0, "ultrafast", "zerolatency", "baseline" },
+        { 0, H264ENC_THREADS_SLICED, 0, 0 , "ultrafast", "zerolatency", "baseline" },
+        { 0, H264ENC_THREADS_FRAME , 0, 0 , "ultrafast", "zerolatency", "baseline" },
+        { 0, H264ENC_THREADS_SLICED, 0, 0 , "veryfast" , "zerolatency", "main"     },
+        { 0, H264ENC_THREADS_FRAME , 0, 10, "veryfast" , ""           , "main"     },
+        { 0, H264ENC_THREADS_FRAME , 0, 40, "medium"   , ""           , "high"     },
+    };
+    H264ENC_BENCH bench;
+    int           i;
+    printf("benchmark %dx%d %d bps, 300 frames each\n", w, h, bitrate);
+    for (i=0; i<(int)(sizeof(settings)/sizeof(settings[0])); i++) {
+        H264ENC_PARAMS *p = &settings[i];
+        if (h264enc_benchmark(bitrate, 25, w, h, p, 300, &bench) < 0) continue;
+        printf("%-9s %-11s %-8s threads: %2d %-6s lookahead: %2d  fps: %7.1f  latency avg: %7u us  max: %7u us\n",
+            p->preset, p->tune[0] ? p->tune : "-", p->profile, bench.threads,
+            p->threading == H264ENC_THREADS_FRAME ? "frame" : "sliced", p->lookahead, bench.fps, bench.latency_avg, bench.latency_max);
+    }
+    h264enc_calibrate(bitrate, 25, w, h, 1, NULL); // what a pool worker picks for one stream of this size
+}
+
+static void* multi_capture_proc(void *param)
+{ // every camera at 25 fps, frames are the same gray picture and a 500 Hz tone
+    void     *mgr = ((void**)param)[0];
+    uint32_t *flags = ((void**)param)[1];
+    static uint8_t vbuf[640 * 480 * 3 / 2];
+    int16_t   abuf[8000 / 25];
+    uint32_t  tick_next = get_tick_count() + 40;
+    int32_t   tick_sleep;
+    int       i;
+    memset(vbuf, 128, sizeof(vbuf));
+    gen_sin_wav(abuf, sizeof(abuf)/sizeof(int16_t), 8000, 500);
+    while (!(*flags & FLAG_EXIT)) {
+        tick_sleep = (int32_t)tick_next - (int32_t)get_tick_count();
+        tick_next += 40;
+        for (i=0; i<RECMGR_MAX_CHANNELS; i++) { // removed channels just return -1
+            recmgr_audio(mgr, i, (uint8_t*)abuf, sizeof(abuf), 0);
+            recmgr_video(mgr, i, vbuf, sizeof(vbuf), 0);
+        }
         if (tick_sleep > 0) usleep(tick_sleep * 1000);
     }
     return NULL;
 }
 
-int main(void)
+static void multichannel(int n)
+{ // ./test multi [n], n cameras recorded by one process
+    RECMGR_CHANNEL chan = { NULL, "mp4", 60000, 640, 480, 25, 512000, 8000, 1, 32000, 0, 128000 };
+    RECMGR_STATS   ms;
+    void     *mgr = recmgr_init(0, 16 * 1024 * 1024), *param[2];
+    uint32_t  flags = 0;
+    pthread_t thread;
+    char      name[32], cmd[256];
+    int       i;
+    recmgr_calibrate(mgr, &chan, n);
+    for (i=0; i<n; i++) {
+        snprintf(name, sizeof(name), "cam%02d", i);
+        chan.name = name;
+        recmgr_add(mgr, &chan);
+    }
+    recmgr_start(mgr, -1, 1);
+    param[0] = mgr; param[1] = &flags;
+    pthread_create(&thread, NULL, multi_capture_proc, param);
+    while (scanf("%255s", cmd) == 1) {
+        if (strcmp(cmd, "stats") == 0) {
+            recmgr_getstats(mgr, -1, &ms);
+            printf("channels: %d recording: %d frames: %u bytes: %llu segments: %u mux max: %u us bitrate: %d/%u target: %d venc: %u/%u frames drops: %u encode max: %u us ring: %d/%d\n",
+                ms.channels, ms.rec.recording, ms.rec.frames, (unsigned long long)ms.rec.bytes, ms.rec.segments, ms.rec.mux_max, ms.rec.bitrate, ms.rec.ratechanges, ms.target,
+                ms.venc.frames_out, ms.venc.frames_in, ms.buffer.drops[0] + ms.buffer.drops[1] + ms.buffer.drops[2] + ms.buffer.drops[3] + ms.buffer.drops[4],
+                ms.venc.encode_max, ms.buffer.cursize, ms.buffer.maxsize);
+        } else if (strcmp(cmd, "disk") == 0 && scanf("%d", &i) == 1) { // disk <bps>, 0 for no limit
+            recmgr_diskrate(mgr, i);
+        } else if (strcmp(cmd, "add") == 0) {
+            snprintf(name, sizeof(name), "cam%02d", n++);
+            chan.name = name;
+            if ((i = recmgr_add(mgr, &chan)) >= 0) recmgr_start(mgr, i, 1);
+        } else if (strcmp(cmd, "quit") == 0 || strcmp(cmd, "exit") == 0) {
+            break;
+        }
+    }
+    flags |= FLAG_EXIT;
+    pthread_join(thread, NULL);
+    recmgr_exit(mgr);
+}
+
+static int bframes(int n)
+{ // ./test bframes [n], a b-frame channel recorded for n seconds, every frame h264enc puts out has to be muxed, exit code 1 if not
+    static uint8_t vbuf[320 * 240 * 3 / 2];
+    RECMGR_CHANNEL chan = { "bframes", "mp4", 60000, 320, 240, 25, 256000 };
+    RECMGR_STATS   ms;
+    void          *mgr = recmgr_init(0, 0);
+    uint32_t       drops;
+    int            i, ok;
+    chan.bframes = 2;
+    if (recmgr_add(mgr, &chan) < 0) {
+        recmgr_exit(mgr);
+        return 1;
+    }
+    recmgr_start(mgr, -1, 1);
+    for (i=0; i<n * 25; i++) {
+        memset(vbuf, i * 7, sizeof(vbuf)); // something changes every frame
+        recmgr_video(mgr, 0, vbuf, sizeof(vbuf), 0);
+        usleep(40 * 1000);
+    }
+    usleep(1000 * 1000); // the recorder catches up with the ring
+    recmgr_getstats(mgr, 0, &ms);
+    drops = ms.buffer.drops[0] + ms.buffer.drops[1] + ms.buffer.drops[2] + ms.buffer.drops[3] + ms.buffer.drops[4];
+    ok    = ms.rec.frames + drops == ms.venc.frames_out && ms.venc.frames_out > 0;
+    printf("bframes: encoded %u muxed %u dropped %u, %s\n", ms.venc.frames_out, ms.rec.frames, drops, ok ? "ok" : "frames missing !");
+    recmgr_exit(mgr);
+    return !ok;
+}
+
+int main(int argc, char *argv[])
 {
     TESTCTXT test = {0};
+    CODEC   *all [8];
+    SCALER_OUTPUT sub = {0};
+    H264ENC_PARAMS subp = {0};
     int      i;
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        benchmark(argc > 3 ? atoi(argv[2]) : 1920, argc > 3 ? atoi(argv[3]) : 1080, argc > 4 ? atoi(argv[4]) : 4000000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "multi") == 0) {
+        multichannel(argc > 2 ? atoi(argv[2]) : 4);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bframes") == 0) return bframes(argc > 2 ? atoi(argv[2]) : 4);
+    if (argc > 1 && strcmp(argv[1], "pool") == 0) worker_init(argc > 2 ? atoi(argv[2]) : 0); // encoders and recorder as tasks on shared workers
     test.codeclist[0] = codec_init  ("buffer", sizeof(CODEC), 512 * 1024, NULL);
+    codec_config(test.codeclist[0], CODEC_CONFIG_SET_MODE, NULL, CODEC_MODE_MPSC|CODEC_MODE_MIRROR); // h264enc and aacenc both write to it
+    codec_config(test.codeclist[0], CODEC_CONFIG_SET_POLICY, NULL, CODEC_POLICY_DROP_NONREF|CODEC_POLICY_AUDIO_LAST); // keep audio going when the disk stalls
     test.codeclist[1] = alawenc_init(0, test.codeclist[0]);
     test.codeclist[2] = aacenc_init (0, test.codeclist[0], 32000 , 8000, 1);
     test.codeclist[3] = h264enc_init(0, test.codeclist[0], 512000, 25, 640, 480);
+    test.live         = codec_init  ("live", sizeof(CODEC), 256 * 1024, NULL);
+    subp.slices       = 4;
+    subp.sliceout     = 1; // a live view client gets each slice as it is encoded, not a frame later
+    test.subenc       = h264enc_init_ex(0, test.live, 128000, 12, 320, 240, &subp);
+    sub.next          = test.subenc;
+    sub.w             = 320;
+    sub.h             = 240;
+    sub.fps           = 12;
+    test.scaler       = scaler_init (test.codeclist[3], 640, 480, &sub, 1);
+    test.osd          = osd_init    (test.scaler, 640, 480);
+    codec_start(test.subenc, 1);
     test.recorder= ffrecorder_init("test", "mp4", 60000, 1, 8000, 640, 480, 25, test.codeclist, 4);
     ffrecorder_start(test.recorder, 1);
 
@@ -70,6 +233,31 @@ int main(void)
             ffrecorder_start(test.recorder, 1);
         } else if (strcmp(cmd, "stop") == 0) {
             ffrecorder_start(test.recorder, 0);
+        } else if (strcmp(cmd, "stats") == 0) {
+            CODEC_STATS    cs;
+            RECORDER_STATS rs;
+            memcpy(all, test.codeclist, sizeof(test.codeclist));
+            all[4] = test.scaler;
+            all[5] = test.subenc;
+            all[6] = test.live;
+            all[7] = test.osd;
+            for (i=0; i<8; i++) {
+                codec_getstats(all[i], &cs);
+                printf("%-8s in: %u/%llu out: %u/%llu drops: %u %u %u %u %u ring: %d/%d/%d lockwait: %llu/%u us encode: %llu/%u us\n", all[i]->name,
+                    cs.frames_in, (unsigned long long)cs.bytes_in, cs.frames_out, (unsigned long long)cs.bytes_out,
+                    cs.drops[0], cs.drops[1], cs.drops[2], cs.drops[3], cs.drops[4], cs.cursize, cs.highwater, cs.maxsize,
+                    (unsigned long long)cs.lockwait_us, cs.lockwait_max, (unsigned long long)cs.encode_us, cs.encode_max);
+            }
+            ffrecorder_getstats(test.recorder, &rs);
+            printf("recorder frames: %u bytes: %llu segments: %u mux: %llu/%u us firstbyte: %d ms recording: %d bitrate: %d/%u\n",
+                rs.frames, (unsigned long long)rs.bytes, rs.segments, (unsigned long long)rs.mux_us, rs.mux_max, rs.firstbyte, rs.recording, rs.bitrate, rs.ratechanges);
+            printf("producer frames: %u write: %llu/%u us (avg/max)\n", test.writes,
+                (unsigned long long)(test.writes ? test.write_us / test.writes : 0), test.write_max);
+        } else if (strcmp(cmd, "trace") == 0) {
+            trace_enable(10000);
+        } else if (strcmp(cmd, "report") == 0) {
+            trace_report();
+            printf("trace.json: %d frames\n", trace_export("trace.json"));
         } else if (strcmp(cmd, "quit") == 0 || strcmp(cmd, "exit") == 0) {
             test.flags |= FLAG_EXIT; break;
         }
@@ -78,6 +266,11 @@ int main(void)
 
     ffrecorder_start(test.recorder, 0);
     ffrecorder_exit(test.recorder);
+    codec_free(test.osd   );
+    codec_free(test.scaler);
+    codec_free(test.subenc);
+    codec_free(test.live  );
     for (i=3; i>=0; i--) codec_free(test.codeclist[i]);
+    worker_exit();
     return 0;
 }
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "trace.h"
+#include "utils.h"
+
+#define TRACE_SLOTS   1024 // frames in flight, power of 2
+#define TRACE_BUCKETS 128  // 4 buckets for every power of 2 of microseconds
+
+enum { SPAN_QUEUE, SPAN_ENCODE, SPAN_BUFFER, SPAN_MUX, SPAN_TOTAL, SPAN_NUM };
+static const char *s_span_names[SPAN_NUM] = { "queue", "encode", "buffer", "mux", "total" };
+static const int   s_span_points[SPAN_NUM][2] = {
+    { TRACE_CAPTURE     , TRACE_ENCODE_START },
+    { TRACE_ENCODE_START, TRACE_ENCODE_END   },
+    { TRACE_ENCODE_END  , TRACE_LOCKFRAME    },
+    { TRACE_LOCKFRAME   , TRACE_WRITTEN      },
+    { TRACE_CAPTURE     , TRACE_WRITTEN      },
+};
+
+typedef struct {
+    uint32_t stream;
+    int64_t  pts;
+    uint64_t us[TRACE_POINTS]; // 0 if the frame did not pass that point
+} TRACE_FRAME;
+
+static struct {
+    pthread_mutex_t mutex;
+    uint64_t        start;
+    TRACE_FRAME     slots[TRACE_SLOTS];
+    uint32_t        hist [SPAN_NUM][TRACE_BUCKETS];
+    uint32_t        max  [SPAN_NUM];
+    TRACE_FRAME    *events;
+    int             maxevents;
+    uint32_t        nevents;
+} s_trace = { PTHREAD_MUTEX_INITIALIZER };
+
+volatile int g_trace_enabled = 0;
+
+static int us_to_bucket(uint32_t us)
+{
+    int e;
+    if (us < 4) return us;
+    for (e=2; e < 31 && (us >> (e + 1)) != 0; e++);
+    return MIN(TRACE_BUCKETS - 1, 4 * (e - 1) + ((us >> (e - 2)) & 3));
+}
+
+static uint32_t bucket_to_us(int b) // upper bound of bucket, within 25%
+{
+    int e = b / 4 + 1;
+    if (b < 4) return b;
+    return ((uint32_t)(4 + b % 4 + 1) << (e - 2)) - 1;
+}
+
+static uint32_t percentile(uint32_t *hist, uint32_t total, int pct)
+{
+    uint32_t n = 0, need = (uint32_t)((uint64_t)total * pct / 100);
+    int      i;
+    for (i=0; i<TRACE_BUCKETS; i++) {
+        n += hist[i];
+        if (n > need || n == total) return bucket_to_us(i);
+    }
+    return 0;
+}
+
+void trace_enable(int maxevents)
+{
+    pthread_mutex_lock(&s_trace.mutex);
+    g_trace_enabled = 0;
+    free(s_trace.events);
+    memset(s_trace.slots, 0, sizeof(s_trace.slots));
+    memset(s_trace.hist , 0, sizeof(s_trace.hist ));
+    memset(s_trace.max  , 0, sizeof(s_trace.max  ));
+    s_trace.events    = maxevents > 0 ? calloc(maxevents, sizeof(TRACE_FRAME)) : NULL;
+    s_trace.maxevents = s_trace.events ? maxevents : 0;
+    s_trace.nevents   = 0;
+    s_trace.start     = get_time_us();
+    g_trace_enabled   = maxevents > 0;
+    pthread_mutex_unlock(&s_trace.mutex);
+}
+
+static void trace_done(TRACE_FRAME *f) // mutex held, frame is on disk
+{
+    uint32_t us;
+    int      i;
+    for (i=0; i<SPAN_NUM; i++) {
+        if (!f->us[s_span_points[i][0]] || !f->us[s_span_points[i][1]]) continue;
+        us = (uint32_t)MAX(0, (int64_t)(f->us[s_span_points[i][1]] - f->us[s_span_points[i][0]])); // stamped from different threads, may be out of order
+        s_trace.hist[i][us_to_bucket(us)]++;
+        s_trace.max [i] = MAX(s_trace.max[i], us);
+    }
+    if (s_trace.maxevents) s_trace.events[s_trace.nevents++ % s_trace.maxevents] = *f;
+    memset(f, 0, sizeof(TRACE_FRAME));
+}
+
+void trace_stamp(uint32_t stream, int64_t pts, int point, uint64_t us)
+{
+    TRACE_FRAME *f;
+    if (!g_trace_enabled || point < 0 || point >= TRACE_POINTS) return;
+    pthread_mutex_lock(&s_trace.mutex);
+    f = &s_trace.slots[((uint32_t)pts * 31 + stream) & (TRACE_SLOTS - 1)];
+    if (f->stream != stream || f->pts != pts) { // a frame which never reached disk is overwritten
+        memset(f, 0, sizeof(TRACE_FRAME));
+        f->stream = stream;
+        f->pts    = pts;
+    }
+    f->us[point] = us ? us : 1;
+    if (point == TRACE_WRITTEN) trace_done(f);
+    pthread_mutex_unlock(&s_trace.mutex);
+}
+
+void trace_report(void)
+{
+    uint32_t total;
+    int      i, j;
+    pthread_mutex_lock(&s_trace.mutex);
+    for (i=0; i<SPAN_NUM; i++) {
+        for (total=0,j=0; j<TRACE_BUCKETS; j++) total += s_trace.hist[i][j];
+        printf("trace %-6s frames: %6u  p50: %8u us  p99: %8u us  max: %8u us\n", s_span_names[i], total,
+            MIN(percentile(s_trace.hist[i], total, 50), s_trace.max[i]), MIN(percentile(s_trace.hist[i], total, 99), s_trace.max[i]), s_trace.max[i]);
+    }
+    pthread_mutex_unlock(&s_trace.mutex);
+}
+
+int trace_export(char *file)
+{
+    FILE        *fp;
+    TRACE_FRAME *f;
+    uint32_t     n, k;
+    int          i, first = 1;
+    if (!(fp = fopen(file, "w"))) return -1;
+    pthread_mutex_lock(&s_trace.mutex);
+    fprintf(fp, "{\"traceEvents\":[\n");
+    n = MIN(s_trace.nevents, (uint32_t)s_trace.maxevents);
+    for (k=s_trace.nevents-n; k!=s_trace.nevents; k++) {
+        f = &s_trace.events[k % s_trace.maxevents];
+        for (i=0; i<SPAN_NUM - 1; i++) { // async begin/end pairs, frames overlap each other in the pipeline, total is the whole row
+            if (!f->us[s_span_points[i][0]] || !f->us[s_span_points[i][1]] || f->us[s_span_points[i][0]] < s_trace.start) continue;
+            fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%c\",\"ph\":\"b\",\"pid\":1,\"id\":\"%c%lld\",\"ts\":%llu,\"args\":{\"pts\":%lld}},\n", first ? "" : ",\n",
+                s_span_names[i], (char)f->stream, (char)f->stream, (long long)f->pts, (unsigned long long)(f->us[s_span_points[i][0]] - s_trace.start), (long long)f->pts);
+            fprintf(fp, "{\"name\":\"%s\",\"cat\":\"%c\",\"ph\":\"e\",\"pid\":1,\"id\":\"%c%lld\",\"ts\":%llu}",
+                s_span_names[i], (char)f->stream, (char)f->stream, (long long)f->pts, (unsigned long long)(f->us[s_span_points[i][1]] - s_trace.start));
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    pthread_mutex_unlock(&s_trace.mutex);
+    fclose(fp);
+    return n;
+}
@@ -0,0 +1,32 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { // points a frame passes from capture to disk
+    TRACE_CAPTURE,      // raw data captured, the pts given to the encoder
+    TRACE_ENCODE_START,
+    TRACE_ENCODE_END,
+    TRACE_LOCKFRAME,    // recorder took it from the buffer
+    TRACE_WRITTEN,      // muxer has written it to file
+    TRACE_POINTS,
+};
+
+#define TRACE_STREAM(type) ((char)(type) == 'V' ? 'v' : (char)(type)) // key and non-key video frames are one stream
+
+extern volatile int g_trace_enabled; // checked before taking any timestamp, so tracing costs nothing when off
+
+void trace_enable (int maxevents); // keep the last maxevents frames for trace_export, 0 turns tracing off
+void trace_stamp  (uint32_t stream, int64_t pts, int point, uint64_t us); // us is get_time_us() at that point
+void trace_report (void); // print p50/p99/max latency of every stage
+int  trace_export (char *file); // write the frames kept in chrome trace event json, open it with chrome://tracing
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,5 +10,33 @@ uint32_t get_tick_count(void)
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
 }
+
+uint64_t get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#else
+uint64_t get_time_us(void)
+{
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+}
 #endif
 
+
+int get_cpu_flags(void)
+{
+    int flags = 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) flags |= CPU_FLAG_SSE2;
+    if (__builtin_cpu_supports("avx2")) flags |= CPU_FLAG_AVX2;
+    if (__builtin_cpu_supports("ssse3")) flags |= CPU_FLAG_SSSE3;
+#endif
+    if (getenv("FFRECORDER_NOSIMD")) flags &= ~atoi(getenv("FFRECORDER_NOSIMD")); // mask out flags to compare kernels
+    return flags;
+}
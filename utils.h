@@ -11,10 +11,34 @@
 #include <unistd.h>
 uint32_t get_tick_count(void);
 #endif
+uint64_t get_time_us(void); // monotonic microseconds, for measuring short durations and the clock of every pts
+
+#define CPU_FLAG_SSE2  (1 << 0)
+#define CPU_FLAG_AVX2  (1 << 1)
+#define CPU_FLAG_SSSE3 (1 << 2)
+int get_cpu_flags(void); // CPU_FLAG_XXX simd kernels may use, 0 on other architectures
 
 #define ARRAY_SIZE(a)  (sizeof(a) / sizeof(a[0]))
 #define ALIGN(x, y)    ((x + y - 1) & ~(y - 1))
 #define MIN(a, b)      ((a) < (b) ? (a) : (b))
 #define MAX(a, b)      ((a) > (b) ? (a) : (b))
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL         __declspec(thread)
+#define ATOMIC_LOAD(p)       (*(p))
+#define ATOMIC_STORE(p, v)   (*(p) = (v))
+#define ATOMIC_FENCE()       MemoryBarrier()
+#define ATOMIC_CAS(p, o, n)  (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(n), (LONG)*(o)) == (LONG)*(o))
+#define ATOMIC_ADD(p, v)     (InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v)) + (v))
+#define ATOMIC_ADD64(p, v)   (InterlockedExchangeAdd64((volatile LONGLONG*)(p), (LONGLONG)(v)) + (v))
+#else
+#define THREAD_LOCAL         __thread
+#define ATOMIC_LOAD(p)       __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v)   __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_FENCE()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(p, o, n)  __atomic_compare_exchange_n(p, o, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define ATOMIC_ADD(p, v)     __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_ADD64(p, v)   __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+#endif
+
 #endif
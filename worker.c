@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "worker.h"
+#include "utils.h"
+
+#define WORKER_MAX 64
+
+enum { TASK_IDLE, TASK_QUEUED, TASK_RUNNING, TASK_AGAIN, TASK_DEAD }; // AGAIN is running and kicked meanwhile, it goes back in a queue when done
+
+typedef struct TASK {
+    struct TASK *next;
+    int        (*run)(void *ctxt);
+    void        *ctxt;
+    volatile int32_t prio;
+    volatile int32_t state;
+    volatile int32_t dead; // worker_del is waiting for it
+    int          home;     // worker it is queued on, the last one which ran it so its data is still in that cache
+} TASK;
+
+typedef struct { // tasks queued on one worker, others steal from it when they run out
+    pthread_mutex_t mutex;
+    TASK           *head[WORKER_PRIOS];
+    TASK           *tail[WORKER_PRIOS];
+    pthread_t       thread;
+    uint8_t         pad[64]; // keep the mutexes of workers off each other's cache lines
+} QUEUE;
+
+static struct {
+    QUEUE            queues[WORKER_MAX];
+    int              num;
+    volatile int32_t exit;
+    volatile int32_t queued; // tasks in all queues
+    volatile int32_t idle;   // workers asleep on cond
+    uint32_t         next;   // home of the next new task, round robin
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;   // idle workers sleep on it
+    pthread_cond_t   done;   // worker_del waits on it
+} s_pool;
+
+static void task_push(TASK *t)
+{
+    QUEUE *q = &s_pool.queues[t->home];
+    int    p = t->prio;
+    t->next  = NULL;
+    ATOMIC_ADD(&s_pool.queued, 1); // counted first, so it never goes below 0 when a worker takes it at once
+    pthread_mutex_lock(&q->mutex);
+    if (q->tail[p]) q->tail[p]->next = t;
+    else            q->head[p] = t;
+    q->tail[p] = t;
+    pthread_mutex_unlock(&q->mutex);
+    ATOMIC_FENCE(); // pairs with the fence in worker_proc, only take the mutex if some worker is really idle
+    if (ATOMIC_LOAD(&s_pool.idle)) {
+        pthread_mutex_lock(&s_pool.mutex);
+        pthread_cond_signal(&s_pool.cond);
+        pthread_mutex_unlock(&s_pool.mutex);
+    }
+}
+
+static TASK* task_take(int self) // own queue first, then steal, all workers drain a priority before any lower one
+{
+    QUEUE *q;
+    TASK  *t;
+    int    p, i;
+    for (p=0; p<WORKER_PRIOS; p++) {
+        for (i=0; i<s_pool.num; i++) {
+            q = &s_pool.queues[(self + i) % s_pool.num];
+            if (!q->head[p]) continue; // racy peek, saves the lock on empty queues
+            pthread_mutex_lock(&q->mutex);
+            if ((t = q->head[p])) {
+                q->head[p] = t->next;
+                if (!q->head[p]) q->tail[p] = NULL;
+            }
+            pthread_mutex_unlock(&q->mutex);
+            if (t) {
+                ATOMIC_ADD(&s_pool.queued, -1);
+                t->home = self;
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void* worker_proc(void *param)
+{
+    int     self = (int)(intptr_t)param, ret;
+    int32_t state;
+    TASK   *t;
+    while (!ATOMIC_LOAD(&s_pool.exit)) {
+        if (!(t = task_take(self))) {
+            pthread_mutex_lock(&s_pool.mutex);
+            ATOMIC_ADD(&s_pool.idle, 1);
+            ATOMIC_FENCE(); // a task queued meanwhile is counted in queued, or its pusher sees us idle and signals
+            while (!ATOMIC_LOAD(&s_pool.queued) && !ATOMIC_LOAD(&s_pool.exit)) pthread_cond_wait(&s_pool.cond, &s_pool.mutex);
+            ATOMIC_ADD(&s_pool.idle, -1);
+            pthread_mutex_unlock(&s_pool.mutex);
+            continue;
+        }
+        ATOMIC_STORE(&t->state, TASK_RUNNING);
+        ret = ATOMIC_LOAD(&t->dead) ? 0 : t->run(t->ctxt);
+        if (ATOMIC_LOAD(&t->dead)) {
+            pthread_mutex_lock(&s_pool.mutex);
+            ATOMIC_STORE(&t->state, TASK_DEAD);
+            pthread_cond_broadcast(&s_pool.done);
+            pthread_mutex_unlock(&s_pool.mutex);
+            continue;
+        }
+        state = TASK_RUNNING;
+        if (ret > 0 || !ATOMIC_CAS(&t->state, &state, TASK_IDLE)) { // more to do, or kicked while running, back of the queue so other tasks get their turn
+            ATOMIC_STORE(&t->state, TASK_QUEUED);
+            task_push(t);
+        }
+    }
+    return NULL;
+}
+
+int worker_init(int threads)
+{
+    int i;
+    if (s_pool.num) return s_pool.num;
+#ifndef WIN32
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    threads = MAX(1, MIN(threads, WORKER_MAX));
+    pthread_mutex_init(&s_pool.mutex, NULL);
+    pthread_cond_init (&s_pool.cond , NULL);
+    pthread_cond_init (&s_pool.done , NULL);
+    s_pool.exit = 0;
+    for (i=0; i<threads; i++) {
+        pthread_mutex_init(&s_pool.queues[i].mutex, NULL);
+        memset(s_pool.queues[i].head, 0, sizeof(s_pool.queues[i].head));
+        memset(s_pool.queues[i].tail, 0, sizeof(s_pool.queues[i].tail));
+    }
+    s_pool.num = threads; // workers look at every queue
+    for (i=0; i<threads; i++) pthread_create(&s_pool.queues[i].thread, NULL, worker_proc, (void*)(intptr_t)i);
+    printf("worker pool of %d threads started\n", threads);
+    return threads;
+}
+
+void worker_exit(void)
+{
+    int i, n = s_pool.num;
+    if (!n) return;
+    pthread_mutex_lock(&s_pool.mutex);
+    ATOMIC_STORE(&s_pool.exit, 1);
+    pthread_cond_broadcast(&s_pool.cond);
+    pthread_mutex_unlock(&s_pool.mutex);
+    for (i=0; i<n; i++) pthread_join(s_pool.queues[i].thread, NULL);
+    for (i=0; i<n; i++) pthread_mutex_destroy(&s_pool.queues[i].mutex);
+    pthread_mutex_destroy(&s_pool.mutex);
+    pthread_cond_destroy (&s_pool.cond );
+    pthread_cond_destroy (&s_pool.done );
+    s_pool.num = 0;
+}
+
+void* worker_add(int (*run)(void *ctxt), void *ctxt, int prio)
+{
+    TASK *t;
+    if (!s_pool.num || !run || !(t = calloc(1, sizeof(TASK)))) return NULL;
+    t->run  = run;
+    t->ctxt = ctxt;
+    t->prio = MAX(0, MIN(prio, WORKER_PRIOS - 1));
+    t->home = ATOMIC_ADD(&s_pool.next, 1) % s_pool.num;
+    return t; // idle until the first kick
+}
+
+void worker_del(void *task)
+{
+    TASK *t = (TASK*)task;
+    if (!t) return;
+    ATOMIC_STORE(&t->dead, 1);
+    worker_kick(t); // a worker takes it off the queues and marks it dead instead of running it
+    pthread_mutex_lock(&s_pool.mutex);
+    while (ATOMIC_LOAD(&t->state) != TASK_DEAD) pthread_cond_wait(&s_pool.done, &s_pool.mutex);
+    pthread_mutex_unlock(&s_pool.mutex);
+    free(t);
+}
+
+void worker_kick(void *task)
+{
+    TASK   *t = (TASK*)task;
+    int32_t s;
+    if (!t) return;
+    while (1) { // lost a race with the worker, look again
+        s = ATOMIC_LOAD(&t->state);
+        if (s == TASK_IDLE    && ATOMIC_CAS(&t->state, &s, TASK_QUEUED)) { task_push(t); return; }
+        if (s == TASK_RUNNING && ATOMIC_CAS(&t->state, &s, TASK_AGAIN )) return;
+        if (s != TASK_IDLE && s != TASK_RUNNING) return; // queued, kicked already or dead
+    }
+}
+
+void worker_setprio(void *task, int prio)
+{
+    TASK *t = (TASK*)task;
+    if (t) ATOMIC_STORE(&t->prio, MAX(0, MIN(prio, WORKER_PRIOS - 1)));
+}
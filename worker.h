@@ -0,0 +1,33 @@
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { // tasks of a higher priority always run first, on any worker
+    WORKER_PRIO_HIGH,
+    WORKER_PRIO_NORMAL,
+    WORKER_PRIO_LOW,
+    WORKER_PRIOS,
+};
+
+// shared pool of encode and mux workers, without it every encoder and recorder runs its own thread.
+// codecs and recorders created after worker_init run as tasks on the pool, the ones created before keep their threads.
+int   worker_init   (int threads); // 0 for one worker per core, return workers started
+void  worker_exit   (void); // free every codec and recorder running on the pool first
+
+// a task is run by one worker at a time, again and again while run returns > 0, then it sleeps until kicked.
+// run must not block for long, it holds a worker meanwhile.
+void* worker_add    (int (*run)(void *ctxt), void *ctxt, int prio); // NULL if the pool is not running, the caller starts a thread instead
+void  worker_del    (void *task); // wait for a running task to return, it never runs again
+void  worker_kick   (void *task); // input has arrived, cheap when the task is queued or running already, NULL is ignored
+void  worker_setprio(void *task, int prio); // WORKER_PRIO_XXX, takes effect the next time it is queued
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif